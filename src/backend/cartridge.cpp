@@ -0,0 +1,416 @@
+#include <algorithm>
+#include <iostream>
+#include <tuple>
+
+#include "cartridge.h"
+
+Cartridge::Cartridge(std::shared_ptr<const RomImage> rom, Scheduler &scheduler, const std::string &savePath):
+rom(std::move(rom)), scheduler(scheduler), romBankCount(std::max<size_t>(this->rom->size() / romBankSize, 1))
+{
+    // Cartridge header
+    const uint8 cartridgeType = this->rom->size() > 0x149 ? this->rom->data()[0x147] : 0;
+    const uint8 ramSizeCode = this->rom->size() > 0x149 ? this->rom->data()[0x149] : 0;
+
+    switch (cartridgeType)
+    {
+        case 0x00: case 0x08: case 0x09:
+            type = Controller::None;
+            break;
+        case 0x05: case 0x06:
+            type = Controller::MBC2;
+            break;
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            type = Controller::MBC3;
+            break;
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            type = Controller::MBC5;
+            break;
+        default:
+            type = Controller::MBC1;
+            break;
+    }
+
+    if (type == Controller::MBC2)
+    {
+        // Built-in 512 half-bytes
+        ramSize = 0x200;
+    }
+    else
+    {
+        static constexpr std::array<size_t, 6> ramSizes = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+        ramSize = ramSizeCode < ramSizes.size() ? ramSizes[ramSizeCode] : 0;
+    }
+
+    bool battery = false;
+    switch (cartridgeType)
+    {
+        case 0x03: case 0x06: case 0x09: case 0x0F: case 0x10: case 0x13: case 0x1B: case 0x1E:
+            battery = true;
+            break;
+        default:
+            break;
+    }
+
+    if (battery && ramSize > 0 && !savePath.empty())
+    {
+        try
+        {
+            saveFile = std::make_unique<SaveFile>(savePath, ramSize);
+            ram = saveFile->data();
+            dirtyPages.resize((ramSize + pageSize - 1) / pageSize, false);
+        }
+        catch (const std::exception &exception)
+        {
+            std::cerr << "Cartridge RAM will not be saved: " << exception.what() << std::endl;
+        }
+    }
+    if (saveFile == nullptr)
+    {
+        volatileRAM.resize(ramSize, 0xFF);
+        ram = volatileRAM.data();
+    }
+
+    // Without a controller, there is no register to enable RAM: it is always accessible
+    ramEnabled = type == Controller::None;
+
+    updateBanks();
+}
+
+bool Cartridge::writeControl(uint16 address, uint8 value)
+{
+    const auto mapping = [this]
+    {
+        return std::make_tuple(romBank0Offset, romBankNOffset, selectedRAMBank(), isRTCSelected());
+    };
+    const auto previousMapping = mapping();
+
+    switch (type)
+    {
+        case Controller::None:
+            return false;
+
+        case Controller::MBC1:
+            if (address < 0x2000)
+            {
+                ramEnabled = (value & 0x0Fu) == 0x0A;
+            }
+            else if (address < 0x4000)
+            {
+                romBank = std::max(value & 0x1Fu, 1u);
+            }
+            else if (address < 0x6000)
+            {
+                ramBank = value & 0x03u;
+            }
+            else
+            {
+                advancedBanking = value & 0x01u;
+            }
+            break;
+
+        case Controller::MBC2:
+            // Bit 8 of the address select the register
+            if (address < 0x4000)
+            {
+                if (address & 0x100u)
+                {
+                    romBank = std::max(value & 0x0Fu, 1u);
+                }
+                else
+                {
+                    ramEnabled = (value & 0x0Fu) == 0x0A;
+                }
+            }
+            break;
+
+        case Controller::MBC3:
+            if (address < 0x2000)
+            {
+                ramEnabled = (value & 0x0Fu) == 0x0A;
+            }
+            else if (address < 0x4000)
+            {
+                romBank = std::max(value & 0x7Fu, 1u);
+            }
+            else if (address < 0x6000)
+            {
+                ramBank = value;
+            }
+            else
+            {
+                if (rtc.latchWrite == 0x00 && value == 0x01)
+                {
+                    latchRTC();
+                }
+                rtc.latchWrite = value;
+            }
+            break;
+
+        case Controller::MBC5:
+            if (address < 0x2000)
+            {
+                ramEnabled = (value & 0x0Fu) == 0x0A;
+            }
+            else if (address < 0x3000)
+            {
+                romBank = (romBank & 0x100u) | value;
+            }
+            else if (address < 0x4000)
+            {
+                romBank = (romBank & 0xFFu) | ((value & 0x01u) << 8u);
+            }
+            else if (address < 0x6000)
+            {
+                ramBank = value & 0x0Fu;
+            }
+            break;
+    }
+
+    updateBanks();
+    return mapping() != previousMapping;
+}
+
+void Cartridge::updateBanks()
+{
+    size_t bank0 = 0;
+    size_t bankN = 1;
+    switch (type)
+    {
+        case Controller::None:
+            break;
+        case Controller::MBC1:
+            bankN = (ramBank << 5u) | romBank;
+            bank0 = advancedBanking ? ramBank << 5u : 0;
+            break;
+        case Controller::MBC2:
+        case Controller::MBC3:
+        case Controller::MBC5:
+            bankN = romBank;
+            break;
+    }
+
+    romBank0Offset = (bank0 % romBankCount) * romBankSize;
+    romBankNOffset = (bankN % romBankCount) * romBankSize;
+}
+
+uint8 *Cartridge::selectedRAMBank()
+{
+    if (!ramEnabled || ramSize == 0 || isRTCSelected())
+    {
+        return nullptr;
+    }
+
+    size_t bank = 0;
+    switch (type)
+    {
+        case Controller::MBC1:
+            bank = advancedBanking ? ramBank : 0;
+            break;
+        case Controller::MBC3:
+            bank = ramBank & 0x03u;
+            break;
+        case Controller::MBC5:
+            bank = ramBank;
+            break;
+        default:
+            break;
+    }
+
+    // Small RAMs are mirrored
+    return ram + (bank * ramBankSize) % ramSize;
+}
+
+uint8 *Cartridge::selectedRAMPage(uint16 address)
+{
+    uint8 *bank = selectedRAMBank();
+    if (bank == nullptr)
+    {
+        return nullptr;
+    }
+    return bank + (address - 0xA000u) % std::min(ramSize, ramBankSize);
+}
+
+const uint8 *Cartridge::ramReadPage(uint16 address)
+{
+    return selectedRAMPage(address);
+}
+
+uint8 *Cartridge::ramWritePage(uint16 address)
+{
+    // MBC2 RAM only store the lower half of each byte
+    if (type == Controller::MBC2)
+    {
+        return nullptr;
+    }
+
+    uint8 *page = selectedRAMPage(address);
+    if (page == nullptr)
+    {
+        return nullptr;
+    }
+
+    // Catch the first write to a clean page to mark it dirty
+    if (saveFile != nullptr && !dirtyPages[ramPageIndex(page)])
+    {
+        return nullptr;
+    }
+    return page;
+}
+
+uint8 Cartridge::readRAM(uint16 address)
+{
+    if (ramEnabled && isRTCSelected())
+    {
+        return rtc.latched[ramBank - rtcFirstRegister];
+    }
+
+    const uint8 *page = ramReadPage(address & ~(pageSize - 1));
+    return page != nullptr ? page[address & (pageSize - 1)] : 0xFF;
+}
+
+bool Cartridge::writeRAM(uint16 address, uint8 value)
+{
+    if (!ramEnabled)
+    {
+        return false;
+    }
+
+    if (isRTCSelected())
+    {
+        updateRTC();
+        switch (ramBank)
+        {
+            case 0x08:
+                rtc.seconds = value;
+                // Writing seconds resets the sub-second counter
+                rtc.cycles = 0;
+                break;
+            case 0x09:
+                rtc.minutes = value;
+                break;
+            case 0x0A:
+                rtc.hours = value;
+                break;
+            case 0x0B:
+                rtc.days = (rtc.days & 0x100u) | value;
+                break;
+            case 0x0C:
+                rtc.days = (rtc.days & 0xFFu) | ((value & rtcDayHighBits.dayHigh) << 8u);
+                rtc.halted = value & rtcDayHighBits.halt;
+                rtc.dayCarry = value & rtcDayHighBits.dayCarry;
+                break;
+            default:
+                break;
+        }
+        rtc.latched[ramBank - rtcFirstRegister] = value;
+        return false;
+    }
+
+    if (type == Controller::MBC2)
+    {
+        ram[address & 0x1FFu] = value | 0xF0u;
+        if (saveFile != nullptr)
+        {
+            // Never mapped for writes: nothing to map again
+            dirtyPages[ramPageIndex(ram + (address & 0x1FFu))] = true;
+        }
+        return false;
+    }
+
+    uint8 *page = selectedRAMPage(address & ~(pageSize - 1));
+    if (page == nullptr)
+    {
+        return false;
+    }
+    page[address & (pageSize - 1)] = value;
+
+    if (saveFile == nullptr)
+    {
+        return false;
+    }
+    const size_t index = ramPageIndex(page);
+    const bool wasClean = !dirtyPages[index];
+    dirtyPages[index] = true;
+    return wasClean;
+}
+
+bool Cartridge::flushRAM()
+{
+    if (saveFile == nullptr)
+    {
+        return false;
+    }
+
+    // Runs of consecutive dirty pages
+    std::vector<SaveFile::Range> ranges;
+    for (size_t index = 0; index < dirtyPages.size(); ++index)
+    {
+        if (!dirtyPages[index])
+        {
+            continue;
+        }
+        dirtyPages[index] = false;
+
+        const size_t offset = index * pageSize;
+        const size_t length = std::min(pageSize, ramSize - offset);
+        if (!ranges.empty() && ranges.back().offset + ranges.back().length == offset)
+        {
+            ranges.back().length += length;
+        }
+        else
+        {
+            ranges.push_back({offset, length});
+        }
+    }
+
+    if (ranges.empty())
+    {
+        return false;
+    }
+    saveFile->flush(ranges);
+    return true;
+}
+
+void Cartridge::updateRTC()
+{
+    const uint64 now = scheduler.now();
+    const uint64 elapsed = now - rtc.lastUpdate;
+    rtc.lastUpdate = now;
+    if (rtc.halted)
+    {
+        return;
+    }
+
+    rtc.cycles += elapsed;
+    uint64 carry = rtc.cycles / cyclesPerSecond;
+    rtc.cycles %= cyclesPerSecond;
+    if (carry == 0)
+    {
+        return;
+    }
+
+    carry += rtc.seconds;
+    rtc.seconds = carry % 60;
+    carry = carry / 60 + rtc.minutes;
+    rtc.minutes = carry % 60;
+    carry = carry / 60 + rtc.hours;
+    rtc.hours = carry % 24;
+    carry = carry / 24 + rtc.days;
+    if (carry > 0x1FF)
+    {
+        rtc.dayCarry = true;
+    }
+    rtc.days = carry & 0x1FFu;
+}
+
+void Cartridge::latchRTC()
+{
+    updateRTC();
+    rtc.latched = {
+        rtc.seconds,
+        rtc.minutes,
+        rtc.hours,
+        static_cast<uint8>(rtc.days & 0xFFu),
+        static_cast<uint8>((rtc.days >> 8u) | (rtc.halted ? rtcDayHighBits.halt : 0) | (rtc.dayCarry ? rtcDayHighBits.dayCarry : 0))
+    };
+}
@@ -0,0 +1,213 @@
+#ifndef FRACTAL_CARTRIDGE_H
+#define FRACTAL_CARTRIDGE_H
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../general.h"
+#include "../files/rom_registry.h"
+#include "../files/save_file.h"
+#include "scheduler.h"
+
+/**
+ * Game cartridge: ROM, external RAM and the memory bank controller (MBC) switching their banks.
+ *
+ * The controller is picked from the header byte 0x147: none, MBC1, MBC2, MBC3 (with its real time
+ * clock) or MBC5. Unknown controllers are driven as MBC1.
+ *
+ * It does not serve accesses itself. It tells VirtualMemory where each page of the cartridge
+ * address space (0x0000 to 0x7FFF and 0xA000 to 0xBFFF) currently points, and VirtualMemory updates
+ * its page table each time a write to the controller registers changes it.
+ * Only accesses which can not be served by a pointer (RTC registers, MBC2 RAM writes, disabled RAM)
+ * go through `readRAM` / `writeRAM`.
+ *
+ * Banks numbers are masked to the real ROM and RAM sizes.
+ *
+ * RAM of cartridges with a battery lives in a save file mapped in memory (see SaveFile), so it
+ * survives the emulator. Written pages are tracked, 256 bytes at a time: a clean page is not mapped
+ * for writes, so its first write goes through `writeRAM` which marks it dirty and asks to map it.
+ * `flushRAM` hands dirty pages to the save file, and cleans them again.
+ */
+class Cartridge
+{
+public:
+    /**
+     * @param savePath Save file of battery-backed RAM. If empty, or if the cartridge has no battery, RAM is lost on exit.
+     */
+    explicit Cartridge(std::shared_ptr<const RomImage> rom, Scheduler &scheduler, const std::string &savePath);
+
+    // No copy
+    Cartridge(const Cartridge&) = delete;
+    Cartridge& operator=(const Cartridge&) = delete;
+
+    enum class Controller
+    {
+        None,
+        MBC1,
+        MBC2,
+        MBC3,
+        MBC5
+    };
+
+    [[nodiscard]] Controller controller() const { return type; }
+
+    /**
+     * Is RAM persisted in a save file?
+     */
+    [[nodiscard]] bool hasSaveFile() const { return saveFile != nullptr; }
+
+    /**
+     * Offset in the ROM file of the byte read at `address`, from 0x0000 to 0x7FFF, with current banks applied.
+     */
+    [[nodiscard]] size_t romOffset(uint16 address) const
+    {
+        return address < 0x4000 ? romBank0Offset + address : romBankNOffset + (address - 0x4000u);
+    }
+
+    /**
+     * Memory read by the page starting at `address` of external RAM (0xA000 to 0xBFFF),
+     * or nullptr if reads must go through `readRAM`.
+     */
+    [[nodiscard]] const uint8 *ramReadPage(uint16 address);
+
+    /**
+     * Memory written by the page starting at `address` of external RAM (0xA000 to 0xBFFF),
+     * or nullptr if writes must go through `writeRAM`.
+     */
+    [[nodiscard]] uint8 *ramWritePage(uint16 address);
+
+    /**
+     * Write to the controller registers (0x0000 to 0x7FFF).
+     * @return Did banks mapping change? If so, pages must be mapped again.
+     */
+    bool writeControl(uint16 address, uint8 value);
+
+    [[nodiscard]] uint8 readRAM(uint16 address);
+
+    /**
+     * @return Did a page become dirty? If so, pages must be mapped again so later writes to it are direct.
+     */
+    bool writeRAM(uint16 address, uint8 value);
+
+    /**
+     * Write dirty RAM pages to the save file, in the background.
+     * @return Were some pages dirty? If so, pages must be mapped again so their next write is caught.
+     */
+    bool flushRAM();
+
+private:
+    const std::shared_ptr<const RomImage> rom;
+    Scheduler &scheduler;
+
+    Controller type = Controller::None;
+
+    static constexpr size_t romBankSize = 0x4000;
+    static constexpr size_t ramBankSize = 0x2000;
+    static constexpr size_t pageSize = 0x100;
+
+    size_t romBankCount;
+
+    /**
+     * External RAM. For MBC2, 512 half-bytes stored with their upper half high, so they can be read directly.
+     * It points either in `volatileRAM` or in `saveFile`.
+     */
+    uint8 *ram = nullptr;
+    size_t ramSize = 0;
+
+    std::vector<uint8> volatileRAM;
+    std::unique_ptr<SaveFile> saveFile;
+
+    /**
+     * One bit per RAM page written since the last flush. Only used with a save file.
+     */
+    std::vector<bool> dirtyPages;
+
+    // Offsets of the banks mapped at 0x0000 and 0x4000, already masked
+    size_t romBank0Offset = 0;
+    size_t romBankNOffset = romBankSize;
+
+    // Controller registers
+    bool ramEnabled = false;
+    // ROM bank number as written, up to 9 bits (MBC5)
+    uint16 romBank = 1;
+    // MBC1 upper bits, MBC3 RAM bank or RTC register, MBC5 RAM bank
+    uint8 ramBank = 0;
+    // MBC1 banking mode: if set, `ramBank` also select the ROM bank mapped at 0x0000 and the RAM bank
+    bool advancedBanking = false;
+
+    /**
+     * Compute banks offsets from the controller registers.
+     */
+    void updateBanks();
+
+    /**
+     * RAM bank currently selected, or nullptr if RAM is not accessible directly.
+     */
+    [[nodiscard]] uint8 *selectedRAMBank();
+
+    /**
+     * Page starting at `address` of the selected RAM bank, or nullptr if RAM is not accessible directly.
+     * Unlike `ramWritePage`, it is returned even if clean.
+     */
+    [[nodiscard]] uint8 *selectedRAMPage(uint16 address);
+
+    /**
+     * Index in `dirtyPages` of the RAM page starting at `page`.
+     */
+    [[nodiscard]] size_t ramPageIndex(const uint8 *page) const
+    {
+        return static_cast<size_t>(page - ram) / pageSize;
+    }
+
+    /**
+     * MBC3 real time clock.
+     * It counts emulated time (cycles), not the host time, so it stays in sync with the game however
+     * fast the emulator runs.
+     */
+    struct
+    {
+        uint8 seconds = 0;
+        uint8 minutes = 0;
+        uint8 hours = 0;
+        uint16 days = 0;
+        bool halted = false;
+        bool dayCarry = false;
+
+        // Cycles counted in the current second
+        uint64 cycles = 0;
+        // Clock of the last update
+        uint64 lastUpdate = 0;
+
+        // Registers copied by a latch, which the game reads
+        std::array<uint8, 5> latched {};
+        // Last value written to the latch register: a write of 0 then 1 latches
+        uint8 latchWrite = 0xFF;
+    } rtc;
+
+    static constexpr uint64 cyclesPerSecond = 4194304;
+
+    static constexpr uint8 rtcFirstRegister = 0x08;
+    static constexpr uint8 rtcLastRegister = 0x0C;
+
+    const struct
+    {
+        const uint8 dayHigh = 1u << 0u;
+        const uint8 halt = 1u << 6u;
+        const uint8 dayCarry = 1u << 7u;
+    } rtcDayHighBits;
+
+    [[nodiscard]] bool isRTCSelected() const
+    {
+        return type == Controller::MBC3 && ramBank >= rtcFirstRegister && ramBank <= rtcLastRegister;
+    }
+
+    /**
+     * Move the clock forward to the current emulated time.
+     */
+    void updateRTC();
+    void latchRTC();
+};
+
+#endif //FRACTAL_CARTRIDGE_H
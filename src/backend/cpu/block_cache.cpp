@@ -0,0 +1,300 @@
+#include <algorithm>
+
+#include "block_cache.h"
+#include "cpu.h"
+
+/**
+ * Length in bytes of each opcode. 0 for opcodes which can not be cached (unknown opcodes and STOP).
+ */
+static constexpr std::array<uint8, 256> instructionLengths =
+{{
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x0_
+    0, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x1_
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x2_
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x3_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x4_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x5_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x6_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x7_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x8_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x9_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB_
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xC_
+    1, 1, 3, 0, 3, 1, 2, 1, 1, 1, 3, 0, 3, 0, 2, 1, // 0xD_
+    2, 1, 1, 0, 0, 1, 2, 1, 2, 1, 3, 0, 0, 0, 2, 1, // 0xE_
+    2, 1, 1, 1, 0, 1, 2, 1, 2, 1, 3, 1, 0, 0, 2, 1, // 0xF_
+}};
+
+/**
+ * Does the opcode end a basic block? True for every instruction which may not continue to the next one:
+ * jumps, calls, returns, restarts and halt.
+ */
+static constexpr bool endsBlock(const uint8 opcode)
+{
+    switch (opcode)
+    {
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+        case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // RET, RETI
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+        case 0x76: // HALT
+            return true;
+        default:
+            return false;
+    }
+}
+
+BlockCache::Block *BlockCache::find(const uint16 PC)
+{
+    if (memory.hasWrittenCodePages())
+    {
+        forgetWrittenCode();
+    }
+
+    // Protect working RAM before decoding from it, so its code offset is valid
+    const bool inWorkingRAM = PC >= 0xC000 && PC < 0xE000;
+    if (inWorkingRAM)
+    {
+        memory.protectCode(PC);
+    }
+
+    const int32 codeOffset = memory.codeOffset(PC);
+    if (codeOffset < 0)
+    {
+        return nullptr;
+    }
+
+    Storage &storage = inWorkingRAM ? workingRAMStorages[(PC - 0xC000) / pageSize] : romStorage;
+    uint32 &index = indexOf(codeOffset);
+    if (index == 0)
+    {
+        const Block block = decode(PC, codeOffset, storage);
+        if (block.count == 0)
+        {
+            return nullptr;
+        }
+        storage.blocks.push_back(block);
+        index = storage.blocks.size();
+    }
+
+    return &storage.blocks[index - 1];
+}
+
+uint32 &BlockCache::indexOf(const uint32 codeOffset)
+{
+    if (codeOffset >= VirtualMemory::workingRAMCodeOffset)
+    {
+        return workingRAMBlockIndexes[codeOffset - VirtualMemory::workingRAMCodeOffset];
+    }
+
+    const uint32 bank = codeOffset / bankSize;
+    if (bank >= blockIndexes.size())
+    {
+        blockIndexes.resize(bank + 1);
+    }
+    if (!blockIndexes[bank])
+    {
+        blockIndexes[bank] = std::make_unique<std::array<uint32, bankSize>>();
+        blockIndexes[bank]->fill(0);
+    }
+    return (*blockIndexes[bank])[codeOffset % bankSize];
+}
+
+void BlockCache::forgetWrittenCode()
+{
+    const uint32 pages = memory.takeWrittenCodePages();
+    for (uint32 page = 0; page < workingRAMPageCount; ++page)
+    {
+        if (pages & (1u << page))
+        {
+            workingRAMStorages[page].blocks.clear();
+            workingRAMStorages[page].microOps.clear();
+            const auto first = workingRAMBlockIndexes.begin() + page * pageSize;
+            std::fill(first, first + pageSize, 0);
+        }
+    }
+}
+
+BlockCache::Block BlockCache::decode(uint16 PC, uint32 codeOffset, Storage &storage)
+{
+    Block block {PC, static_cast<uint32>(storage.microOps.size()), 0};
+
+    // A block never leave the ROM region it starts in: 0x0000-0x3FFF is bank 0, 0x4000-0x7FFF is the switchable bank.
+    // In working RAM, it never leaves its page, which is protected as a whole.
+    const uint32 regionEnd = PC >= 0xC000 ? (PC & 0xFF00u) + pageSize : (PC < 0x4000 ? 0x4000 : 0x8000);
+
+    while (block.count < maxBlockLength)
+    {
+        const uint8 opcode = memory.read8(PC);
+        const uint8 length = instructionLengths[opcode];
+        if (length == 0 || PC + length > regionEnd)
+        {
+            break;
+        }
+
+        MicroOp microOp {CPU::opcodeTable[opcode], codeOffset, 1, length};
+        if (opcode == 0xCB)
+        {
+            microOp.handler = CPU::opcodeTableCB[memory.read8(PC + 1)];
+            microOp.opcodeLength = 2;
+        }
+        storage.microOps.push_back(microOp);
+        ++block.count;
+
+        if (endsBlock(opcode))
+        {
+            break;
+        }
+        PC += length;
+        codeOffset += length;
+    }
+
+    detectIdleLoop(block);
+    return block;
+}
+
+void BlockCache::detectIdleLoop(Block &block) const
+{
+    if (block.count > maxIdleLoopLength)
+    {
+        return;
+    }
+
+    // Registers B, C, D, E, H, L, A use bits of their index in opcodes (6 is (HL)).
+    // Flags are split in Z (with N and H) and C, so BIT which preserves C can be followed by JR C.
+    static constexpr uint16 A = 1u << 7u;
+    static constexpr uint16 flagZ = 1u << 8u;
+    static constexpr uint16 flagC = 1u << 9u;
+    static constexpr uint8 HL = 6;
+
+    uint16 written = 0;
+    uint16 readBeforeWritten = 0;
+    uint8 polls = 0;
+    bool jumpsBack = false;
+
+    uint16 PC = block.PC;
+    for (uint32 i = 0; i < block.count; ++i)
+    {
+        const uint8 opcode = memory.read8(PC);
+        const bool isLast = i + 1 == block.count;
+        uint16 reads = 0;
+        uint16 writes = 0;
+
+        if (opcode == 0xF0 || opcode == 0xFA)
+        {
+            // LDH A,(a8) and LD A,(a16)
+            const uint16 address = opcode == 0xF0
+                ? 0xFF00 + memory.read8(PC + 1)
+                : bytesToWordLE(memory.read8(PC + 1), memory.read8(PC + 2));
+            switch (address)
+            {
+                case 0xFF04: polls |= pollsDivider; break;
+                case 0xFF05: polls |= pollsTIMA; break;
+                case 0xFF0F: case 0xFF41: case 0xFF44: break; // IF, STAT, LY
+                default: return;
+            }
+            writes = A;
+        }
+        else if (opcode == 0x00)
+        {
+            // NOP
+        }
+        else if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76)
+        {
+            // LD r,r
+            const uint8 dest = (opcode >> 3u) & 0x7u;
+            const uint8 src = opcode & 0x7u;
+            if (dest == HL || src == HL)
+            {
+                return;
+            }
+            reads = 1u << src;
+            writes = 1u << dest;
+        }
+        else if (opcode >= 0xA0 && opcode < 0xC0)
+        {
+            // AND, XOR, OR, CP r
+            const uint8 src = opcode & 0x7u;
+            if (src == HL)
+            {
+                return;
+            }
+            reads = A | (1u << src);
+            writes = flagZ | flagC | (opcode < 0xB8 ? A : 0);
+        }
+        else if (opcode == 0xE6 || opcode == 0xEE || opcode == 0xF6 || opcode == 0xFE)
+        {
+            // AND, XOR, OR, CP d8
+            reads = A;
+            writes = flagZ | flagC | (opcode != 0xFE ? A : 0);
+        }
+        else if (opcode == 0xCB)
+        {
+            // BIT b,r
+            const uint8 opcodeCB = memory.read8(PC + 1);
+            const uint8 src = opcodeCB & 0x7u;
+            if (opcodeCB < 0x40 || opcodeCB >= 0x80 || src == HL)
+            {
+                return;
+            }
+            reads = 1u << src;
+            writes = flagZ;
+        }
+        else if (isLast && (opcode == 0x18 || opcode == 0x20 || opcode == 0x28 || opcode == 0x30 || opcode == 0x38))
+        {
+            // JR, JR cc back to the block start
+            const uint16 target = PC + 2 + static_cast<int8>(memory.read8(PC + 1));
+            if (target != block.PC)
+            {
+                return;
+            }
+            jumpsBack = true;
+            reads = opcode == 0x18 ? 0 : (opcode < 0x30 ? flagZ : flagC);
+        }
+        else if (isLast && (opcode == 0xC3 || opcode == 0xC2 || opcode == 0xCA || opcode == 0xD2 || opcode == 0xDA))
+        {
+            // JP, JP cc back to the block start
+            const uint16 target = bytesToWordLE(memory.read8(PC + 1), memory.read8(PC + 2));
+            if (target != block.PC)
+            {
+                return;
+            }
+            jumpsBack = true;
+            reads = opcode == 0xC3 ? 0 : (opcode < 0xD0 ? flagZ : flagC);
+        }
+        else
+        {
+            return;
+        }
+
+        readBeforeWritten |= reads & ~written;
+        written |= writes;
+        PC += instructionLengths[opcode];
+    }
+
+    // Nothing written may come from the previous iteration
+    if (jumpsBack && (readBeforeWritten & written) == 0)
+    {
+        block.idleLoop = true;
+        block.polls = polls;
+    }
+}
+
+#ifdef FRACTAL_JIT
+void BlockCache::forgetNativeCode()
+{
+    const auto forget = [](Storage &storage)
+    {
+        for (Block &block : storage.blocks)
+        {
+            block.hits = 0;
+            block.native = nullptr;
+        }
+    };
+    forget(romStorage);
+    std::for_each(workingRAMStorages.begin(), workingRAMStorages.end(), forget);
+}
+#endif
@@ -0,0 +1,160 @@
+#ifndef FRACTAL_BLOCK_CACHE_H
+#define FRACTAL_BLOCK_CACHE_H
+
+#include <array>
+#include <vector>
+#include <memory>
+
+#include "../../general.h"
+#include "../virtual_memory.h"
+
+class CPU;
+
+/**
+ * Cache of decoded basic blocks, for code running from the game ROM or working RAM.
+ *
+ * A basic block is a straight-line run of instructions ending on a jump, call, return, halt or
+ * bank boundary. Each instruction is decoded once in a micro-op which already hold its handler,
+ * so executing a block does not fetch nor decode opcodes anymore.
+ *
+ * Blocks are keyed by their code offset (see `VirtualMemory::codeOffset`): for the game ROM, the
+ * offset inside the ROM file, which is PC with the current ROM bank applied. A bank switch therefore
+ * select other blocks and never serve stale ones.
+ *
+ * Working RAM may be modified, by a test ROM patching the instruction it tests for instance. Blocks
+ * from working RAM never leave their 256 bytes page, and the page is protected (see
+ * `VirtualMemory::protectCode`). Once written, all blocks of the page are dropped before the next lookup.
+ *
+ * Other code (BIOS, echo RAM, HRAM) is never cached and is interpreted instruction by instruction instead.
+ */
+class BlockCache
+{
+public:
+    explicit BlockCache(VirtualMemory &memory) : memory(memory)
+    {};
+
+    // No copy
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    using OpcodeHandler = uint16 (CPU::*)();
+
+    struct MicroOp
+    {
+        // Handler of the instruction. For 0xCB prefixed instructions, the handler of the second byte.
+        OpcodeHandler handler;
+        // Code offset of the instruction, see `VirtualMemory::codeOffset`
+        uint32 codeOffset;
+        // Bytes to skip before calling the handler: 1, or 2 for 0xCB prefixed instructions
+        uint8 opcodeLength;
+        // Length of the whole instruction, operands included
+        uint8 length;
+    };
+
+    /**
+     * Native code translated from a block by the JIT.
+     */
+    using NativeCode = void (*)(CPU *cpu);
+
+    struct Block
+    {
+        // Address of the first instruction
+        uint16 PC;
+        // Index of the first micro-op in the `microOps` of its `Storage`
+        uint32 first;
+        uint32 count;
+
+        // The block is an idle loop: a short loop back to its own start which only polls registers
+        // changed by scheduled events or the timer. See `detectIdleLoop` and `CPU::skipIdleLoop`.
+        bool idleLoop = false;
+        // Timer registers polled by the idle loop: `pollsDivider` and `pollsTIMA` bits
+        uint8 polls = 0;
+
+#ifdef FRACTAL_JIT
+        // How many time the block have been executed by the interpreter
+        uint32 hits = 0;
+        NativeCode native = nullptr;
+#endif
+    };
+
+    static constexpr uint8 pollsDivider = 1u << 0u;
+    static constexpr uint8 pollsTIMA = 1u << 1u;
+
+    /**
+     * Find, or decode, the block starting at `PC`.
+     * @return The block, or nullptr if code at `PC` can not be cached.
+     */
+    [[nodiscard]] Block *find(uint16 PC);
+
+    [[nodiscard]] const MicroOp *microOpsOf(const Block &block) const
+    {
+        return storageOf(block.PC).microOps.data() + block.first;
+    }
+
+#ifdef FRACTAL_JIT
+    /**
+     * Forget all native code of all blocks. Blocks are translated again once hot.
+     */
+    void forgetNativeCode();
+#endif
+
+private:
+    VirtualMemory &memory;
+
+    static constexpr uint32 bankSize = 0x4000;
+    static constexpr uint32 pageSize = 0x100;
+    static constexpr uint32 workingRAMPageCount = 0x20;
+    static constexpr uint32 maxBlockLength = 64;
+    static constexpr uint32 maxIdleLoopLength = 8;
+
+    struct Storage
+    {
+        std::vector<Block> blocks;
+        std::vector<MicroOp> microOps;
+    };
+
+    /**
+     * Blocks of the game ROM, kept forever, and blocks of each working RAM page, dropped with the page.
+     */
+    Storage romStorage;
+    std::array<Storage, workingRAMPageCount> workingRAMStorages;
+
+    [[nodiscard]] const Storage &storageOf(uint16 PC) const
+    {
+        return PC >= 0xC000 ? workingRAMStorages[(PC - 0xC000) / pageSize] : romStorage;
+    }
+
+    /**
+     * For each ROM bank ever executed, index+1 in `romStorage.blocks` of the block starting at each byte.
+     * 0 means not decoded yet.
+     */
+    std::vector<std::unique_ptr<std::array<uint32, bankSize>>> blockIndexes;
+
+    /**
+     * For each byte of working RAM, index+1 in the blocks of its page storage. 0 means not decoded yet.
+     */
+    std::array<uint32, workingRAMPageCount * pageSize> workingRAMBlockIndexes {};
+
+    /**
+     * Index of the block starting at `codeOffset`, creating the bank index if needed.
+     */
+    [[nodiscard]] uint32 &indexOf(uint32 codeOffset);
+
+    /**
+     * Drop blocks of working RAM pages written since last call, see `VirtualMemory::takeWrittenCodePages`.
+     */
+    void forgetWrittenCode();
+
+    [[nodiscard]] Block decode(uint16 PC, uint32 codeOffset, Storage &storage);
+
+    /**
+     * Set `block.idleLoop` if each iteration of the block does exactly the same thing as long as the
+     * registers it polls do not change:
+     * - it ends with a jump back to its first instruction
+     * - it only reads LY, STAT, IF, DIV or TIMA, and never writes memory
+     * - no register or flag carries a value from one iteration to the next one
+     */
+    void detectIdleLoop(Block &block) const;
+};
+
+#endif //FRACTAL_BLOCK_CACHE_H
@@ -2,58 +2,183 @@
 #include "../virtual_memory.h"
 
 void CPU::nextTick()
+{
+    if (isHalt && !isInterruptPending())
+    {
+        fastForwardHalt();
+        return;
+    }
+
+    // Straight-line code from the game ROM and working RAM is executed from the block cache.
+    // Everything else, interrupts, halt and halt bug, goes through the regular fetch, decode and execute.
+    if (!isHalt && !missOnePCIncrement && !(IME == IMEState::ENABLED && isInterruptPending()))
+    {
+        if (BlockCache::Block *block = blockCache.find(PC))
+        {
+            const uint64 start = scheduler.now();
+            executeBlock(*block);
+            if (block->idleLoop && PC == block->PC)
+            {
+                skipIdleLoop(*block, scheduler.now() - start);
+            }
+            return;
+        }
+    }
+
+    executeInstruction();
+}
+
+void CPU::executeInstruction()
 {
     // fetch
     uint8 opcode = fetch8(PC);
 
     // decode & execute
     uint16 cycles = 0;
-    try
+    if (isInterruptPending())
     {
-        std::optional<RequestedInterrupt> interrupt = checkInterrupts();
-        if (interrupt && IME == IMEState::ENABLED)
+        if (IME == IMEState::ENABLED)
         {
-            cycles = callInterrupt(interrupt.value());
+            cycles = callInterrupt();
         }
-        else if (interrupt)
+        else
         {
             isHalt = false;
         }
+    }
 
-        if (IME == IMEState::ENABLED_AFTER)
+    if (IME == IMEState::ENABLED_AFTER)
+    {
+        IME = IMEState::ENABLED;
+    }
+
+    if (!isHalt && cycles == 0)
+    {
+        // Simulate HALT bug which fails to increment PC for one instruction.
+        // It would be easier to read with a `if()` but this is faster and avoid a jump.
+        PC -= static_cast<uint8>(missOnePCIncrement);
+        missOnePCIncrement = false;
+        ++PC;
+
+        cycles = decodeThenExecute(opcode);
+    }
+    else if (cycles == 0)
+    {
+        cycles = nop();
+    }
+
+    updateComponents(cycles);
+}
+
+void CPU::executeBlock(BlockCache::Block &block)
+{
+#ifdef FRACTAL_JIT
+    if (!block.native && ++block.hits >= JIT::hotThreshold)
+    {
+        block.native = jit.compile(block, blockCache.microOpsOf(block));
+        if (!block.native)
         {
-            IME = IMEState::ENABLED;
+            // Native code buffer is full: start over
+            blockCache.forgetNativeCode();
+            jit.clear();
+            block.native = jit.compile(block, blockCache.microOpsOf(block));
         }
+    }
 
-        if (!isHalt && cycles == 0)
-        {
-            // Simulate HALT bug which fails to increment PC for one instruction.
-            // It would be easier to read with a `if()` but this is faster and avoid a jump.
-            PC -= static_cast<uint8>(missOnePCIncrement);
-            missOnePCIncrement = false;
-            ++PC;
+    if (block.native)
+    {
+        block.native(this);
+        return;
+    }
+#endif
 
-            cycles = decodeThenExecute(opcode);
+    const BlockCache::MicroOp *microOp = blockCache.microOpsOf(block);
+    const BlockCache::MicroOp *const end = microOp + block.count;
+    const uint32 codeMappingVersion = memory.codeMappingVersion();
+
+    while (true)
+    {
+        // Same IME handling than `executeInstruction`. No interrupt must be serviced at this point.
+        if (IME == IMEState::ENABLED_AFTER)
+        {
+            IME = IMEState::ENABLED;
         }
-        else if (cycles == 0)
+
+        // Only known opcodes are cached: no need to catch anything here.
+        PC += microOp->opcodeLength;
+        const uint16 cycles = (this->*microOp->handler)();
+        updateComponents(cycles);
+
+        // Leave it to `nextTick` when the last instruction entered halt (bug), when an interrupt
+        // must be serviced, or when the next instruction is not mapped anymore (ROM bank switch,
+        // DMA, working RAM page written).
+        ++microOp;
+        if (microOp == end || isHalt || missOnePCIncrement || (IME == IMEState::ENABLED && isInterruptPending())
+            || (memory.codeMappingVersion() != codeMappingVersion && memory.codeOffset(PC) != static_cast<int32>(microOp->codeOffset)))
         {
-            cycles = nop();
+            return;
         }
     }
-    catch (std::exception &e)
+}
+
+void CPU::updateComponents(uint32 cycles)
+{
+    scheduler.advance(cycles);
+    if (scheduler.isEventDue())
+    {
+        scheduler.runDueEvents();
+    }
+}
+
+void CPU::fastForwardHalt()
+{
+    if (IME == IMEState::ENABLED_AFTER)
+    {
+        IME = IMEState::ENABLED;
+    }
+
+    // Only an interrupt can wake the CPU. Interrupts are only requested by scheduled events
+    // (including TIMA overflow) and joypad (which is updated between two batches of ticks).
+    // Jump right to the earliest of them, by steps of 4 cycles as if halt executed nops.
+    const uint64 now = scheduler.now();
+    const uint64 wakeUp = scheduler.nextEventTime();
+    const uint64 cycles = std::clamp<uint64>(wakeUp - std::min(wakeUp, now), 1, maxFastForward);
+    updateComponents((cycles + 3u) & ~uint64(3u));
+}
+
+void CPU::skipIdleLoop(const BlockCache::Block &block, uint64 iterationCycles)
+{
+    // An interrupt is about to be serviced: that is not idle.
+    if (IME == IMEState::ENABLED_AFTER || (IME == IMEState::ENABLED && isInterruptPending()))
+    {
+        return;
+    }
+
+    // Polled registers change with scheduled events (LY, STAT, IF including TIMA overflow) or the timer itself.
+    const uint64 now = scheduler.now();
+    uint64 change = scheduler.nextEventTime();
+    if (block.polls & BlockCache::pollsDivider)
     {
-        std::cerr << std::hex << "Crash at PC=0x" << PC - 1 << ", opcode=0x" << +opcode << std::endl;
-        exit(1);
+        change = std::min(change, now + timer.cyclesUntilDividerChange());
     }
+    if (block.polls & BlockCache::pollsTIMA)
+    {
+        change = std::min(change, now + timer.cyclesUntilTimerIncrement());
+    }
+    change = std::min(change, now + maxFastForward);
 
-    F &= ~FFlags.alwaysLow;
-    memory.incrementDividerRegister(cycles);
-    lcd.cycles(cycles);
-    performCycleTiming(cycles);
-    input.updateInputStatus();
+    // Skip whole iterations which all end before the change: they would read the same values
+    // and take the same branches. Remaining iterations run for real.
+    if (change <= now + iterationCycles)
+    {
+        return;
+    }
+    const uint64 skipped = (change - now - 1) / iterationCycles * iterationCycles;
+    idleCycles += skipped;
+    updateComponents(static_cast<uint32>(skipped));
 }
 
-void CPU::performCycleTiming(uint16 cycles)
+void CPU::performCycleTiming(uint32 cycles)
 {
     // Now time to make CPU timing.
     // We can not sleep_for after each instruction. We wait for 5ms of instructions to execute then
@@ -79,51 +204,19 @@ void CPU::performCycleTiming(uint16 cycles)
     }
 }
 
-std::optional<CPU::RequestedInterrupt> CPU::checkInterrupts()
+uint16 CPU::callInterrupt()
 {
-    const uint8 interruptEnable = memory.read8(0xFFFF);
-    const uint8 interruptRequest = memory.read8(0xFF0F);
-
-    if (interruptEnable & interruptRequest & memory.interruptBits.verticalBlank)
-    {
-        return RequestedInterrupt {memory.interruptAddress.verticalBlank, memory.interruptBits.verticalBlank};
-    }
-
-    if (interruptEnable & interruptRequest & memory.interruptBits.STAT)
-    {
-        return RequestedInterrupt {memory.interruptAddress.lcdStat, memory.interruptBits.STAT};
-    }
-
-    if (interruptEnable & interruptRequest & memory.interruptBits.TIMA)
-    {
-        return RequestedInterrupt {memory.interruptAddress.TIMA, memory.interruptBits.TIMA};
-    }
-
-    if (interruptEnable & interruptRequest & memory.interruptBits.serial)
-    {
-        return RequestedInterrupt {memory.interruptAddress.serial, memory.interruptBits.serial};
-    }
-
-    if (interruptEnable & interruptRequest & memory.interruptBits.joypad)
-    {
-        return RequestedInterrupt {memory.interruptAddress.joypad, memory.interruptBits.joypad};
-    }
+    // Lowest bit has the highest priority, and vectors are 8 bytes apart.
+    const uint8 index = lowestSetBit(memory.pendingInterrupts());
 
-    return std::nullopt;
-}
-
-uint16 CPU::callInterrupt(RequestedInterrupt requestedInterrupt)
-{
     // Disable interrupt request from IF flag
-    uint8 interruptRequest = memory.read8(0xFF0F);
-    interruptRequest &= ~requestedInterrupt.bit;
-    memory.write8(0xFF0F, interruptRequest);
+    memory.acknowledgeInterrupt(1u << index);
 
     setIME(false);
 
     uint16 cycles = isHalt * 4;
     isHalt = false;
-    return call(requestedInterrupt.addr) + cycles;
+    return call(memory.interruptAddress.verticalBlank + index * 8) + cycles;
 }
 
 void CPU::setIME(bool enabled)
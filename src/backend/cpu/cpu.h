@@ -1,16 +1,20 @@
 #ifndef FRACTAL_CPU_H
 #define FRACTAL_CPU_H
 
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <utility>
 #include <thread>
 #include <chrono>
-#include <optional>
 #include <functional>
 
 #include "../../general.h"
 #include "../virtual_memory.h"
-#include "../lcd.h"
-#include "../input_manager.h"
+#include "../scheduler.h"
+#include "../timer.h"
+#include "block_cache.h"
+#include "jit.h"
 
 /**
  * CPU take care of:
@@ -18,13 +22,17 @@
  * - Managing and executing interrupts
  * - Counting and performing cycle timings
  *
- * It works with memory and graphics. CPU actually tell to timers and graphics how
- * much time pass so they can update and do their job on-time.
+ * It works with memory and the scheduler. CPU actually tell the scheduler how
+ * much time pass, so timers and graphics can do their job on-time.
  */
 class CPU
 {
 public:
-    explicit CPU(VirtualMemory &memory, InputManager &input, LCD &lcd) : memory(memory), input(input), lcd(lcd)
+    explicit CPU(VirtualMemory &memory, Scheduler &scheduler, Timer &timer) :
+    memory(memory), scheduler(scheduler), timer(timer), blockCache(memory)
+#ifdef FRACTAL_JIT
+    , jit(*this)
+#endif
     {};
 
     // No copy
@@ -32,18 +40,91 @@ public:
     CPU& operator=(const CPU&) = delete;
 
     /**
-     * - Fetch, decode and execute next instruction, or interrupt.
+     * - Fetch, decode and execute next instruction, or interrupt. It may execute a whole cached block.
      * - Perform timers update and graphic update.
-     * - This function can go very fast or wait for an extended period of time.
      *
-     * This function is intended to be run in a loop.
+     * This function is intended to be run in a loop, see `Motherboard`.
      */
     void nextTick();
 
+    /**
+     * Sleep so the emulation runs at the Gameboy speed.
+     * This function can go very fast or wait for an extended period of time.
+     * @param cycles Cycles executed since the last call
+     */
+    void performCycleTiming(uint32 cycles);
+
+    /**
+     * Did the CPU lock up? Real hardware freezes on an illegal opcode. The CPU does the same:
+     * it keeps executing the illegal opcode without side effect.
+     * It is meant to be checked once in a while by the run loop, not after each instruction.
+     */
+    [[nodiscard]] bool hasCrashed() const { return crashed; }
+
+    /**
+     * Address of the illegal opcode which locked up the CPU. Only meaningful if `hasCrashed`.
+     */
+    [[nodiscard]] uint16 crashPC() const { return crashAddress; }
+
+    /**
+     * Illegal opcode which locked up the CPU. Only meaningful if `hasCrashed`.
+     */
+    [[nodiscard]] uint8 crashOpcode() const { return crashedOpcode; }
+
+    /**
+     * Cycles skipped by idle loop detection since power on, see `skipIdleLoop`.
+     */
+    [[nodiscard]] uint64 idleCyclesSkipped() const { return idleCycles; }
+
 private:
+    friend class BlockCache;
+    friend class JIT;
+
     VirtualMemory &memory;
-    InputManager &input;
-    LCD &lcd;
+    Scheduler &scheduler;
+    Timer &timer;
+
+    BlockCache blockCache;
+#ifdef FRACTAL_JIT
+    JIT jit;
+#endif
+
+    /**
+     * Fetch, decode and execute one instruction, or interrupt.
+     */
+    void executeInstruction();
+
+    /**
+     * Execute a cached block of instructions.
+     * It stops early when an interrupt must be serviced, when the CPU halt, or when the ROM bank change.
+     */
+    void executeBlock(BlockCache::Block &block);
+
+    /**
+     * Tell the scheduler that `cycles` cycles elapsed with the last instruction.
+     * Due events run here.
+     */
+    void updateComponents(uint32 cycles);
+
+    /**
+     * While halted, skip cycles up to the next event which may request an interrupt.
+     */
+    void fastForwardHalt();
+
+    /**
+     * After an iteration of an idle loop, skip the iterations which would poll the same values.
+     * @param block The idle loop, see `BlockCache::Block::idleLoop`
+     * @param iterationCycles Cycles taken by the iteration just executed
+     */
+    void skipIdleLoop(const BlockCache::Block &block, uint64 iterationCycles);
+
+    /**
+     * Upper bound of a single halt or idle loop fast-forward, so the run loop stays responsive
+     * when nothing is scheduled.
+     */
+    static constexpr uint32 maxFastForward = 4560;
+
+    uint64 idleCycles = 0;
 
     static constexpr long int speedFactor = 10;
     static constexpr long int cyclesPerSecond = 4194304 * speedFactor;
@@ -51,8 +132,6 @@ private:
     static constexpr std::chrono::milliseconds minimumSleepTime {5};
     std::chrono::nanoseconds overSleepDuration {0};
 
-    void performCycleTiming(uint16 cycles);
-
     /**
      * IME - Interrupt Master Enable Flag
      * DISABLED: disable jump to interrupt vectors
@@ -74,26 +153,14 @@ private:
     void setIME(bool enabled);
 
     /**
-     * Struct representing a requested interrupt.
-     */
-    struct RequestedInterrupt
-    {
-        // Vector address of the interrupt
-        const uint16 addr;
-        // Bit representing the interrupt in various registers
-        const uint8 bit;
-    };
-
-    /**
-     * Check if an interrupt is ready to be serviced
-     * @return An optional interrupt.
+     * Is an interrupt requested and enabled? It does not look at IME.
      */
-    [[nodiscard]] std::optional<RequestedInterrupt> checkInterrupts();
+    [[nodiscard]] bool isInterruptPending() const { return memory.pendingInterrupts() != 0; }
     /**
-     * Call the given interrupt.
+     * Call the pending interrupt with the highest priority.
      * @return Cycles consumed
      */
-    [[nodiscard]] uint16 callInterrupt(RequestedInterrupt requestedInterrupt);
+    [[nodiscard]] uint16 callInterrupt();
 
     /**
      * Is CPU halted? (from instruction `halt`)
@@ -108,6 +175,16 @@ private:
      */
     uint16 halt();
 
+    bool crashed = false;
+    uint16 crashAddress = 0;
+    uint8 crashedOpcode = 0;
+    /**
+     * Lock up the CPU on an illegal opcode: PC stays on it and interrupts are not serviced anymore.
+     * @param opcode The illegal opcode
+     * @return Cycles consumed
+     */
+    uint16 lockUp(uint8 opcode);
+
     /**
      * Decode then Execute the given opcode.
      * @param opcode opcode to execute
@@ -115,6 +192,49 @@ private:
      */
     [[nodiscard]] uint16 decodeThenExecute(uint8 opcode);
 
+    /**
+     * An opcode handler execute one instruction and return cycles consumed.
+     */
+    using OpcodeHandler = uint16 (CPU::*)();
+
+    /**
+     * Handlers for every opcode, and every opcode following a 0xCB prefix.
+     * Both tables are generated at compile time from `executeOpcode` and `executeOpcodeCB`.
+     */
+    static const std::array<OpcodeHandler, 256> opcodeTable;
+    static const std::array<OpcodeHandler, 256> opcodeTableCB;
+
+    template <uint8 opcode>
+    uint16 executeOpcode();
+    template <uint8 opcode>
+    uint16 executeOpcodeCB();
+
+#ifdef FRACTAL_JIT
+    /**
+     * Same handlers as `opcodeTable` and `opcodeTableCB`, as plain functions callable from native code.
+     */
+    using OpcodeFunction = uint16 (*)(CPU *cpu);
+    static const std::array<OpcodeFunction, 256> opcodeFunctionTable;
+    static const std::array<OpcodeFunction, 256> opcodeFunctionTableCB;
+
+    template <size_t... opcodes>
+    static constexpr std::array<OpcodeFunction, 256> makeOpcodeFunctionTable(std::index_sequence<opcodes...>);
+    template <size_t... opcodes>
+    static constexpr std::array<OpcodeFunction, 256> makeOpcodeFunctionTableCB(std::index_sequence<opcodes...>);
+#endif
+
+    template <size_t... opcodes>
+    static constexpr std::array<OpcodeHandler, 256> makeOpcodeTable(std::index_sequence<opcodes...>);
+    template <size_t... opcodes>
+    static constexpr std::array<OpcodeHandler, 256> makeOpcodeTableCB(std::index_sequence<opcodes...>);
+
+    /**
+     * Register from its 3 bits index in an opcode: B, C, D, E, H, L, (HL), A.
+     * Index 6 is not a register and is rejected.
+     */
+    template <uint8 index>
+    uint8 &registerByIndex();
+
     /**
      * Fetch a byte from memory
      * @param addr Address of the byte to read
@@ -176,23 +296,64 @@ private:
         const uint8 alwaysLow = 1u << 0u | 1u << 1u | 1u << 2u | 1u << 3u;
     } FFlags;
 
-    /* Carry and Half carry
-     *
-     * Algorithm have been taken from https://stackoverflow.com/a/7261149/3780971
-     *
-     * It works for both signed and unsigned integers and `a + b` and `a - b`.
-     * It must be adapted if working from int8 or int16.
+    // Flags are evaluated lazily.
+    // ALU instructions do not build `F`. They store, for each flag, a value the flag can be derived from:
+    // - Z is set when `flagZeroSource` is zero
+    // - N is `flagSubtract`
+    // - H is bit 4 of `flagHalfCarrySource`
+    // - C is bit 8 of `flagCarrySource`
+    // `F` is only built by `materializeFlags` when it is observed as a whole (PUSH AF),
+    // and split back by `unpackFlags` when written as a whole (POP AF).
+    // Instructions that read a single flag (conditional jumps, ADC, SBC, DAA...) use the accessors below.
+    uint8 flagZeroSource = 1;
+    bool flagSubtract = false;
+    uint16 flagHalfCarrySource = 0;
+    uint16 flagCarrySource = 0;
+
+    [[nodiscard]] bool flagZ() const { return flagZeroSource == 0; }
+    [[nodiscard]] bool flagH() const { return flagHalfCarrySource & 0x10u; }
+    [[nodiscard]] bool flagC() const { return flagCarrySource & 0x100u; }
+
+    /**
+     * Build `F` from the lazy flag sources.
      */
+    void materializeFlags();
+
+    /**
+     * Set the lazy flag sources from `F`.
+     */
+    void unpackFlags();
+
+    /**
+     * Set all flags after an 8 bit addition or subtraction.
+     * @param a first operand
+     * @param b second operand
+     * @param result full width result of `a + b (+ carry)` or `a - b (- carry)`
+     * @param subtract True if the operation is a subtraction
+     */
+    void setArithmeticFlags(uint8 a, uint8 b, uint16 result, bool subtract);
+
+    /**
+     * Set all flags after adding a signed 8 bit offset to a 16 bit register (ADD SP,e8 and LD HL,SP+e8).
+     * @param a 16 bit register
+     * @param offset signed offset
+     * @param result `a + offset`
+     */
+    void setOffsetFlags(uint16 a, int8 offset, uint16 result);
+
+    /**
+     * Set all flags after AND, OR or XOR.
+     * @param result result of the operation
+     * @param halfCarry True if H must be set (AND)
+     */
+    void setLogicFlags(uint8 result, bool halfCarry);
+
     /**
-     * Compute carry and half carry for operation a + b or a - b.
-     * @tparam T Type to compute
-     * @tparam addition True if operation is `a + b`. False if operation is `a - b`.
-     * @param a first element
-     * @param b second element
-     * @return Return zero except for bit CARRY and HALF_CARRY set if needed.
+     * Set all flags after a rotation, shift or swap.
+     * @param result result of the operation
+     * @param carry bit shifted out
      */
-    template<typename T, bool addition = true>
-    [[nodiscard]] uint8 carryAndHalfCarry(T a, T b);
+    void setShiftFlags(uint8 result, bool carry);
 
     // Here live all processor instructions.
     // They all return cycle count consumed.
@@ -211,6 +372,8 @@ private:
 
     uint16 push(uint16 reg);
     uint16 pop(uint16 &reg);
+    uint16 pushAF();
+    uint16 popAF();
 
     uint16 DAA();
     uint16 CPL();
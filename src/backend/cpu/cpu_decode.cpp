@@ -1,7 +1,12 @@
+#include <utility>
+
 #include "cpu.h"
 
-uint16 CPU::decodeThenExecute(const uint8 opcode)
+template <uint8 opcode>
+uint16 CPU::executeOpcode()
 {
+    // `opcode` is a template parameter: each instantiation of this switch is folded
+    // down to its single matching case at compile time.
     switch(opcode)
     {
         case 0x00: return nop();
@@ -22,25 +27,25 @@ uint16 CPU::decodeThenExecute(const uint8 opcode)
         case 0xC5: return push(BC);
         case 0xD5: return push(DE);
         case 0xE5: return push(HL);
-        case 0xF5: return push(AF);
+        case 0xF5: return pushAF();
 
         case 0xC1: return pop(BC);
         case 0xD1: return pop(DE);
         case 0xE1: return pop(HL);
-        case 0xF1: return pop(AF);
+        case 0xF1: return popAF();
 
         case 0xCD: return callD16();
-        case 0xC4: return callIfD16(F & FFlags.Z, false);
-        case 0xCC: return callIfD16(F & FFlags.Z, true);
-        case 0xD4: return callIfD16(F & FFlags.C, false);
-        case 0xDC: return callIfD16(F & FFlags.C, true);
+        case 0xC4: return callIfD16(flagZ(), false);
+        case 0xCC: return callIfD16(flagZ(), true);
+        case 0xD4: return callIfD16(flagC(), false);
+        case 0xDC: return callIfD16(flagC(), true);
 
         case 0xC9: return ret();
         case 0xD9: return reti();
-        case 0xC0: return retIf(F & FFlags.Z, false);
-        case 0xC8: return retIf(F & FFlags.Z, true);
-        case 0xD0: return retIf(F & FFlags.C, false);
-        case 0xD8: return retIf(F & FFlags.C, true);
+        case 0xC0: return retIf(flagZ(), false);
+        case 0xC8: return retIf(flagZ(), true);
+        case 0xD0: return retIf(flagC(), false);
+        case 0xD8: return retIf(flagC(), true);
 
         case 0xC7: return rst(0x00);
         case 0xCF: return rst(0x08);
@@ -58,16 +63,16 @@ uint16 CPU::decodeThenExecute(const uint8 opcode)
 
         case 0xC3: return JPD16();
         case 0xE9: return JPHL();
-        case 0xC2: return JpIfR16(F & FFlags.Z, false);
-        case 0xCA: return JpIfR16(F & FFlags.Z, true);
-        case 0xD2: return JpIfR16(F & FFlags.C, false);
-        case 0xDA: return JpIfR16(F & FFlags.C, true);
+        case 0xC2: return JpIfR16(flagZ(), false);
+        case 0xCA: return JpIfR16(flagZ(), true);
+        case 0xD2: return JpIfR16(flagC(), false);
+        case 0xDA: return JpIfR16(flagC(), true);
 
         case 0x18: return JRD8();
-        case 0x20: return JrIfD8(F & FFlags.Z, false);
-        case 0x28: return JrIfD8(F & FFlags.Z, true);
-        case 0x30: return JrIfD8(F & FFlags.C, false);
-        case 0x38: return JrIfD8(F & FFlags.C, true);
+        case 0x20: return JrIfD8(flagZ(), false);
+        case 0x28: return JrIfD8(flagZ(), true);
+        case 0x30: return JrIfD8(flagC(), false);
+        case 0x38: return JrIfD8(flagC(), true);
 
         case 0x06: return loadD8ToR8(B);
         case 0x0E: return loadD8ToR8(C);
@@ -285,301 +290,145 @@ uint16 CPU::decodeThenExecute(const uint8 opcode)
         case 0x2B: return decR16(HL);
         case 0x3B: return decR16(SP);
 
-        default:
-        {
-            std::cerr << "Unknown opcode 0x" << std::hex << +opcode << std::endl;
-            throw std::invalid_argument("Unknown opcode");
-        }
+        default: return lockUp(opcode);
+    }
+}
+
+
+template <uint8 index>
+uint8 &CPU::registerByIndex()
+{
+    static_assert(index < 8 && index != 6, "Index 6 is (HL), which is not a register");
+
+    if constexpr (index == 0) return B;
+    else if constexpr (index == 1) return C;
+    else if constexpr (index == 2) return D;
+    else if constexpr (index == 3) return E;
+    else if constexpr (index == 4) return H;
+    else if constexpr (index == 5) return L;
+    else return A;
+}
+
+template <uint8 opcode>
+uint16 CPU::executeOpcodeCB()
+{
+    // CB opcodes are fully regular: [7..6] group, [5..3] operation or bit index, [2..0] operand.
+    // Operand are B, C, D, E, H, L, (HL), A. Operand 6 is the byte pointed by HL.
+    constexpr uint8 group = opcode >> 6u;
+    constexpr uint8 operation = (opcode >> 3u) & 0x7u;
+    constexpr uint8 operand = opcode & 0x7u;
+
+    if constexpr (operand == 6)
+    {
+        if constexpr (group == 1) return bitM8(HL, operation);
+        else if constexpr (group == 2) return resM8(HL, operation);
+        else if constexpr (group == 3) return setM8(HL, operation);
+        else if constexpr (operation == 0) return rlcM8(HL);
+        else if constexpr (operation == 1) return rrcM8(HL);
+        else if constexpr (operation == 2) return rlM8(HL);
+        else if constexpr (operation == 3) return rrM8(HL);
+        else if constexpr (operation == 4) return slaM8(HL);
+        else if constexpr (operation == 5) return sraM8(HL);
+        else if constexpr (operation == 6) return swapM8(HL);
+        else return srlM8(HL);
     }
+    else
+    {
+        uint8 &reg = registerByIndex<operand>();
+
+        if constexpr (group == 1) return bitR8(reg, operation);
+        else if constexpr (group == 2) return resR8(reg, operation);
+        else if constexpr (group == 3) return setR8(reg, operation);
+        else if constexpr (operation == 0) return rlcR8(reg);
+        else if constexpr (operation == 1) return rrcR8(reg);
+        else if constexpr (operation == 2) return rlR8(reg);
+        else if constexpr (operation == 3) return rrR8(reg);
+        else if constexpr (operation == 4) return slaR8(reg);
+        else if constexpr (operation == 5) return sraR8(reg);
+        else if constexpr (operation == 6) return swapR8(reg);
+        else return srlR8(reg);
+    }
+}
+
+template <size_t... opcodes>
+constexpr std::array<CPU::OpcodeHandler, 256> CPU::makeOpcodeTable(std::index_sequence<opcodes...>)
+{
+    return {{ &CPU::executeOpcode<static_cast<uint8>(opcodes)>... }};
+}
+
+template <size_t... opcodes>
+constexpr std::array<CPU::OpcodeHandler, 256> CPU::makeOpcodeTableCB(std::index_sequence<opcodes...>)
+{
+    return {{ &CPU::executeOpcodeCB<static_cast<uint8>(opcodes)>... }};
+}
+
+const std::array<CPU::OpcodeHandler, 256> CPU::opcodeTable = makeOpcodeTable(std::make_index_sequence<256>());
+const std::array<CPU::OpcodeHandler, 256> CPU::opcodeTableCB = makeOpcodeTableCB(std::make_index_sequence<256>());
+
+#ifdef FRACTAL_JIT
+template <size_t... opcodes>
+constexpr std::array<CPU::OpcodeFunction, 256> CPU::makeOpcodeFunctionTable(std::index_sequence<opcodes...>)
+{
+    return {{ [](CPU *cpu) { return cpu->executeOpcode<static_cast<uint8>(opcodes)>(); }... }};
+}
+
+template <size_t... opcodes>
+constexpr std::array<CPU::OpcodeFunction, 256> CPU::makeOpcodeFunctionTableCB(std::index_sequence<opcodes...>)
+{
+    return {{ [](CPU *cpu) { return cpu->executeOpcodeCB<static_cast<uint8>(opcodes)>(); }... }};
 }
 
+const std::array<CPU::OpcodeFunction, 256> CPU::opcodeFunctionTable = makeOpcodeFunctionTable(std::make_index_sequence<256>());
+const std::array<CPU::OpcodeFunction, 256> CPU::opcodeFunctionTableCB = makeOpcodeFunctionTableCB(std::make_index_sequence<256>());
+#endif
+
+#ifdef FRACTAL_THREADED_DISPATCH
+
+// Expand `X(n)` for the 16 opcodes of row `0x[row]0` to `0x[row]F`
+#define FRACTAL_OPCODE_ROW(X, row) \
+    X(0x##row##0) X(0x##row##1) X(0x##row##2) X(0x##row##3) \
+    X(0x##row##4) X(0x##row##5) X(0x##row##6) X(0x##row##7) \
+    X(0x##row##8) X(0x##row##9) X(0x##row##A) X(0x##row##B) \
+    X(0x##row##C) X(0x##row##D) X(0x##row##E) X(0x##row##F)
+
+// Expand `X(n)` for every opcode from 0x00 to 0xFF
+#define FRACTAL_OPCODES(X) \
+    FRACTAL_OPCODE_ROW(X, 0) FRACTAL_OPCODE_ROW(X, 1) FRACTAL_OPCODE_ROW(X, 2) FRACTAL_OPCODE_ROW(X, 3) \
+    FRACTAL_OPCODE_ROW(X, 4) FRACTAL_OPCODE_ROW(X, 5) FRACTAL_OPCODE_ROW(X, 6) FRACTAL_OPCODE_ROW(X, 7) \
+    FRACTAL_OPCODE_ROW(X, 8) FRACTAL_OPCODE_ROW(X, 9) FRACTAL_OPCODE_ROW(X, A) FRACTAL_OPCODE_ROW(X, B) \
+    FRACTAL_OPCODE_ROW(X, C) FRACTAL_OPCODE_ROW(X, D) FRACTAL_OPCODE_ROW(X, E) FRACTAL_OPCODE_ROW(X, F)
+
+#define FRACTAL_OPCODE_LABEL_ADDRESS(opcode) &&label_##opcode,
+#define FRACTAL_OPCODE_LABEL(opcode) label_##opcode: return executeOpcode<opcode>();
+
+uint16 CPU::decodeThenExecute(const uint8 opcode)
+{
+    // Computed goto (GCC and Clang extension): the label table is indexed without bound check
+    // and each label jumps straight into its inlined handler.
+    static const void *const labels[256] = { FRACTAL_OPCODES(FRACTAL_OPCODE_LABEL_ADDRESS) };
+
+    goto *labels[opcode];
+    FRACTAL_OPCODES(FRACTAL_OPCODE_LABEL)
+}
+
+#undef FRACTAL_OPCODE_LABEL
+#undef FRACTAL_OPCODE_LABEL_ADDRESS
+#undef FRACTAL_OPCODES
+#undef FRACTAL_OPCODE_ROW
+
+#else
+
+uint16 CPU::decodeThenExecute(const uint8 opcode)
+{
+    return (this->*opcodeTable[opcode])();
+}
+
+#endif
+
 uint16 CPU::prefixCB()
 {
     const uint8 opcode = fetch8(PC);
     ++PC;
 
-    switch (opcode)
-    {
-        case 0x00: return rlcR8(B);
-        case 0x01: return rlcR8(C);
-        case 0x02: return rlcR8(D);
-        case 0x03: return rlcR8(E);
-        case 0x04: return rlcR8(H);
-        case 0x05: return rlcR8(L);
-        case 0x06: return rlcM8(HL);
-        case 0x07: return rlcR8(A);
-
-        case 0x08: return rrcR8(B);
-        case 0x09: return rrcR8(C);
-        case 0x0A: return rrcR8(D);
-        case 0x0B: return rrcR8(E);
-        case 0x0C: return rrcR8(H);
-        case 0x0D: return rrcR8(L);
-        case 0x0E: return rrcM8(HL);
-        case 0x0F: return rrcR8(A);
-
-        case 0x10: return rlR8(B);
-        case 0x11: return rlR8(C);
-        case 0x12: return rlR8(D);
-        case 0x13: return rlR8(E);
-        case 0x14: return rlR8(H);
-        case 0x15: return rlR8(L);
-        case 0x16: return rlM8(HL);
-        case 0x17: return rlR8(A);
-
-        case 0x18: return rrR8(B);
-        case 0x19: return rrR8(C);
-        case 0x1A: return rrR8(D);
-        case 0x1B: return rrR8(E);
-        case 0x1C: return rrR8(H);
-        case 0x1D: return rrR8(L);
-        case 0x1E: return rrM8(HL);
-        case 0x1F: return rrR8(A);
-
-        case 0x20: return slaR8(B);
-        case 0x21: return slaR8(C);
-        case 0x22: return slaR8(D);
-        case 0x23: return slaR8(E);
-        case 0x24: return slaR8(H);
-        case 0x25: return slaR8(L);
-        case 0x26: return slaM8(HL);
-        case 0x27: return slaR8(A);
-
-        case 0x28: return sraR8(B);
-        case 0x29: return sraR8(C);
-        case 0x2A: return sraR8(D);
-        case 0x2B: return sraR8(E);
-        case 0x2C: return sraR8(H);
-        case 0x2D: return sraR8(L);
-        case 0x2E: return sraM8(HL);
-        case 0x2F: return sraR8(A);
-
-        case 0x30: return swapR8(B);
-        case 0x31: return swapR8(C);
-        case 0x32: return swapR8(D);
-        case 0x33: return swapR8(E);
-        case 0x34: return swapR8(H);
-        case 0x35: return swapR8(L);
-        case 0x36: return swapM8(HL);
-        case 0x37: return swapR8(A);
-
-        case 0x38: return srlR8(B);
-        case 0x39: return srlR8(C);
-        case 0x3A: return srlR8(D);
-        case 0x3B: return srlR8(E);
-        case 0x3C: return srlR8(H);
-        case 0x3D: return srlR8(L);
-        case 0x3E: return srlM8(HL);
-        case 0x3F: return srlR8(A);
-
-        case 0x40: return bitR8(B, 0);
-        case 0x41: return bitR8(C, 0);
-        case 0x42: return bitR8(D, 0);
-        case 0x43: return bitR8(E, 0);
-        case 0x44: return bitR8(H, 0);
-        case 0x45: return bitR8(L, 0);
-        case 0x46: return bitM8(HL, 0);
-        case 0x47: return bitR8(A, 0);
-        case 0x48: return bitR8(B, 1);
-        case 0x49: return bitR8(C, 1);
-        case 0x4A: return bitR8(D, 1);
-        case 0x4B: return bitR8(E, 1);
-        case 0x4C: return bitR8(H, 1);
-        case 0x4D: return bitR8(L, 1);
-        case 0x4E: return bitM8(HL, 1);
-        case 0x4F: return bitR8(A, 1);
-
-        case 0x50: return bitR8(B, 2);
-        case 0x51: return bitR8(C, 2);
-        case 0x52: return bitR8(D, 2);
-        case 0x53: return bitR8(E, 2);
-        case 0x54: return bitR8(H, 2);
-        case 0x55: return bitR8(L, 2);
-        case 0x56: return bitM8(HL, 2);
-        case 0x57: return bitR8(A, 2);
-        case 0x58: return bitR8(B, 3);
-        case 0x59: return bitR8(C, 3);
-        case 0x5A: return bitR8(D, 3);
-        case 0x5B: return bitR8(E, 3);
-        case 0x5C: return bitR8(H, 3);
-        case 0x5D: return bitR8(L, 3);
-        case 0x5E: return bitM8(HL, 3);
-        case 0x5F: return bitR8(A, 3);
-
-        case 0x60: return bitR8(B, 4);
-        case 0x61: return bitR8(C, 4);
-        case 0x62: return bitR8(D, 4);
-        case 0x63: return bitR8(E, 4);
-        case 0x64: return bitR8(H, 4);
-        case 0x65: return bitR8(L, 4);
-        case 0x66: return bitM8(HL, 4);
-        case 0x67: return bitR8(A, 4);
-        case 0x68: return bitR8(B, 5);
-        case 0x69: return bitR8(C, 5);
-        case 0x6A: return bitR8(D, 5);
-        case 0x6B: return bitR8(E, 5);
-        case 0x6C: return bitR8(H, 5);
-        case 0x6D: return bitR8(L, 5);
-        case 0x6E: return bitM8(HL, 5);
-        case 0x6F: return bitR8(A, 5);
-
-        case 0x70: return bitR8(B, 6);
-        case 0x71: return bitR8(C, 6);
-        case 0x72: return bitR8(D, 6);
-        case 0x73: return bitR8(E, 6);
-        case 0x74: return bitR8(H, 6);
-        case 0x75: return bitR8(L, 6);
-        case 0x76: return bitM8(HL, 6);
-        case 0x77: return bitR8(A, 6);
-        case 0x78: return bitR8(B, 7);
-        case 0x79: return bitR8(C, 7);
-        case 0x7A: return bitR8(D, 7);
-        case 0x7B: return bitR8(E, 7);
-        case 0x7C: return bitR8(H, 7);
-        case 0x7D: return bitR8(L, 7);
-        case 0x7E: return bitM8(HL, 7);
-        case 0x7F: return bitR8(A, 7);
-
-        case 0x80: return resR8(B, 0);
-        case 0x81: return resR8(C, 0);
-        case 0x82: return resR8(D, 0);
-        case 0x83: return resR8(E, 0);
-        case 0x84: return resR8(H, 0);
-        case 0x85: return resR8(L, 0);
-        case 0x86: return resM8(HL, 0);
-        case 0x87: return resR8(A, 0);
-        case 0x88: return resR8(B, 1);
-        case 0x89: return resR8(C, 1);
-        case 0x8A: return resR8(D, 1);
-        case 0x8B: return resR8(E, 1);
-        case 0x8C: return resR8(H, 1);
-        case 0x8D: return resR8(L, 1);
-        case 0x8E: return resM8(HL, 1);
-        case 0x8F: return resR8(A, 1);
-
-        case 0x90: return resR8(B, 2);
-        case 0x91: return resR8(C, 2);
-        case 0x92: return resR8(D, 2);
-        case 0x93: return resR8(E, 2);
-        case 0x94: return resR8(H, 2);
-        case 0x95: return resR8(L, 2);
-        case 0x96: return resM8(HL, 2);
-        case 0x97: return resR8(A, 2);
-        case 0x98: return resR8(B, 3);
-        case 0x99: return resR8(C, 3);
-        case 0x9A: return resR8(D, 3);
-        case 0x9B: return resR8(E, 3);
-        case 0x9C: return resR8(H, 3);
-        case 0x9D: return resR8(L, 3);
-        case 0x9E: return resM8(HL, 3);
-        case 0x9F: return resR8(A, 3);
-
-        case 0xA0: return resR8(B, 4);
-        case 0xA1: return resR8(C, 4);
-        case 0xA2: return resR8(D, 4);
-        case 0xA3: return resR8(E, 4);
-        case 0xA4: return resR8(H, 4);
-        case 0xA5: return resR8(L, 4);
-        case 0xA6: return resM8(HL, 4);
-        case 0xA7: return resR8(A, 4);
-        case 0xA8: return resR8(B, 5);
-        case 0xA9: return resR8(C, 5);
-        case 0xAA: return resR8(D, 5);
-        case 0xAB: return resR8(E, 5);
-        case 0xAC: return resR8(H, 5);
-        case 0xAD: return resR8(L, 5);
-        case 0xAE: return resM8(HL, 5);
-        case 0xAF: return resR8(A, 5);
-
-        case 0xB0: return resR8(B, 6);
-        case 0xB1: return resR8(C, 6);
-        case 0xB2: return resR8(D, 6);
-        case 0xB3: return resR8(E, 6);
-        case 0xB4: return resR8(H, 6);
-        case 0xB5: return resR8(L, 6);
-        case 0xB6: return resM8(HL, 6);
-        case 0xB7: return resR8(A, 6);
-        case 0xB8: return resR8(B, 7);
-        case 0xB9: return resR8(C, 7);
-        case 0xBA: return resR8(D, 7);
-        case 0xBB: return resR8(E, 7);
-        case 0xBC: return resR8(H, 7);
-        case 0xBD: return resR8(L, 7);
-        case 0xBE: return resM8(HL, 7);
-        case 0xBF: return resR8(A, 7);
-
-        case 0xC0: return setR8(B, 0);
-        case 0xC1: return setR8(C, 0);
-        case 0xC2: return setR8(D, 0);
-        case 0xC3: return setR8(E, 0);
-        case 0xC4: return setR8(H, 0);
-        case 0xC5: return setR8(L, 0);
-        case 0xC6: return setM8(HL, 0);
-        case 0xC7: return setR8(A, 0);
-        case 0xC8: return setR8(B, 1);
-        case 0xC9: return setR8(C, 1);
-        case 0xCA: return setR8(D, 1);
-        case 0xCB: return setR8(E, 1);
-        case 0xCC: return setR8(H, 1);
-        case 0xCD: return setR8(L, 1);
-        case 0xCE: return setM8(HL, 1);
-        case 0xCF: return setR8(A, 1);
-
-        case 0xD0: return setR8(B, 2);
-        case 0xD1: return setR8(C, 2);
-        case 0xD2: return setR8(D, 2);
-        case 0xD3: return setR8(E, 2);
-        case 0xD4: return setR8(H, 2);
-        case 0xD5: return setR8(L, 2);
-        case 0xD6: return setM8(HL, 2);
-        case 0xD7: return setR8(A, 2);
-        case 0xD8: return setR8(B, 3);
-        case 0xD9: return setR8(C, 3);
-        case 0xDA: return setR8(D, 3);
-        case 0xDB: return setR8(E, 3);
-        case 0xDC: return setR8(H, 3);
-        case 0xDD: return setR8(L, 3);
-        case 0xDE: return setM8(HL, 3);
-        case 0xDF: return setR8(A, 3);
-
-        case 0xE0: return setR8(B, 4);
-        case 0xE1: return setR8(C, 4);
-        case 0xE2: return setR8(D, 4);
-        case 0xE3: return setR8(E, 4);
-        case 0xE4: return setR8(H, 4);
-        case 0xE5: return setR8(L, 4);
-        case 0xE6: return setM8(HL, 4);
-        case 0xE7: return setR8(A, 4);
-        case 0xE8: return setR8(B, 5);
-        case 0xE9: return setR8(C, 5);
-        case 0xEA: return setR8(D, 5);
-        case 0xEB: return setR8(E, 5);
-        case 0xEC: return setR8(H, 5);
-        case 0xED: return setR8(L, 5);
-        case 0xEE: return setM8(HL, 5);
-        case 0xEF: return setR8(A, 5);
-
-        case 0xF0: return setR8(B, 6);
-        case 0xF1: return setR8(C, 6);
-        case 0xF2: return setR8(D, 6);
-        case 0xF3: return setR8(E, 6);
-        case 0xF4: return setR8(H, 6);
-        case 0xF5: return setR8(L, 6);
-        case 0xF6: return setM8(HL, 6);
-        case 0xF7: return setR8(A, 6);
-        case 0xF8: return setR8(B, 7);
-        case 0xF9: return setR8(C, 7);
-        case 0xFA: return setR8(D, 7);
-        case 0xFB: return setR8(E, 7);
-        case 0xFC: return setR8(H, 7);
-        case 0xFD: return setR8(L, 7);
-        case 0xFE: return setM8(HL, 7);
-        case 0xFF: return setR8(A, 7);
-
-        default:
-        {
-            std::cerr << "Unknown opcode 0xCB 0x" << std::hex << +opcode << std::endl;
-            throw std::invalid_argument("Unknown opcode");
-        }
-    }
+    return (this->*opcodeTableCB[opcode])();
 }
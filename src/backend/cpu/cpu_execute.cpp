@@ -1,97 +1,64 @@
 #include "cpu.h"
 
-template<>
-[[nodiscard]] uint8 CPU::carryAndHalfCarry<int8, true>(int8 a, int8 b)
+void CPU::materializeFlags()
 {
-    uint8 flag = 0;
-    if (b >= 0)
-    {
-        if (((a & 0xFF) + (b)) > 0xFF)
-            flag |= FFlags.C;
-        if (((a & 0xF) + (b & 0xF)) > 0xF)
-            flag |= FFlags.H;
-    }
-    else
-    {
-        if (((a + b) & 0xFF) <= (a & 0xFF))
-            flag |= FFlags.C;
-        if (((a + b) & 0xF) <= (a & 0xF))
-            flag |= FFlags.H;
-    }
-    return flag;
+    F = 0;
+    if (flagZ())
+        F |= FFlags.Z;
+    if (flagSubtract)
+        F |= FFlags.N;
+    if (flagH())
+        F |= FFlags.H;
+    if (flagC())
+        F |= FFlags.C;
 }
 
-template<>
-[[nodiscard]] uint8 CPU::carryAndHalfCarry<uint8, true>(uint8 a, uint8 b)
+void CPU::unpackFlags()
 {
-    uint8 flag = 0;
+    F &= ~FFlags.alwaysLow;
 
-    if (((a & 0xFF) + (b)) > 0xFF)
-        flag |= FFlags.C;
-    if (((a & 0xF) + (b & 0xF)) > 0xF)
-        flag |= FFlags.H;
-
-    return flag;
+    flagZeroSource = (F & FFlags.Z) ? 0 : 1;
+    flagSubtract = F & FFlags.N;
+    flagHalfCarrySource = (F & FFlags.H) ? 0x10 : 0;
+    flagCarrySource = (F & FFlags.C) ? 0x100 : 0;
 }
 
-template<>
-[[maybe_unused]] [[nodiscard]] uint8 CPU::carryAndHalfCarry<int16, true>(int16 a, int16 b)
+void CPU::setArithmeticFlags(uint8 a, uint8 b, uint16 result, bool subtract)
 {
-    uint8 flag = 0;
-    if (b >= 0)
-    {
-        if (((a & 0xFFFF) + (b)) > 0xFFFF)
-            flag |= FFlags.C;
-        if (((a & 0xFFF) + (b & 0xFFF)) > 0xFFF)
-            flag |= FFlags.H;
-    }
-    else
-    {
-        if (((a + b) & 0xFFFF) <= (a & 0xFFFF))
-            flag |= FFlags.C;
-        if (((a + b) & 0xFFF) <= (a & 0xFFF))
-            flag |= FFlags.H;
-    }
-    return flag;
+    // `result` is the full width `a + b (+ carry)` or `a - b (- carry)`.
+    // Bit 8 of it is the carry (or borrow) out of bit 7.
+    // Bit 4 of `a ^ b ^ result` is the carry (or borrow) out of bit 3.
+    flagZeroSource = static_cast<uint8>(result);
+    flagSubtract = subtract;
+    flagHalfCarrySource = a ^ b ^ result;
+    flagCarrySource = result;
 }
 
-template<>
-[[nodiscard]] uint8 CPU::carryAndHalfCarry<uint16, true>(uint16 a, uint16 b)
+void CPU::setOffsetFlags(uint16 a, int8 offset, uint16 result)
 {
-    uint8 flag = 0;
-
-    if (((a & 0xFFFF) + (b)) > 0xFFFF)
-        flag |= FFlags.C;
-    if (((a & 0xFFF) + (b & 0xFFF)) > 0xFFF)
-        flag |= FFlags.H;
-
-    return flag;
+    // ADD SP,e8 and LD HL,SP+e8 compute H and C on the unsigned low byte.
+    // Z and N are always reset.
+    const uint16 carries = a ^ static_cast<uint16>(offset) ^ result;
+    flagZeroSource = 1;
+    flagSubtract = false;
+    flagHalfCarrySource = carries;
+    flagCarrySource = carries;
 }
 
-template<>
-[[nodiscard]] uint8 CPU::carryAndHalfCarry<uint8, false>(uint8 a, uint8 b)
+void CPU::setLogicFlags(uint8 result, bool halfCarry)
 {
-    uint8 flag = 0;
-
-    if (b > a)
-        flag |= FFlags.C;
-    if ((a & 0xF) - (b & 0xF) < 0)
-        flag |= FFlags.H;
-
-    return flag;
+    flagZeroSource = result;
+    flagSubtract = false;
+    flagHalfCarrySource = halfCarry ? 0x10 : 0;
+    flagCarrySource = 0;
 }
 
-template<>
-[[nodiscard]] uint8 CPU::carryAndHalfCarry<uint16, false>(uint16 a, uint16 b)
+void CPU::setShiftFlags(uint8 result, bool carry)
 {
-    uint8 flag = 0;
-
-    if (b > a)
-        flag |= FFlags.C;
-    if ((a & 0xFFF) - (b & 0xFFF) < 0)
-        flag |= FFlags.H;
-
-    return flag;
+    flagZeroSource = result;
+    flagSubtract = false;
+    flagHalfCarrySource = 0;
+    flagCarrySource = carry ? 0x100 : 0;
 }
 
 uint16 CPU::halt()
@@ -99,7 +66,7 @@ uint16 CPU::halt()
     // If IME is disabled and we have interrupt waiting to be serviced...
     if (IME == IMEState::DISABLED || IME == IMEState::ENABLED_AFTER)
     {
-        if (checkInterrupts())
+        if (isInterruptPending())
         {
             // Do not halt but execute twice next instruction
             missOnePCIncrement = true;
@@ -112,6 +79,21 @@ uint16 CPU::halt()
     return 4;
 }
 
+uint16 CPU::lockUp(uint8 opcode)
+{
+    if (!crashed)
+    {
+        crashed = true;
+        crashAddress = PC - 1;
+        crashedOpcode = opcode;
+    }
+
+    // Stay on the illegal opcode
+    --PC;
+    IME = IMEState::DISABLED;
+    return 4;
+}
+
 uint16 CPU::nop()
 {
     (void)this;
@@ -132,17 +114,30 @@ uint16 CPU::pop(uint16 &reg)
     return 12;
 }
 
+uint16 CPU::pushAF()
+{
+    materializeFlags();
+    return push(AF);
+}
+
+uint16 CPU::popAF()
+{
+    pop(AF);
+    unpackFlags();
+    return 12;
+}
+
 uint16 CPU::DAA()
 {
     // Shameless taken from https://ehaskins.com/2018-01-30%20Z80%20DAA/
     // because yeah...
     uint8 correction = 0;
 
-    const bool FH = F & FFlags.H;
-    const bool FN = F & FFlags.N;
-    const bool FC = F & FFlags.C;
+    const bool FH = flagH();
+    const bool FN = flagSubtract;
+    const bool FC = flagC();
 
-    uint8 setFlagC = false;
+    bool setFlagC = false;
     if (FH || (!FN && (A & 0xFu) > 9))
     {
         correction |= 0x6u;
@@ -151,25 +146,24 @@ uint16 CPU::DAA()
     if (FC || (!FN && A > 0x99u))
     {
         correction |= 0x60u;
-        setFlagC = FFlags.C;
+        setFlagC = true;
     }
 
     A += FN ? -correction : correction;
 
     A &= 0xFFu;
 
-    const uint8 setFlagZ = A == 0 ? FFlags.Z : 0;
-
-    F &= ~(FFlags.H | FFlags.Z | FFlags.C);
-    F |= setFlagC | setFlagZ;
+    flagZeroSource = A;
+    flagHalfCarrySource = 0;
+    flagCarrySource = setFlagC ? 0x100 : 0;
 
     return 4;
 }
 
 uint16 CPU::CPL()
 {
-    F |= FFlags.N;
-    F |= FFlags.H;
+    flagSubtract = true;
+    flagHalfCarrySource = 0x10;
     A = ~A;
 
     return 4;
@@ -177,17 +171,17 @@ uint16 CPU::CPL()
 
 uint16 CPU::SCF()
 {
-    F &= ~FFlags.N;
-    F &= ~FFlags.H;
-    F |= FFlags.C;
+    flagSubtract = false;
+    flagHalfCarrySource = 0;
+    flagCarrySource = 0x100;
     return 4;
 }
 
 uint16 CPU::CCF()
 {
-    F &= ~FFlags.N;
-    F &= ~FFlags.H;
-    F ^= FFlags.C;
+    flagSubtract = false;
+    flagHalfCarrySource = 0;
+    flagCarrySource ^= 0x100;
     return 4;
 }
 
@@ -392,24 +386,19 @@ uint16 CPU::LDHL()
     const auto value = static_cast<int8>(fetch8(PC));
     ++PC;
 
-    F = 0;
-    F |= carryAndHalfCarry<int8>(SP, value);
+    const uint16 result = SP + value;
+    setOffsetFlags(SP, value, result);
 
-    HL = SP + value;
+    HL = result;
     return 12;
 }
 
 uint16 CPU::addR8ToA(uint8 reg)
 {
-    F = 0;
-    F |= carryAndHalfCarry<uint8>(A, reg);
-
-    A += reg;
+    const uint16 result = A + reg;
+    setArithmeticFlags(A, reg, result, false);
 
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    A = result;
     return 4;
 }
 
@@ -430,13 +419,14 @@ uint16 CPU::addD8ToA()
 
 uint16 CPU::addR16ToHL(uint16 reg)
 {
-    F &= ~FFlags.N;
-    F &= ~FFlags.H;
-    F &= ~FFlags.C;
+    const uint32 result = HL + reg;
 
-    F |= carryAndHalfCarry<uint16>(HL, reg);
+    // Z is untouched, H and C are the carries out of bit 11 and 15.
+    flagSubtract = false;
+    flagHalfCarrySource = (HL ^ reg ^ result) >> 8u;
+    flagCarrySource = result >> 8u;
 
-    HL += reg;
+    HL = result;
     return 8;
 }
 
@@ -444,35 +434,21 @@ uint16 CPU::addD8ToSP()
 {
     const auto reg = static_cast<int8>(fetch8(PC));
     ++PC;
-    F = 0;
 
-    F |= carryAndHalfCarry<int8>(SP, reg);
+    const uint16 result = SP + reg;
+    setOffsetFlags(SP, reg, result);
 
-    SP += reg;
+    SP = result;
 
     return 16;
 }
 
 uint16 CPU::adcR8ToA(uint8 reg)
 {
-    bool carry = F & FFlags.C;
+    const uint16 result = A + reg + flagC();
+    setArithmeticFlags(A, reg, result, false);
 
-    F = 0;
-    F |= carryAndHalfCarry<uint8>(A, reg);
-
-    if (carry)
-    {
-        F |= carryAndHalfCarry<uint8>(reg, 1);
-        ++reg;
-        F |= carryAndHalfCarry<uint8>(A, reg);
-    }
-
-    A += reg;
-
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    A = result;
     return 4;
 }
 
@@ -493,16 +469,10 @@ uint16 CPU::adcD8ToA()
 
 uint16 CPU::subR8ToA(uint8 reg)
 {
-    F = 0;
-    F |= FFlags.N;
-    F |= carryAndHalfCarry<uint8, false>(A, reg);
-
-    A -= reg;
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    const uint16 result = A - reg;
+    setArithmeticFlags(A, reg, result, true);
 
+    A = result;
     return 4;
 }
 
@@ -523,25 +493,10 @@ uint16 CPU::subD8ToA()
 
 uint16 CPU::sbcR8ToA(uint8 reg)
 {
-    bool carry = F & FFlags.C;
-
-    F = 0;
-    F |= FFlags.N;
-    F |= carryAndHalfCarry<uint8, false>(A, reg);
-
-    if (carry)
-    {
-        F |= carryAndHalfCarry<uint8>(reg, 1);
-        ++reg;
-        F |= carryAndHalfCarry<uint8, false>(A, reg);
-    }
-
-    A -= reg;
+    const uint16 result = A - reg - flagC();
+    setArithmeticFlags(A, reg, result, true);
 
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    A = result;
     return 4;
 }
 
@@ -564,12 +519,7 @@ uint16 CPU::andR8ToA(uint8 reg)
 {
     A = A & reg;
 
-    F = 0;
-    F |= FFlags.H;
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setLogicFlags(A, true);
     return 4;
 }
 
@@ -592,11 +542,7 @@ uint16 CPU::orR8ToA(uint8 reg)
 {
     A = A | reg;
 
-    F = 0;
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setLogicFlags(A, false);
     return 4;
 }
 
@@ -619,11 +565,7 @@ uint16 CPU::xorR8ToA(uint8 reg)
 {
     A = A ^ reg;
 
-    F = 0;
-    if (A == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setLogicFlags(A, false);
     return 4;
 }
 
@@ -644,14 +586,8 @@ uint16 CPU::xorD8ToA()
 
 uint16 CPU::cpR8ToA(uint8 reg)
 {
-    F = 0;
-    F |= FFlags.N;
-    F |= carryAndHalfCarry<uint8, false>(A, reg);
-
-    if (A == reg)
-    {
-        F |= FFlags.Z;
-    }
+    const uint16 result = A - reg;
+    setArithmeticFlags(A, reg, result, true);
 
     return 4;
 }
@@ -673,19 +609,14 @@ uint16 CPU::cpD8ToA()
 
 uint16 CPU::incR8(uint8 &reg)
 {
-    F &= ~FFlags.Z;
-    F &= ~FFlags.N;
+    const uint8 result = reg + 1;
 
-    F &= ~FFlags.H;
-    F |= carryAndHalfCarry<uint8, true>(reg, 1) & FFlags.H;
-
-    ++reg;
-
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    // C is untouched.
+    flagZeroSource = result;
+    flagSubtract = false;
+    flagHalfCarrySource = reg ^ 1u ^ result;
 
+    reg = result;
     return 4;
 }
 
@@ -706,19 +637,14 @@ uint16 CPU::incR16(uint16 &reg)
 
 uint16 CPU::decR8(uint8 &reg)
 {
-    F &= ~FFlags.Z;
-    F |= FFlags.N;
+    const uint8 result = reg - 1;
 
-    F &= ~FFlags.H;
-    F |= carryAndHalfCarry<uint8, false>(reg, 1) & FFlags.H;
-
-    --reg;
-
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    // C is untouched.
+    flagZeroSource = result;
+    flagSubtract = true;
+    flagHalfCarrySource = reg ^ 1u ^ result;
 
+    reg = result;
     return 4;
 }
 
@@ -739,89 +665,47 @@ uint16 CPU::decR16(uint16 &reg)
 
 uint16 CPU::rlca()
 {
-    F = 0;
-
-    if (A & (1u << 7u))
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = A & (1u << 7u);
     A = rol(A);
+
+    // Unlike RLC A, Z is always reset.
+    setShiftFlags(1, carry);
     return 4;
 }
 
 uint16 CPU::rrca()
 {
-    F = 0;
-
-    if (A & 1u)
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = A & 1u;
     A = ror(A);
+
+    setShiftFlags(1, carry);
     return 4;
 }
 
 uint16 CPU::rla()
 {
-    uint8 carryBit = A & (1u << 7u);
-    A = rol(A);
-
-    if (F & FFlags.C)
-    {
-        A |= 1u;
-    }
-    else
-    {
-        A &= ~1u;
-    }
-
-    F = 0;
-
-    if (carryBit)
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = A & (1u << 7u);
+    A = (A << 1u) | static_cast<uint8>(flagC());
 
+    setShiftFlags(1, carry);
     return 4;
 }
 
 uint16 CPU::rra()
 {
-    uint8 carryBit = A & 1u;
-    A = ror(A);
-
-    if (F & FFlags.C)
-    {
-        A |= (1u << 7u);
-    }
-    else
-    {
-        A &= ~(1u << 7u);
-    }
-
-    F = 0;
-
-    if (carryBit)
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = A & 1u;
+    A = (A >> 1u) | (static_cast<uint8>(flagC()) << 7u);
 
+    setShiftFlags(1, carry);
     return 4;
 }
 
 uint16 CPU::rlcR8(uint8 &reg)
 {
-    F = 0;
-
-    if (reg & (1u << 7u))
-    {
-        F |= FFlags.C;
-    }
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    const bool carry = reg & (1u << 7u);
     reg = rol(reg);
+
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -835,17 +719,10 @@ uint16 CPU::rlcM8(uint16 addr)
 
 uint16 CPU::rrcR8(uint8 &reg)
 {
-    F = 0;
-
-    if (reg & 1u)
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = reg & 1u;
     reg = ror(reg);
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -859,29 +736,10 @@ uint16 CPU::rrcM8(uint16 addr)
 
 uint16 CPU::rlR8(uint8 &reg)
 {
-    uint8 carryBit = reg & (1u << 7u);
-    reg = rol(reg);
-
-    if (F & FFlags.C)
-    {
-        reg |= 1u;
-    }
-    else
-    {
-        reg &= ~1u;
-    }
-
-    F = 0;
-
-    if (carryBit)
-    {
-        F |= FFlags.C;
-    }
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    const bool carry = reg & (1u << 7u);
+    reg = (reg << 1u) | static_cast<uint8>(flagC());
 
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -895,29 +753,10 @@ uint16 CPU::rlM8(uint16 addr)
 
 uint16 CPU::rrR8(uint8 &reg)
 {
-    uint8 carryBit = reg & 1u;
-    reg = ror(reg);
-
-    if (F & FFlags.C)
-    {
-        reg |= (1u << 7u);
-    }
-    else
-    {
-        reg &= ~(1u << 7u);
-    }
-
-    F = 0;
-
-    if (carryBit)
-    {
-        F |= FFlags.C;
-    }
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    const bool carry = reg & 1u;
+    reg = (reg >> 1u) | (static_cast<uint8>(flagC()) << 7u);
 
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -931,18 +770,10 @@ uint16 CPU::rrM8(uint16 addr)
 
 uint16 CPU::slaR8(uint8 &reg)
 {
-    F = 0;
-
-    if (reg & (1u << 7u))
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = reg & (1u << 7u);
     reg <<= 1u;
 
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -956,20 +787,12 @@ uint16 CPU::slaM8(uint16 addr)
 
 uint16 CPU::sraR8(uint8 &reg)
 {
-    F = 0;
-
+    const bool carry = reg & 1u;
     const uint8 bit7 = reg & (1u << 7u);
-    if (reg & 1u)
-    {
-        F |= FFlags.C;
-    }
     reg >>= 1u;
     reg |= bit7;
 
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -983,18 +806,10 @@ uint16 CPU::sraM8(uint16 addr)
 
 uint16 CPU::srlR8(uint8 &reg)
 {
-    F = 0;
-
-    if (reg & 1u)
-    {
-        F |= FFlags.C;
-    }
+    const bool carry = reg & 1u;
     reg >>= 1u;
 
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+    setShiftFlags(reg, carry);
     return 8;
 }
 
@@ -1008,12 +823,9 @@ uint16 CPU::srlM8(uint16 addr)
 
 uint16 CPU::swapR8(uint8 &reg)
 {
-    F = 0;
     reg = ((reg & 0xF0u) >> 4u) | ((reg & 0x0Fu) << 4u);
-    if (reg == 0)
-    {
-        F |= FFlags.Z;
-    }
+
+    setShiftFlags(reg, false);
     return 8;
 }
 
@@ -1027,17 +839,10 @@ uint16 CPU::swapM8(uint16 addr)
 
 uint16 CPU::bitR8(uint8 reg, const uint8 bitIndex)
 {
-    F &= ~FFlags.N;
-    F |= FFlags.H;
-
-    if (reg & (1u << bitIndex))
-    {
-        F &= ~FFlags.Z;
-    }
-    else
-    {
-        F |= FFlags.Z;
-    }
+    // C is untouched.
+    flagZeroSource = reg & (1u << bitIndex);
+    flagSubtract = false;
+    flagHalfCarrySource = 0x10;
     return 8;
 }
 
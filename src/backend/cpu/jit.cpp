@@ -0,0 +1,687 @@
+#ifdef FRACTAL_JIT
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "cpu.h"
+
+JIT::JIT(CPU &cpu) : cpu(cpu)
+{
+    static_assert(sizeof(CPU::IMEState) == 4, "Native code compare IME as a 32 bit value");
+
+    // W^X: the buffer is never writable and executable at once, see `setWritable`
+    void *memory = mmap(nullptr, codeCapacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        throw std::runtime_error("Can not allocate executable memory for the JIT");
+    }
+    code = static_cast<uint8*>(memory);
+}
+
+JIT::~JIT()
+{
+    munmap(code, codeCapacity);
+}
+
+void JIT::clear()
+{
+    codeUsed = 0;
+}
+
+BlockCache::NativeCode JIT::compile(const BlockCache::Block &block, const BlockCache::MicroOp *microOps)
+{
+    if (codeUsed + (block.count + 1) * maxInstructionSize > codeCapacity)
+    {
+        return nullptr;
+    }
+
+    const int32 IMEOffset = offsetOf(&cpu.IME);
+    const int32 PCOffset = offsetOf(&cpu.PC);
+    const int32 clockOffset = schedulerOffsetOf(&cpu.scheduler.clock);
+    const int32 nextTimestampOffset = schedulerOffsetOf(&cpu.scheduler.nextTimestamp);
+
+    uint8 *const start = code + codeUsed;
+    setWritable(start, (block.count + 1) * maxInstructionSize, true);
+    X64Emitter emitter(start);
+    std::vector<X64Emitter::Label> exits;
+
+    emitter.prologue();
+    emitter.movRBP(&cpu.scheduler);
+    emitter.watch(&cpu.memory.codeMappingChanges);
+
+    uint16 PC = block.PC;
+    uint8 previousOpcode = 0;
+    for (uint32 i = 0; i < block.count; ++i)
+    {
+        const BlockCache::MicroOp &microOp = microOps[i];
+        const uint8 opcode = cpu.memory.read8(PC);
+        const uint16 nextPC = PC + microOp.length;
+        const bool isLast = i + 1 == block.count;
+
+        // IME is enabled one instruction after EI, which may have been executed before the block
+        const bool mayEnableIME = i == 0 || previousOpcode == 0xFB;
+        if (mayEnableIME)
+        {
+            emitter.cmpM32(IMEOffset, static_cast<uint8>(CPU::IMEState::ENABLED_AFTER));
+            const X64Emitter::Label notEnabledAfter = emitter.jump(X64Emitter::Condition::NotEqual);
+            emitter.movM32(IMEOffset, static_cast<uint32>(CPU::IMEState::ENABLED));
+            emitter.bind(notEnabledAfter);
+        }
+
+        // Native code only updates PC on jumps. Handlers update it themselves.
+        bool isPCUpToDate = true;
+        const uint16 cycles = emitNative(emitter, PC, opcode);
+        if (cycles == cyclesInEAX)
+        {
+            emitter.addRBPM64FromRAX(clockOffset);
+        }
+        else if (cycles != 0)
+        {
+            emitter.addRBPM64(clockOffset, cycles);
+            isPCUpToDate = opcode == 0xC3 || opcode == 0x18 || opcode == 0xCD || opcode == 0xC9;
+        }
+        else
+        {
+            emitter.movM16(PCOffset, PC + microOp.opcodeLength);
+            emitter.movRDIFromRBX();
+            if (opcode == 0xCB)
+            {
+                emitter.call(CPU::opcodeFunctionTableCB[cpu.memory.read8(PC + 1)]);
+            }
+            else
+            {
+                emitter.call(CPU::opcodeFunctionTable[opcode]);
+            }
+            emitter.movzxEAXFromAX();
+            emitter.addRBPM64FromRAX(clockOffset);
+        }
+
+        // Run due events, then leave if they requested an interrupt which must be serviced
+        emitter.movRAXFromRBPM64(clockOffset);
+        emitter.cmpRAXWithRBPM64(nextTimestampOffset);
+        const X64Emitter::Label noEventDue = emitter.jump(X64Emitter::Condition::Below);
+        if (!isPCUpToDate)
+        {
+            emitter.movM16(PCOffset, nextPC);
+        }
+        emitter.movRDIFromRBX();
+        emitter.call(&JIT::runDueEvents);
+        emitter.testAL();
+        exits.push_back(emitter.jump(X64Emitter::Condition::NotEqual));
+        emitter.bind(noEventDue);
+
+        if (isLast)
+        {
+            if (!isPCUpToDate)
+            {
+                emitter.movM16(PCOffset, nextPC);
+            }
+            checkSize(emitter, i + 1);
+            break;
+        }
+
+        const bool isWrite = writesMemory(PC, opcode);
+        if ((isWrite || mayEnableIME) && !isPCUpToDate)
+        {
+            emitter.movM16(PCOffset, nextPC);
+        }
+        if (isWrite)
+        {
+            // Leave when the next instruction may not be mapped anymore, the interpreter will check it
+            emitter.cmpWatched();
+            exits.push_back(emitter.jump(X64Emitter::Condition::NotEqual));
+        }
+        if (isWrite || mayEnableIME)
+        {
+            // Leave if an interrupt must be serviced
+            emitter.cmpM32(IMEOffset, static_cast<uint8>(CPU::IMEState::ENABLED));
+            const X64Emitter::Label IMEDisabled = emitter.jump(X64Emitter::Condition::NotEqual);
+            emitter.cmpAbsoluteM8(&cpu.memory.pendingInterruptsMask, 0);
+            exits.push_back(emitter.jump(X64Emitter::Condition::NotEqual));
+            emitter.bind(IMEDisabled);
+        }
+
+        checkSize(emitter, i + 1);
+        previousOpcode = opcode;
+        PC = nextPC;
+    }
+
+    for (X64Emitter::Label exit : exits)
+    {
+        emitter.bind(exit);
+    }
+    emitter.epilogue();
+    checkSize(emitter, block.count + 1);
+
+    setWritable(start, (block.count + 1) * maxInstructionSize, false);
+
+    // Keep blocks 16 bytes aligned
+    codeUsed += (emitter.size() + 15u) & ~static_cast<size_t>(15u);
+
+    return reinterpret_cast<BlockCache::NativeCode>(start);
+}
+
+uint16 JIT::emitNative(X64Emitter &emitter, const uint16 PC, const uint8 opcode) const
+{
+    using Register = X64Emitter::Register;
+    const int32 PCOffset = offsetOf(&cpu.PC);
+    const uint8 destination = (opcode >> 3u) & 0x7u;
+    const uint8 source = opcode & 0x7u;
+
+    // LD r,r
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76 && destination != 6 && source != 6)
+    {
+        if (destination != source)
+        {
+            emitter.movzxFromM8(Register::EAX, registerOffset(source));
+            emitter.movM8From(registerOffset(destination), Register::EAX);
+        }
+        return 4;
+    }
+
+    // LD r,(HL)
+    if (opcode >= 0x40 && opcode < 0x80 && opcode != 0x76 && source == 6)
+    {
+        emitter.movzxFromM16(Register::ESI, offsetOf(&cpu.HL));
+        emitRead(emitter);
+        emitter.movM8From(registerOffset(destination), Register::EAX);
+        return 8;
+    }
+
+    // LD (HL),r
+    if (opcode >= 0x70 && opcode < 0x78 && opcode != 0x76)
+    {
+        emitter.movzxFromM16(Register::ESI, offsetOf(&cpu.HL));
+        emitter.movzxFromM8(Register::EAX, registerOffset(source));
+        emitWrite(emitter);
+        return 8;
+    }
+
+    // ADD, SUB, AND, XOR, OR, CP r and (HL)
+    if (opcode >= 0x80 && opcode < 0xC0)
+    {
+        const uint8 operation = destination;
+        if (operation == 1 || operation == 3)
+        {
+            // ADC, SBC
+            return 0;
+        }
+        if (source == 6)
+        {
+            emitter.movzxFromM16(Register::ESI, offsetOf(&cpu.HL));
+            emitRead(emitter);
+            emitter.mov(Register::ECX, Register::EAX);
+        }
+        else
+        {
+            emitter.movzxFromM8(Register::ECX, registerOffset(source));
+        }
+        emitALU(emitter, operation);
+        return source == 6 ? 8 : 4;
+    }
+
+    switch (opcode)
+    {
+        // NOP
+        case 0x00:
+            return 4;
+
+        // LD r,d8
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+            emitter.movM8(registerOffset(destination), cpu.memory.read8(PC + 1));
+            return 8;
+
+        // INC r
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+            emitIncDec(emitter, destination, false);
+            return 4;
+
+        // DEC r
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+            emitIncDec(emitter, destination, true);
+            return 4;
+
+        // ADD, SUB, AND, XOR, OR, CP d8
+        case 0xC6: case 0xD6: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            emitter.mov(Register::ECX, cpu.memory.read8(PC + 1));
+            emitALU(emitter, destination);
+            return 8;
+
+        // LD A,(BC), LD A,(DE), LD A,(HL+), LD A,(HL-)
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A:
+        {
+            const uint16 *const registers[] = {&cpu.BC, &cpu.DE, &cpu.HL, &cpu.HL};
+            emitter.movzxFromM16(Register::ESI, offsetOf(registers[opcode >> 4u]));
+            emitRead(emitter);
+            emitter.movM8From(registerOffset(7), Register::EAX);
+            if (opcode == 0x2A)
+            {
+                emitter.incM16(offsetOf(&cpu.HL));
+            }
+            else if (opcode == 0x3A)
+            {
+                emitter.decM16(offsetOf(&cpu.HL));
+            }
+            return 8;
+        }
+
+        // LD (BC),A, LD (DE),A, LD (HL+),A, LD (HL-),A
+        case 0x02: case 0x12: case 0x22: case 0x32:
+        {
+            const uint16 *const registers[] = {&cpu.BC, &cpu.DE, &cpu.HL, &cpu.HL};
+            emitter.movzxFromM16(Register::ESI, offsetOf(registers[opcode >> 4u]));
+            if (opcode == 0x22)
+            {
+                emitter.incM16(offsetOf(&cpu.HL));
+            }
+            else if (opcode == 0x32)
+            {
+                emitter.decM16(offsetOf(&cpu.HL));
+            }
+            emitter.movzxFromM8(Register::EAX, registerOffset(7));
+            emitWrite(emitter);
+            return 8;
+        }
+
+        // LD (HL),d8
+        case 0x36:
+            emitter.movzxFromM16(Register::ESI, offsetOf(&cpu.HL));
+            emitter.mov(Register::EAX, cpu.memory.read8(PC + 1));
+            emitWrite(emitter);
+            return 12;
+
+        // LD (a16),A
+        case 0xEA:
+            emitter.mov(Register::ESI, bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)));
+            emitter.movzxFromM8(Register::EAX, registerOffset(7));
+            emitWrite(emitter);
+            return 16;
+
+        // LD (C),A
+        case 0xE2:
+            emitter.movzxFromM8(Register::ESI, registerOffset(1));
+            emitter.orImmediate(Register::ESI, 0xFF00);
+            emitter.movzxFromM8(Register::EAX, registerOffset(7));
+            emitWrite(emitter);
+            return 8;
+
+        // LD A,(C)
+        case 0xF2:
+            emitter.movzxFromM8(Register::ESI, registerOffset(1));
+            emitter.orImmediate(Register::ESI, 0xFF00);
+            emitRead(emitter);
+            emitter.movM8From(registerOffset(7), Register::EAX);
+            return 8;
+
+        // PUSH BC, PUSH DE, PUSH HL. Same as `CPU::push`: low byte first.
+        case 0xC5: case 0xD5: case 0xE5:
+        {
+            const uint8 high = ((opcode >> 4u) - 0xC) * 2;
+            emitter.decM16(offsetOf(&cpu.SP));
+            emitter.decM16(offsetOf(&cpu.SP));
+            emitStackAddress(emitter, 0);
+            emitter.movzxFromM8(Register::EAX, registerOffset(high + 1));
+            emitWrite(emitter);
+            emitStackAddress(emitter, 1);
+            emitter.movzxFromM8(Register::EAX, registerOffset(high));
+            emitWrite(emitter);
+            return 16;
+        }
+
+        // POP BC, POP DE, POP HL
+        case 0xC1: case 0xD1: case 0xE1:
+        {
+            const uint8 high = ((opcode >> 4u) - 0xC) * 2;
+            emitStackAddress(emitter, 0);
+            emitRead(emitter);
+            emitter.movM8From(registerOffset(high + 1), Register::EAX);
+            emitStackAddress(emitter, 1);
+            emitRead(emitter);
+            emitter.movM8From(registerOffset(high), Register::EAX);
+            emitter.incM16(offsetOf(&cpu.SP));
+            emitter.incM16(offsetOf(&cpu.SP));
+            return 12;
+        }
+
+        // CALL a16
+        case 0xCD:
+        {
+            const uint16 returnAddress = PC + 3;
+            emitter.decM16(offsetOf(&cpu.SP));
+            emitter.decM16(offsetOf(&cpu.SP));
+            emitStackAddress(emitter, 0);
+            emitter.mov(Register::EAX, returnAddress & 0xFFu);
+            emitWrite(emitter);
+            emitStackAddress(emitter, 1);
+            emitter.mov(Register::EAX, returnAddress >> 8u);
+            emitWrite(emitter);
+            emitter.movM16(PCOffset, bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)));
+            return 24;
+        }
+
+        // RET
+        case 0xC9:
+            emitStackAddress(emitter, 0);
+            emitRead(emitter);
+            emitter.movM8From(PCOffset, Register::EAX);
+            emitStackAddress(emitter, 1);
+            emitRead(emitter);
+            emitter.movM8From(PCOffset + 1, Register::EAX);
+            emitter.incM16(offsetOf(&cpu.SP));
+            emitter.incM16(offsetOf(&cpu.SP));
+            return 16;
+
+        // LD A,(a16)
+        case 0xFA:
+            emitter.mov(Register::ESI, bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)));
+            emitRead(emitter);
+            emitter.movM8From(registerOffset(7), Register::EAX);
+            return 16;
+
+        // LDH A,(a8)
+        case 0xF0:
+        {
+            const uint16 address = 0xFF00 + cpu.memory.read8(PC + 1);
+            if (isHRAM(address))
+            {
+                emitter.movzxEAXFromAbsoluteM8(&cpu.memory.stackRAM[address - 0xFF80]);
+            }
+            else
+            {
+                emitter.mov(Register::ESI, address);
+                emitRead(emitter);
+            }
+            emitter.movM8From(registerOffset(7), Register::EAX);
+            return 12;
+        }
+
+        // LDH (a8),A
+        case 0xE0:
+        {
+            const uint16 address = 0xFF00 + cpu.memory.read8(PC + 1);
+            if (!isHRAM(address))
+            {
+                return 0;
+            }
+            emitter.movzxFromM8(Register::EAX, registerOffset(7));
+            emitter.movAbsoluteM8FromAL(&cpu.memory.stackRAM[address - 0xFF80]);
+            return 12;
+        }
+
+        // LD rr,d16
+        case 0x01: case 0x11: case 0x21: case 0x31:
+        {
+            const uint16 *const registers[] = {&cpu.BC, &cpu.DE, &cpu.HL, &cpu.SP};
+            emitter.movM16(offsetOf(registers[opcode >> 4u]), bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)));
+            return 12;
+        }
+
+        // INC rr
+        case 0x03: case 0x13: case 0x23: case 0x33:
+        {
+            const uint16 *const registers[] = {&cpu.BC, &cpu.DE, &cpu.HL, &cpu.SP};
+            emitter.incM16(offsetOf(registers[opcode >> 4u]));
+            return 8;
+        }
+
+        // DEC rr
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+        {
+            const uint16 *const registers[] = {&cpu.BC, &cpu.DE, &cpu.HL, &cpu.SP};
+            emitter.decM16(offsetOf(registers[opcode >> 4u]));
+            return 8;
+        }
+
+        // LD SP,HL
+        case 0xF9:
+            emitter.movzxFromM16(Register::EAX, offsetOf(&cpu.HL));
+            emitter.movM16From(offsetOf(&cpu.SP), Register::EAX);
+            return 8;
+
+        // JP a16
+        case 0xC3:
+            emitter.movM16(PCOffset, bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)));
+            return 16;
+
+        // JR e8
+        case 0x18:
+            emitter.movM16(PCOffset, PC + 2 + static_cast<int8>(cpu.memory.read8(PC + 1)));
+            return 12;
+
+        // JR cc,e8
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            emitConditionalJump(emitter, opcode, PC + 2 + static_cast<int8>(cpu.memory.read8(PC + 1)), PC + 2, 12, 8);
+            return cyclesInEAX;
+
+        // JP cc,a16
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            emitConditionalJump(emitter, opcode, bytesToWordLE(cpu.memory.read8(PC + 1), cpu.memory.read8(PC + 2)), PC + 3, 16, 12);
+            return cyclesInEAX;
+
+        default:
+            return 0;
+    }
+}
+
+void JIT::emitRead(X64Emitter &emitter) const
+{
+    // Same as `VirtualMemory::read8`
+    emitter.loadPage(cpu.memory.readPages.data());
+    const X64Emitter::Label unmapped = emitter.jump(X64Emitter::Condition::Equal);
+    emitter.movzxEAXFromPage();
+    const X64Emitter::Label done = emitter.jump();
+    emitter.bind(unmapped);
+    emitter.movRDIFromRBX();
+    emitter.call(&JIT::read8);
+    emitter.movzxEAXFromAL();
+    emitter.bind(done);
+}
+
+void JIT::emitWrite(X64Emitter &emitter) const
+{
+    // Same as `VirtualMemory::write8`
+    emitter.loadPage(cpu.memory.writePages.data());
+    const X64Emitter::Label unmapped = emitter.jump(X64Emitter::Condition::Equal);
+    emitter.movPageFromAL();
+    const X64Emitter::Label done = emitter.jump();
+    emitter.bind(unmapped);
+    emitter.mov(X64Emitter::Register::EDX, X64Emitter::Register::EAX);
+    emitter.movRDIFromRBX();
+    emitter.call(&JIT::write8);
+    emitter.bind(done);
+}
+
+void JIT::emitStackAddress(X64Emitter &emitter, const uint8 offset) const
+{
+    emitter.movzxFromM16(X64Emitter::Register::ESI, offsetOf(&cpu.SP));
+    if (offset != 0)
+    {
+        emitter.add(X64Emitter::Register::ESI, static_cast<int8>(offset));
+        emitter.movzx16(X64Emitter::Register::ESI);
+    }
+}
+
+void JIT::emitALU(X64Emitter &emitter, const uint8 operation) const
+{
+    using Register = X64Emitter::Register;
+    using Operation = X64Emitter::Operation;
+    enum : uint8 { ADD = 0, SUB = 2, AND = 4, XOR = 5, OR = 6, CP = 7 };
+
+    const int32 AOffset = registerOffset(7);
+    const int32 zeroOffset = offsetOf(&cpu.flagZeroSource);
+    const int32 subtractOffset = offsetOf(&cpu.flagSubtract);
+    const int32 halfCarryOffset = offsetOf(&cpu.flagHalfCarrySource);
+    const int32 carryOffset = offsetOf(&cpu.flagCarrySource);
+
+    // eax is A, ecx the operand
+    switch (operation)
+    {
+        case ADD: case SUB: case CP: default:
+            // Same as `setArithmeticFlags`: edx is the full width result
+            emitter.movzxFromM8(Register::EAX, AOffset);
+            emitter.mov(Register::EDX, Register::EAX);
+            emitter.alu(operation == ADD ? Operation::Add : Operation::Sub, Register::EDX, Register::ECX);
+            emitter.movM8From(zeroOffset, Register::EDX);
+            emitter.movM8(subtractOffset, operation != ADD);
+            emitter.movM16From(carryOffset, Register::EDX);
+            if (operation != CP)
+            {
+                emitter.movM8From(AOffset, Register::EDX);
+            }
+            emitter.alu(Operation::Xor, Register::EAX, Register::ECX);
+            emitter.alu(Operation::Xor, Register::EAX, Register::EDX);
+            emitter.movM16From(halfCarryOffset, Register::EAX);
+            break;
+
+        case AND: case XOR: case OR:
+            // Same as `setLogicFlags`
+            emitter.movzxFromM8(Register::EAX, AOffset);
+            emitter.alu(operation == AND ? Operation::And : (operation == XOR ? Operation::Xor : Operation::Or), Register::EAX, Register::ECX);
+            emitter.movM8From(AOffset, Register::EAX);
+            emitter.movM8From(zeroOffset, Register::EAX);
+            emitter.movM8(subtractOffset, 0);
+            emitter.movM16(halfCarryOffset, operation == AND ? 0x10 : 0);
+            emitter.movM16(carryOffset, 0);
+            break;
+    }
+}
+
+void JIT::emitIncDec(X64Emitter &emitter, const uint8 index, const bool decrement) const
+{
+    using Register = X64Emitter::Register;
+    using Operation = X64Emitter::Operation;
+
+    // Same as `CPU::incR8` and `CPU::decR8`: C is untouched
+    emitter.movzxFromM8(Register::EAX, registerOffset(index));
+    emitter.mov(Register::EDX, Register::EAX);
+    emitter.add(Register::EDX, decrement ? -1 : 1);
+    emitter.movzx8(Register::EDX, Register::EDX);
+    emitter.movM8From(registerOffset(index), Register::EDX);
+    emitter.movM8From(offsetOf(&cpu.flagZeroSource), Register::EDX);
+    emitter.movM8(offsetOf(&cpu.flagSubtract), decrement);
+    emitter.alu(Operation::Xor, Register::EAX, Register::EDX);
+    emitter.xorImmediate(Register::EAX, 1);
+    emitter.movM16From(offsetOf(&cpu.flagHalfCarrySource), Register::EAX);
+}
+
+void JIT::emitConditionalJump(X64Emitter &emitter, const uint8 opcode, const uint16 target, const uint16 next, const uint16 takenCycles, const uint16 notTakenCycles) const
+{
+    using Condition = X64Emitter::Condition;
+    const int32 PCOffset = offsetOf(&cpu.PC);
+
+    emitter.movM16(PCOffset, next);
+    emitter.mov(X64Emitter::Register::EAX, notTakenCycles);
+
+    // Conditions are NZ, Z, NC, C, in bits 3-4 of the opcode.
+    // Z is set when its source is zero, C when bit 8 of its source is set: compare and test set ZF accordingly.
+    Condition notTaken;
+    switch ((opcode >> 3u) & 0x3u)
+    {
+        case 0: emitter.cmpM8(offsetOf(&cpu.flagZeroSource), 0); notTaken = Condition::Equal; break;
+        case 1: emitter.cmpM8(offsetOf(&cpu.flagZeroSource), 0); notTaken = Condition::NotEqual; break;
+        case 2: emitter.testM16(offsetOf(&cpu.flagCarrySource), 0x100); notTaken = Condition::NotEqual; break;
+        default: emitter.testM16(offsetOf(&cpu.flagCarrySource), 0x100); notTaken = Condition::Equal; break;
+    }
+    const X64Emitter::Label skip = emitter.jump(notTaken);
+    emitter.movM16(PCOffset, target);
+    emitter.mov(X64Emitter::Register::EAX, takenCycles);
+    emitter.bind(skip);
+}
+
+bool JIT::writesMemory(const uint16 PC, const uint8 opcode) const
+{
+    switch (opcode)
+    {
+        case 0x02: case 0x12: case 0x22: case 0x32: // LD (rr),A
+        case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77: // LD (HL),r
+        case 0x36: case 0x34: case 0x35: // LD (HL),d8, INC (HL), DEC (HL)
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5: // PUSH
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+        case 0x08: case 0xEA: // LD (a16),SP and LD (a16),A
+        case 0xE2: // LD (C),A
+            return true;
+        case 0xE0: // LDH (a8),A, which writes HRAM in place
+            return !isHRAM(0xFF00 + cpu.memory.read8(PC + 1));
+
+        // CB instructions on (HL), except BIT which only read
+        case 0xCB:
+        {
+            const uint8 opcodeCB = cpu.memory.read8(PC + 1);
+            return (opcodeCB & 0x7u) == 6 && (opcodeCB >> 6u) != 1;
+        }
+
+        default:
+            return false;
+    }
+}
+
+void JIT::setWritable(uint8 *begin, size_t size, bool writable)
+{
+    // Only the pages about to be written are flipped, not the whole buffer
+    static const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    const uintptr_t first = reinterpret_cast<uintptr_t>(begin) & ~(pageSize - 1);
+    const uintptr_t last = std::min(reinterpret_cast<uintptr_t>(begin) + size, reinterpret_cast<uintptr_t>(code) + codeCapacity);
+    if (mprotect(reinterpret_cast<void*>(first), last - first, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+    {
+        throw std::runtime_error("Can not change protection of the JIT code buffer");
+    }
+}
+
+int32 JIT::offsetOf(const void *member) const
+{
+    return static_cast<int32>(static_cast<const uint8*>(member) - reinterpret_cast<const uint8*>(&cpu));
+}
+
+int32 JIT::schedulerOffsetOf(const void *member) const
+{
+    return static_cast<int32>(static_cast<const uint8*>(member) - reinterpret_cast<const uint8*>(&cpu.scheduler));
+}
+
+int32 JIT::registerOffset(const uint8 index) const
+{
+    const uint8 *const registers[] = {&cpu.B, &cpu.C, &cpu.D, &cpu.E, &cpu.H, &cpu.L, nullptr, &cpu.A};
+    return offsetOf(registers[index]);
+}
+
+void JIT::checkSize(const X64Emitter &emitter, size_t slots)
+{
+    // Past the budget, code may already overlap the next block or leave the writable pages
+    if (emitter.size() > slots * maxInstructionSize)
+    {
+        throw std::logic_error("JIT emitted more than maxInstructionSize bytes per instruction");
+    }
+}
+
+bool JIT::isStackAligned(const void *frame)
+{
+    // A function called with a 16 bytes aligned stack pushes the return address then rbp:
+    // its frame address is 16 bytes aligned again.
+    return (reinterpret_cast<uintptr_t>(frame) & 15u) == 0;
+}
+
+bool JIT::runDueEvents(CPU *cpu)
+{
+    assert(isStackAligned(__builtin_frame_address(0)));
+    cpu->scheduler.runDueEvents();
+    return cpu->IME == CPU::IMEState::ENABLED && cpu->isInterruptPending();
+}
+
+uint8 JIT::read8(CPU *cpu, uint16 address)
+{
+    assert(isStackAligned(__builtin_frame_address(0)));
+    return cpu->memory.read8(address);
+}
+
+void JIT::write8(CPU *cpu, uint16 address, uint8 value)
+{
+    assert(isStackAligned(__builtin_frame_address(0)));
+    cpu->memory.write8(address, value);
+}
+
+#endif
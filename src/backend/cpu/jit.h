@@ -0,0 +1,165 @@
+#ifndef FRACTAL_JIT_H
+#define FRACTAL_JIT_H
+
+#ifdef FRACTAL_JIT
+
+#if !defined(__x86_64__)
+#error "FRACTAL_JIT only targets x86-64"
+#endif
+
+#include "../../general.h"
+#include "block_cache.h"
+#include "x64_emitter.h"
+
+class CPU;
+
+/**
+ * Dynamic recompiler from SM83 to x86-64, for hot blocks of the block cache.
+ *
+ * Translated code does exactly what the interpreter does for a block, without fetching, decoding
+ * nor dispatching anything:
+ * - Register loads, 8 bit ALU and inc/dec on registers, 16 bit inc/dec and jumps are emitted natively,
+ *   lazy flags included. So are memory loads and stores, PUSH, POP, CALL and RET, through the page
+ *   table: only pages which are not mapped call `VirtualMemory::read8` or `VirtualMemory::write8`.
+ *   HRAM is read and written in place by LDH. Every other instruction calls directly its opcode handler.
+ * - After each instruction, the cycles are added to the scheduler clock in place. Events are only
+ *   run, out of line, once the clock reached the next one. LCD, timers and divider register see
+ *   exactly the same cycles than with the interpreter.
+ * - It leaves if an interrupt must be serviced. An interrupt only become pending when an event ran
+ *   or memory was written (IE, IF), and IME is only enabled by EI: only these places check it.
+ * - After an instruction which writes memory, it leaves if code may not be mapped anymore: ROM bank
+ *   switch, OAM DMA start (which locks the bus), write to a working RAM page holding cached code.
+ *   See `VirtualMemory::codeMappingVersion`.
+ *
+ * Blocks of the game ROM and working RAM are translated. When a working RAM page is written, the
+ * block cache drops its blocks, and their native code is left unused until `clear`.
+ */
+class JIT
+{
+public:
+    explicit JIT(CPU &cpu);
+    ~JIT();
+
+    // No copy
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+    /**
+     * Blocks are translated after being interpreted that many times.
+     */
+    static constexpr uint32 hotThreshold = 16;
+
+    /**
+     * Translate a block to native code.
+     * @return The native code, or nullptr if the code buffer is full. Call `clear` and try again.
+     */
+    [[nodiscard]] BlockCache::NativeCode compile(const BlockCache::Block &block, const BlockCache::MicroOp *microOps);
+
+    /**
+     * Drop all native code. All previously returned code become invalid.
+     */
+    void clear();
+
+private:
+    CPU &cpu;
+
+    static constexpr size_t codeCapacity = 4 * 1024 * 1024;
+    // Upper bound of the native code size of one instruction. The block start and end take one more.
+    // It is reserved and made writable before emitting, and checked by `checkSize` while emitting.
+    static constexpr size_t maxInstructionSize = 512;
+    uint8 *code = nullptr;
+    size_t codeUsed = 0;
+
+    /**
+     * Make code from `begin` writable while a block is emitted, or executable again once done.
+     * The buffer is mapped executable and never both at once (W^X).
+     */
+    void setWritable(uint8 *begin, size_t size, bool writable);
+
+    /**
+     * Offset of a CPU member from the CPU address, which generated code keep in rbx.
+     */
+    [[nodiscard]] int32 offsetOf(const void *member) const;
+    /**
+     * Offset of a 8 bit register from its 3 bits index in an opcode: B, C, D, E, H, L, (HL), A.
+     */
+    [[nodiscard]] int32 registerOffset(uint8 index) const;
+
+    /**
+     * Offset of a scheduler member from the scheduler address, which generated code keep in rbp.
+     */
+    [[nodiscard]] int32 schedulerOffsetOf(const void *member) const;
+
+    /**
+     * Returned by `emitNative` when cycles depend on a branch: emitted code leaves them in eax.
+     */
+    static constexpr uint16 cyclesInEAX = 0xFFFF;
+
+    /**
+     * Emit native code for the instruction at `PC`, if it is simple enough.
+     * Only jumps update PC: for other instructions, it is up to the caller.
+     * @return Cycles consumed by the instruction, `cyclesInEAX`, or 0 if nothing have been emitted.
+     */
+    [[nodiscard]] uint16 emitNative(X64Emitter &emitter, uint16 PC, uint8 opcode) const;
+
+    /**
+     * Emit ADD, SUB, AND, XOR, OR or CP (3 bits `operation` of the opcode) of A and ecx.
+     * ADC and SBC are not supported.
+     */
+    void emitALU(X64Emitter &emitter, uint8 operation) const;
+
+    /**
+     * Emit a memory read of the address in esi, to eax.
+     */
+    void emitRead(X64Emitter &emitter) const;
+
+    /**
+     * Emit a memory write of al at the address in esi.
+     */
+    void emitWrite(X64Emitter &emitter) const;
+
+    /**
+     * Emit esi = SP + `offset` (0 or 1), wrapped to 16 bits.
+     */
+    void emitStackAddress(X64Emitter &emitter, uint8 offset) const;
+
+    /**
+     * Is `address` in HRAM, which LDH can access in place?
+     */
+    [[nodiscard]] static bool isHRAM(uint16 address) { return address >= 0xFF80 && address < 0xFFFF; }
+
+    /**
+     * Emit INC r or DEC r of the 8 bit register `index`.
+     */
+    void emitIncDec(X64Emitter &emitter, uint8 index, bool decrement) const;
+
+    /**
+     * Emit JR cc or JP cc: set PC to `target` if the condition of `opcode` holds, `next` otherwise.
+     */
+    void emitConditionalJump(X64Emitter &emitter, uint8 opcode, uint16 target, uint16 next, uint16 takenCycles, uint16 notTakenCycles) const;
+
+    /**
+     * Does the instruction write memory? It may then switch ROM bank, start OAM DMA, modify cached
+     * code or request an interrupt.
+     */
+    [[nodiscard]] bool writesMemory(uint16 PC, uint8 opcode) const;
+
+    /**
+     * Throw if the code emitted so far does not fit in `slots` times `maxInstructionSize`.
+     */
+    static void checkSize(const X64Emitter &emitter, size_t slots);
+
+    /**
+     * Is `frame`, the frame address of a function called from native code, aligned as the SysV ABI requires?
+     */
+    [[nodiscard]] static bool isStackAligned(const void *frame);
+
+    // Called from native code. They check the stack alignment of native code in debug builds.
+    static bool runDueEvents(CPU *cpu);
+    static uint8 read8(CPU *cpu, uint16 address);
+    static void write8(CPU *cpu, uint16 address, uint8 value);
+};
+
+#endif
+
+#endif //FRACTAL_JIT_H
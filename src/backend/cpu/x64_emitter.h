@@ -0,0 +1,210 @@
+#ifndef FRACTAL_X64_EMITTER_H
+#define FRACTAL_X64_EMITTER_H
+
+#include <cstring>
+#include <initializer_list>
+
+#include "../../general.h"
+
+/**
+ * Tiny x86-64 machine code emitter, with only the instructions the JIT needs.
+ *
+ * Generated code keeps a few pointers in callee-saved registers, set by `prologue`:
+ * - rbx: the CPU. Most memory operands are `[rbx + displacement]`.
+ * - rbp: the scheduler, for the clock. Operands are `[rbp + displacement]`.
+ * - r13: a 32 bit value watched by the block, and r14d its value on entry.
+ * eax, ecx, edx and esi are scratch registers. esi holds addresses for `loadPage`.
+ *
+ * Jumps are emitted with a 32 bit displacement which is patched later with `bind`.
+ */
+class X64Emitter
+{
+public:
+    explicit X64Emitter(uint8 *code) : begin(code), cursor(code)
+    {};
+
+    /**
+     * A forward jump waiting for its target.
+     */
+    using Label = uint8 *;
+
+    /**
+     * Scratch registers, by their x86 encoding. Byte forms only accept EAX, ECX and EDX (al, cl, dl).
+     */
+    enum class Register : uint8
+    {
+        EAX = 0,
+        ECX = 1,
+        EDX = 2,
+        ESI = 6,
+    };
+
+    /**
+     * Two operands ALU instructions, by their `op r/m32, r32` opcode.
+     */
+    enum class Operation : uint8
+    {
+        Add = 0x01,
+        Or = 0x09,
+        And = 0x21,
+        Sub = 0x29,
+        Xor = 0x31,
+    };
+
+    /**
+     * Conditions of `jcc`, by their x86 encoding.
+     */
+    enum class Condition : uint8
+    {
+        Below = 0x2,
+        Equal = 0x4,
+        NotEqual = 0x5,
+    };
+
+    [[nodiscard]] size_t size() const
+    {
+        return cursor - begin;
+    }
+
+    // push rbx; push rbp; push r13; push r14; sub rsp, 8; mov rbx, rdi
+    // On entry, the return address leaves rsp 8 bytes off a 16 bytes boundary. Four pushes keep it off:
+    // `sub rsp, 8` realigns it, as the SysV ABI requires at each call.
+    void prologue() { bytes({0x53, 0x55, 0x41, 0x55, 0x41, 0x56, 0x48, 0x83, 0xEC, 0x08, 0x48, 0x89, 0xFB}); }
+    // add rsp, 8; pop r14; pop r13; pop rbp; pop rbx; ret
+    void epilogue() { bytes({0x48, 0x83, 0xC4, 0x08, 0x41, 0x5E, 0x41, 0x5D, 0x5D, 0x5B, 0xC3}); }
+
+    // movabs rbp, address
+    void movRBP(const void *address) { bytes({0x48, 0xBD}); qword(reinterpret_cast<uint64>(address)); }
+    // movabs r13, address; mov r14d, [r13]
+    void watch(const uint32 *address) { bytes({0x49, 0xBD}); qword(reinterpret_cast<uint64>(address)); bytes({0x45, 0x8B, 0x75, 0x00}); }
+    // cmp [r13], r14d
+    void cmpWatched() { bytes({0x45, 0x39, 0x75, 0x00}); }
+
+    // add qword [rbp + offset], imm32
+    void addRBPM64(int32 offset, uint32 value) { bytes({0x48, 0x81, 0x85}); dword(offset); dword(value); }
+    // add qword [rbp + offset], rax
+    void addRBPM64FromRAX(int32 offset) { bytes({0x48, 0x01, 0x85}); dword(offset); }
+    // mov rax, qword [rbp + offset]
+    void movRAXFromRBPM64(int32 offset) { bytes({0x48, 0x8B, 0x85}); dword(offset); }
+    // cmp rax, qword [rbp + offset]
+    void cmpRAXWithRBPM64(int32 offset) { bytes({0x48, 0x3B, 0x85}); dword(offset); }
+
+    // movabs rax, address; movzx eax, byte [rax]
+    void movzxEAXFromAbsoluteM8(const uint8 *address) { bytes({0x48, 0xB8}); qword(reinterpret_cast<uint64>(address)); bytes({0x0F, 0xB6, 0x00}); }
+    // movabs rdx, address; mov byte [rdx], al
+    void movAbsoluteM8FromAL(uint8 *address) { bytes({0x48, 0xBA}); qword(reinterpret_cast<uint64>(address)); bytes({0x88, 0x02}); }
+
+    // Load in rdx the page of the address in esi, from a table of 256 page pointers:
+    // mov ecx, esi; shr ecx, 8; movabs rdx, pages; mov rdx, [rdx + rcx * 8]; test rdx, rdx
+    template <typename Page>
+    void loadPage(Page *const *pages) { bytes({0x89, 0xF1, 0xC1, 0xE9, 0x08, 0x48, 0xBA}); qword(reinterpret_cast<uint64>(pages)); bytes({0x48, 0x8B, 0x14, 0xCA, 0x48, 0x85, 0xD2}); }
+    // Read the byte at the address in esi from the page in rdx: and esi, 0xFF; movzx eax, byte [rdx + rsi]
+    void movzxEAXFromPage() { bytes({0x81, 0xE6}); dword(0xFFu); bytes({0x0F, 0xB6, 0x04, 0x32}); }
+    // Write al at the address in esi in the page in rdx: and esi, 0xFF; mov byte [rdx + rsi], al
+    void movPageFromAL() { bytes({0x81, 0xE6}); dword(0xFFu); bytes({0x88, 0x04, 0x32}); }
+
+    // movabs rax, address; cmp byte [rax], imm8
+    void cmpAbsoluteM8(const uint8 *address, uint8 value) { bytes({0x48, 0xB8}); qword(reinterpret_cast<uint64>(address)); bytes({0x80, 0x38, value}); }
+
+    // mov rdi, rbx
+    void movRDIFromRBX() { bytes({0x48, 0x89, 0xDF}); }
+    // movzx eax, ax
+    void movzxEAXFromAX() { bytes({0x0F, 0xB7, 0xC0}); }
+    // movzx eax, al
+    void movzxEAXFromAL() { bytes({0x0F, 0xB6, 0xC0}); }
+    // test al, al
+    void testAL() { bytes({0x84, 0xC0}); }
+
+    // movabs rax, function; call rax
+    template <typename Function>
+    void call(Function *function)
+    {
+        bytes({0x48, 0xB8});
+        qword(reinterpret_cast<uint64>(function));
+        bytes({0xFF, 0xD0});
+    }
+
+    // mov byte [rbx + offset], imm8
+    void movM8(int32 offset, uint8 value) { bytes({0xC6, 0x83}); dword(offset); byte(value); }
+    // mov word [rbx + offset], imm16
+    void movM16(int32 offset, uint16 value) { bytes({0x66, 0xC7, 0x83}); dword(offset); word(value); }
+    // mov dword [rbx + offset], imm32
+    void movM32(int32 offset, uint32 value) { bytes({0xC7, 0x83}); dword(offset); dword(value); }
+
+    // movzx r32, byte [rbx + offset]
+    void movzxFromM8(Register destination, int32 offset) { bytes({0x0F, 0xB6, modRM(destination)}); dword(offset); }
+    // movzx r32, word [rbx + offset]
+    void movzxFromM16(Register destination, int32 offset) { bytes({0x0F, 0xB7, modRM(destination)}); dword(offset); }
+    // mov byte [rbx + offset], r8 (low byte)
+    void movM8From(int32 offset, Register source) { bytes({0x88, modRM(source)}); dword(offset); }
+    // mov word [rbx + offset], r16
+    void movM16From(int32 offset, Register source) { bytes({0x66, 0x89, modRM(source)}); dword(offset); }
+
+    // mov r32, imm32
+    void mov(Register destination, uint32 value) { byte(0xB8 + static_cast<uint8>(destination)); dword(value); }
+    // mov r32, r32
+    void mov(Register destination, Register source) { bytes({0x89, modRR(destination, source)}); }
+    // movzx r32, r16 of the same register
+    void movzx16(Register reg) { bytes({0x0F, 0xB7, modRR(reg, reg)}); }
+    // movzx r32, r8 (low byte)
+    void movzx8(Register destination, Register source) { bytes({0x0F, 0xB6, modRR(source, destination)}); }
+    // add, or, and, sub, xor r32, r32
+    void alu(Operation operation, Register destination, Register source) { bytes({static_cast<uint8>(operation), modRR(destination, source)}); }
+    // add r32, imm8 (sign extended)
+    void add(Register destination, int8 value) { bytes({0x83, static_cast<uint8>(0xC0 + static_cast<uint8>(destination))}); byte(static_cast<uint8>(value)); }
+    // or r32, imm32
+    void orImmediate(Register destination, uint32 value) { bytes({0x81, static_cast<uint8>(0xC8 + static_cast<uint8>(destination))}); dword(value); }
+    // xor r32, imm8 (sign extended)
+    void xorImmediate(Register destination, int8 value) { bytes({0x83, static_cast<uint8>(0xF0 + static_cast<uint8>(destination))}); byte(static_cast<uint8>(value)); }
+
+    // inc word [rbx + offset]
+    void incM16(int32 offset) { bytes({0x66, 0xFF, 0x83}); dword(offset); }
+    // dec word [rbx + offset]
+    void decM16(int32 offset) { bytes({0x66, 0xFF, 0x8B}); dword(offset); }
+
+    // cmp byte [rbx + offset], imm8
+    void cmpM8(int32 offset, uint8 value) { bytes({0x80, 0xBB}); dword(offset); byte(value); }
+    // cmp dword [rbx + offset], imm8
+    void cmpM32(int32 offset, uint8 value) { bytes({0x83, 0xBB}); dword(offset); byte(value); }
+    // test word [rbx + offset], imm16
+    void testM16(int32 offset, uint16 value) { bytes({0x66, 0xF7, 0x83}); dword(offset); word(value); }
+
+    // jcc rel32
+    [[nodiscard]] Label jump(Condition condition) { bytes({0x0F, static_cast<uint8>(0x80 + static_cast<uint8>(condition))}); return placeholder(); }
+    // jmp rel32
+    [[nodiscard]] Label jump() { byte(0xE9); return placeholder(); }
+
+    /**
+     * Make a forward jump land at the current position.
+     */
+    void bind(Label label)
+    {
+        const auto displacement = static_cast<int32>(cursor - (label + 4));
+        std::memcpy(label, &displacement, sizeof(displacement));
+    }
+
+private:
+    uint8 *const begin;
+    uint8 *cursor;
+
+    // ModRM of `[rbx + disp32]` with `reg` as the register operand
+    static uint8 modRM(Register reg) { return 0x83 | static_cast<uint8>(static_cast<uint8>(reg) << 3u); }
+    // ModRM of a register to register instruction: `rm` is the r/m operand, `reg` the register operand
+    static uint8 modRR(Register rm, Register reg) { return 0xC0 | static_cast<uint8>(static_cast<uint8>(reg) << 3u) | static_cast<uint8>(rm); }
+
+    void byte(uint8 value) { *cursor++ = value; }
+    void bytes(std::initializer_list<uint8> values) { for (uint8 value : values) byte(value); }
+    void word(uint16 value) { std::memcpy(cursor, &value, sizeof(value)); cursor += sizeof(value); }
+    void dword(uint32 value) { std::memcpy(cursor, &value, sizeof(value)); cursor += sizeof(value); }
+    void dword(int32 value) { std::memcpy(cursor, &value, sizeof(value)); cursor += sizeof(value); }
+    void qword(uint64 value) { std::memcpy(cursor, &value, sizeof(value)); cursor += sizeof(value); }
+
+    [[nodiscard]] Label placeholder()
+    {
+        Label label = cursor;
+        dword(0u);
+        return label;
+    }
+};
+
+#endif //FRACTAL_X64_EMITTER_H
@@ -5,82 +5,127 @@
 #include "../frontend/interfaces/i_input.h"
 #include "virtual_memory.h"
 
+/**
+ * Joypad register (0xFF00), fed with buttons status from the frontend.
+ */
 class InputManager
 {
 public:
     explicit InputManager(VirtualMemory &memory, IInput &input) : memory(memory), input(input)
-    {};
+    {
+        memory.registerIO(0xFF00, [this]
+        {
+            return (joypadButtons & joypadButtonsBits.selectBits) | joypadInputBits() | joypadButtonsBits.alwaysHigh;
+        }, [this](uint8 value)
+        {
+            // only select bits are writable
+            joypadButtons &= ~joypadButtonsBits.selectBits;
+            joypadButtons |= value & joypadButtonsBits.selectBits;
+        });
+    };
+
+    // No copy
+    InputManager(const InputManager&) = delete;
+    InputManager& operator=(const InputManager&) = delete;
 
+    /**
+     * Latch buttons status from the frontend.
+     * It is called between two batches of instructions. In between, 0xFF00 reflects the latched status
+     * for whatever buttons the game selects.
+     */
     void updateInputStatus()
     {
-        IInput::InputStatus filteredRawInput = input.inputStatus;
-        const uint8 previousJoypadButtons = memory.joypadButtons;
+        const IInput::InputStatus &rawInput = input.inputStatus;
+        const uint8 previousInputBits = joypadInputBits();
 
-        // Direction buttons are disabled
-        if (memory.joypadButtons & memory.joypadButtonsBits.selectDirection)
-        {
-            filteredRawInput.down = false;
-            filteredRawInput.up = false;
-            filteredRawInput.left = false;
-            filteredRawInput.right = false;
-        }
-        // Buttons are disabled
-        if (memory.joypadButtons & memory.joypadButtonsBits.selectButton)
-        {
-            filteredRawInput.start = false;
-            filteredRawInput.select = false;
-            filteredRawInput.buttonA = false;
-            filteredRawInput.buttonB = false;
-        }
+        joypadDirections = pressedBits(rawInput.right, rawInput.left, rawInput.up, rawInput.down);
+        joypadActions = pressedBits(rawInput.buttonA, rawInput.buttonB, rawInput.select, rawInput.start);
 
-        if (filteredRawInput.up || filteredRawInput.select)
-        {
-            memory.joypadButtons &= ~memory.joypadButtonsBits.upOrSelect;
-        }
-        else
+        // Request for interrupt on falling edge
+        if (previousInputBits == joypadButtonsBits.inputBits
+            && joypadInputBits() != joypadButtonsBits.inputBits)
         {
-            memory.joypadButtons |= memory.joypadButtonsBits.upOrSelect;
+            memory.requestInterrupt(memory.interruptBits.joypad);
         }
+    };
+
+private:
+    VirtualMemory &memory;
+    IInput &input;
+
+    /**
+     * Joypad input/output
+     * Only select bits (4 and 5) are stored here. Input bits come from `joypadInputBits`.
+     * Read at 0xFF00 return select bits and input bits. Remaining bits are high.
+     * Write at 0xFF00 set the select bits. Remaining bits are ignored.
+     */
+    uint8 joypadButtons = 0xFF;
 
-        if (filteredRawInput.down || filteredRawInput.start)
+    /**
+     * Buttons status latched from the frontend, with the topology of 0xFF00 input bits: a bit is low when pressed.
+     * - `joypadDirections`: right, left, up, down
+     * - `joypadActions`: A, B, select, start
+     */
+    uint8 joypadDirections = 0x0F;
+    uint8 joypadActions = 0x0F;
+
+    const struct
+    {
+        const uint8 rightOrA = 1u << 0u;
+        const uint8 leftOrB = 1u << 1u;
+        const uint8 upOrSelect = 1u << 2u;
+        const uint8 downOrStart = 1u << 3u;
+        const uint8 inputBits = rightOrA | leftOrB | upOrSelect | downOrStart;
+
+        const uint8 selectDirection = 1u << 4u;
+        const uint8 selectButton = 1u << 5u;
+        const uint8 selectBits = selectDirection | selectButton;
+
+        const uint8 alwaysHigh = 1u << 6u | 1u << 7u;
+    } joypadButtonsBits;
+
+    /**
+     * Input bits of 0xFF00 for the buttons currently selected.
+     */
+    [[nodiscard]] uint8 joypadInputBits() const
+    {
+        // A selection bit is low when selected
+        uint8 inputBits = joypadButtonsBits.inputBits;
+        if ((joypadButtons & joypadButtonsBits.selectDirection) == 0)
         {
-            memory.joypadButtons &= ~memory.joypadButtonsBits.downOrStart;
+            inputBits &= joypadDirections;
         }
-        else
+        if ((joypadButtons & joypadButtonsBits.selectButton) == 0)
         {
-            memory.joypadButtons |= memory.joypadButtonsBits.downOrStart;
+            inputBits &= joypadActions;
         }
+        return inputBits;
+    }
 
-        if (filteredRawInput.right || filteredRawInput.buttonA)
-        {
-            memory.joypadButtons &= ~memory.joypadButtonsBits.rightOrA;
-        }
-        else
+    /**
+     * Build input bits of 0xFF00 (bit low when pressed) from buttons, from bit 0 to 3.
+     */
+    [[nodiscard]] uint8 pressedBits(bool bit0, bool bit1, bool bit2, bool bit3) const
+    {
+        uint8 bits = joypadButtonsBits.inputBits;
+        if (bit0)
         {
-            memory.joypadButtons |= memory.joypadButtonsBits.rightOrA;
+            bits &= ~joypadButtonsBits.rightOrA;
         }
-
-        if (filteredRawInput.left || filteredRawInput.buttonB)
+        if (bit1)
         {
-            memory.joypadButtons &= ~memory.joypadButtonsBits.leftOrB;
+            bits &= ~joypadButtonsBits.leftOrB;
         }
-        else
+        if (bit2)
         {
-            memory.joypadButtons |= memory.joypadButtonsBits.leftOrB;
+            bits &= ~joypadButtonsBits.upOrSelect;
         }
-
-        // Request for interrupt on falling edge
-        if ((previousJoypadButtons & memory.joypadButtonsBits.inputBits) == memory.joypadButtonsBits.inputBits
-            && (memory.joypadButtons & memory.joypadButtonsBits.inputBits) != memory.joypadButtonsBits.inputBits)
+        if (bit3)
         {
-            memory.interruptRequest |= memory.interruptBits.joypad;
+            bits &= ~joypadButtonsBits.downOrStart;
         }
-    };
-
-private:
-    VirtualMemory &memory;
-    IInput &input;
-
+        return bits;
+    }
 };
 
 #endif //FRACTAL_INPUT_MANAGER_H
@@ -1,34 +1,66 @@
+#include <cstring>
+
 #include "lcd.h"
 #include "virtual_memory.h"
+#include "scanline.h"
 
-LCD::LCD(VirtualMemory &memory, IDisplay &display) : memory(memory), display(display)
+LCD::LCD(VirtualMemory &memory, IDisplay &display, Scheduler &scheduler) : memory(memory), display(display), scheduler(scheduler)
 {
+    scheduler.setHandler(Scheduler::Event::LCDMode, [this](uint64 timestamp) { modeEnded(timestamp); });
+    scheduler.schedule(Scheduler::Event::LCDMode, scheduler.now() + modeDuration(currentMode));
+
+    memory.registerIO(0xFF40, [this] { return lcdControl; }, [this](uint8 value) { lcdControl = value; });
+    memory.registerIO(0xFF41, [this] { return STAT | STATBits.alwaysHigh; }, [this](uint8 value) { STAT = value; });
+    memory.registerIO(0xFF42, [this] { return scrollY; }, [this](uint8 value) { scrollY = value; });
+    memory.registerIO(0xFF43, [this] { return scrollX; }, [this](uint8 value) { scrollX = value; });
+    memory.registerIO(0xFF44, [this] { return LY; }, nullptr);
+    memory.registerIO(0xFF45, [this] { return LYC; }, [this](uint8 value) { LYC = value; });
+    memory.registerIO(0xFF47, [this] { return backgroundPalette; }, [this](uint8 value) { backgroundPalette = value; });
+    memory.registerIO(0xFF48, [this] { return objectPalette0; }, [this](uint8 value) { objectPalette0 = value; });
+    memory.registerIO(0xFF49, [this] { return objectPalette1; }, [this](uint8 value) { objectPalette1 = value; });
+    memory.registerIO(0xFF4A, [this] { return windowY; }, [this](uint8 value) { windowY = value; });
+    memory.registerIO(0xFF4B, [this] { return windowX; }, [this](uint8 value) { windowX = value; });
+}
 
+uint16 LCD::modeDuration(Mode mode)
+{
+    // TODO: GPU timing should not be constant
+    switch (mode)
+    {
+        case Mode::HBLANK: return 204;
+        case Mode::VBLANK: return 456;
+        case Mode::OAM: return 80;
+        case Mode::Transfer: return 172;
+    }
+    return 0;
 }
 
-void LCD::cycles(uint16 elapsedCycles)
+void LCD::modeEnded(uint64 timestamp)
 {
-    currentElapsedCycles += elapsedCycles;
+    // Render threads may be done with the previous frame
+    if (isPreviousFrameDrawing)
+    {
+        presentPreviousFrame(false);
+    }
 
-    // TODO: GPU timing should not be constant
     // HBLANK ended
-    if (currentMode == Mode::HBLANK && currentElapsedCycles >= 204)
+    if (currentMode == Mode::HBLANK)
     {
-        currentElapsedCycles = 0;
-        if (memory.LY >= 143)
+        if (LY >= 143)
         {
             // start vblank
-            memory.STAT = (memory.STAT & ~memory.STATBits.currentMode) | memory.STATBits.currentModeVBlank;
+            STAT = (STAT & ~STATBits.currentMode) | STATBits.currentModeVBlank;
             currentMode = Mode::VBLANK;
-            display.newFrameIsReady(buffer);
+            endFrame();
+            ++completedFrames;
 
             updateSTATIRQ();
-            memory.interruptRequest |= memory.interruptBits.verticalBlank;
+            memory.requestInterrupt(memory.interruptBits.verticalBlank);
         }
         else
         {
             // start OAM search
-            memory.STAT = (memory.STAT & ~memory.STATBits.currentMode) | memory.STATBits.currentModeOAM;
+            STAT = (STAT & ~STATBits.currentMode) | STATBits.currentModeOAM;
             currentMode = Mode::OAM;
             incrementLY();
 
@@ -36,300 +68,497 @@ void LCD::cycles(uint16 elapsedCycles)
         }
     }
     // OAM read ended
-    else if (currentMode == Mode::OAM && currentElapsedCycles >= 80)
+    else if (currentMode == Mode::OAM)
     {
         // start OAM and VRAM transfer
-        currentElapsedCycles = 0;
         currentMode = Mode::Transfer;
-        memory.STAT = (memory.STAT & ~memory.STATBits.currentMode) | memory.STATBits.currentModeDataTransfer;
+        STAT = (STAT & ~STATBits.currentMode) | STATBits.currentModeDataTransfer;
     }
     // OAM and VRAM read ended
-    else if (currentMode == Mode::Transfer && currentElapsedCycles >= 172)
+    else if (currentMode == Mode::Transfer)
     {
         // Draw a line and start HBLANK
-        currentElapsedCycles = 0;
         currentMode = Mode::HBLANK;
-        memory.STAT = (memory.STAT & ~memory.STATBits.currentMode) | memory.STATBits.currentModeHBlank;
-        drawLine();
+        STAT = (STAT & ~STATBits.currentMode) | STATBits.currentModeHBlank;
+        if (!isFrameSkipped)
+        {
+            logLine();
+        }
 
         updateSTATIRQ();
     }
     // VBLANK ended a line
-    else if (currentMode == Mode::VBLANK && currentElapsedCycles >= 456)
+    else if (currentMode == Mode::VBLANK)
     {
-        currentElapsedCycles = 0;
         incrementLY();
 
-        if (memory.LY > 153)
+        if (LY > 153)
         {
             // VBLANK ended all lines
             // OAM search start
             currentMode = Mode::OAM;
-            memory.STAT = (memory.STAT & ~memory.STATBits.currentMode) | memory.STATBits.currentModeOAM;
+            STAT = (STAT & ~STATBits.currentMode) | STATBits.currentModeOAM;
             setLY(0);
+            windowLine = 0;
 
             updateSTATIRQ();
         }
     }
+
+    // Next mode (or next VBLANK line) starts exactly where this one ended
+    scheduler.schedule(Scheduler::Event::LCDMode, timestamp + modeDuration(currentMode));
 }
 
-void LCD::drawLine()
+void LCD::setDeferredRendering(bool enabled)
 {
-    drawBackground();
-    drawWindow();
-    drawSprites();
+    drawPendingLines();
+    deferredRendering = enabled;
 }
 
-void LCD::drawBackground()
+void LCD::setRenderThreads(size_t count)
 {
-    if (!(memory.lcdControl & memory.lcdControlBits.backgroundEnable))
+    drawPendingLines();
+    finishRendering();
+
+    // Lines of the current frame already drawn move to where the next ones will be
+    if (renderPool)
     {
-        return;
+        renderPool.reset();
+        std::copy(frames[currentFrame].pixels.begin(), frames[currentFrame].pixels.end(), buffer.begin());
+    }
+    if (count > 0)
+    {
+        std::copy(buffer.begin(), buffer.end(), frames[currentFrame].pixels.begin());
+        renderPool = std::make_unique<WorkerPool>(count);
     }
 
-    const uint16 backgroundTilemapAddr = memory.lcdControl & memory.lcdControlBits.backgroundTilemap ? 0x9C00 : 0x9800;
-    const uint16 tilesetAddr = memory.lcdControl & memory.lcdControlBits.tileset ? 0x8000 : 0x8800;
-    const bool tilemapSigned = tilesetAddr == 0x8800;
-    const uint8 palette = memory.backgroundPalette;
-    const uint8 scrollX = memory.scrollX;
-    const uint8 scrollY = memory.scrollY;
-    const size_t screenY = memory.LY;
-    const uint8 bgY = (screenY + scrollY) % 256;
+    // The memory was not watched without render threads
+    currentSnapshot = nullptr;
+}
 
-    for (size_t screenX = 0; screenX < SCREEN_WIDTH; ++screenX)
+void LCD::finishRendering()
+{
+    if (isPreviousFrameDrawing)
     {
-        const uint8 bgX = (scrollX + screenX) % 256;
+        presentPreviousFrame(true);
+    }
+}
 
-        // From current screen (X,Y), get address of current tilemap
-        const uint16 currentTilemapIndex = (bgX / 8u) + ((bgY / 8u) * 32u);
-        const uint16 currentTilemapAddr = backgroundTilemapAddr + currentTilemapIndex;
+void LCD::setFrameSkip(uint32 skippedFrames)
+{
+    frameSkip = skippedFrames;
+    framesSkippedInARow = 0;
+}
+
+void LCD::setAutoFrameSkip(std::chrono::nanoseconds interval)
+{
+    autoFrameSkipInterval = interval;
+    lastDrawnFrameTime = std::chrono::steady_clock::now();
+}
 
-        // Get current id of the tile being drawn
-        int16 currentTilesetId = 0;
-        if (tilemapSigned)
-            currentTilesetId = static_cast<int8>(memory.read8(currentTilemapAddr)) + 128;
+void LCD::endFrame()
+{
+    if (!isFrameSkipped)
+    {
+        drawPendingLines();
+        if (!renderPool)
+        {
+            display.newFrameIsReady(buffer);
+        }
         else
-            currentTilesetId = memory.read8(currentTilemapAddr);
+        {
+            // Frames are given to the display in order: the previous one must be done before this one is
+            finishRendering();
+            isPreviousFrameDrawing = true;
+            currentFrame = 1 - currentFrame;
+        }
+    }
 
-        // Get address to read that tile
-        const uint16 currentTilesetAddr = tilesetAddr + (currentTilesetId * 16);
+    display.frameEnded();
+    isFrameSkipped = isNextFrameSkipped();
+}
 
-        // Get position inside the tile
-        const uint16 tilePosX = 7 - (bgX % 8u); // says which bit to read
-        const uint16 tilePosY = bgY % 8u * 2; // says which bytes (two bytes per line) to read
+bool LCD::isNextFrameSkipped()
+{
+    if (autoFrameSkipInterval.count() > 0)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastDrawnFrameTime < autoFrameSkipInterval)
+        {
+            return true;
+        }
+        lastDrawnFrameTime = now;
+        return false;
+    }
 
-        // address of both bytes for the current line of the tile
-        const uint8 tile0 = memory.read8(currentTilesetAddr + tilePosY + 0u);
-        const uint8 tile1 = memory.read8(currentTilesetAddr + tilePosY + 1u);
+    if (framesSkippedInARow < frameSkip)
+    {
+        ++framesSkippedInARow;
+        return true;
+    }
+    framesSkippedInARow = 0;
+    return false;
+}
+
+void LCD::presentPreviousFrame(bool wait)
+{
+    Frame &frame = frames[1 - currentFrame];
+    if (frame.jobsLeft.load(std::memory_order_acquire) != 0)
+    {
+        if (!wait)
+        {
+            return;
+        }
+        renderPool->wait();
+    }
+
+    std::copy(frame.pixels.begin(), frame.pixels.end(), buffer.begin());
+    isPreviousFrameDrawing = false;
+    display.newFrameIsReady(buffer);
+}
 
-        // actual DMG color of the pixel [0;3]
-        const uint8 color = ((tile0 >> tilePosX) & 1u) + (((tile1 >> tilePosX) & 1u) << 1u);
-        const uint8 paletteColor = (palette >> (color * 2u) & 1u) + ((palette >> (color * 2u + 1) & 1u) << 1u);
+void LCD::logLine()
+{
+    LineRegisters &registers = frames[currentFrame].registers[LY];
+    registers.lcdControl = lcdControl;
+    registers.scrollY = scrollY;
+    registers.scrollX = scrollX;
+    registers.backgroundPalette = backgroundPalette;
+    registers.objectPalette0 = objectPalette0;
+    registers.objectPalette1 = objectPalette1;
+    registers.windowX = windowX;
+
+    // The window line counter only moves on lines showing the window
+    const bool isWindowEnabled = (lcdControl & lcdControlBits.backgroundEnable) && (lcdControl & lcdControlBits.windowEnable);
+    registers.hasWindow = isWindowEnabled && windowY <= LY && windowX - 7 < SCREEN_WIDTH;
+    registers.windowLine = windowLine;
+    if (registers.hasWindow)
+    {
+        ++windowLine;
+    }
 
-        // Get the SFML color
-        std::array<uint8, 3> SFMLColor = colors[paletteColor];
+    if (firstPendingLine == endPendingLine)
+    {
+        if (!deferredRendering && !renderPool)
+        {
+            firstPendingLine = LY;
+            endPendingLine = LY + 1;
+            drawPendingLines();
+            return;
+        }
 
-        // print it in the final buffer
-        buffer[(screenX + (screenY * SCREEN_WIDTH)) * 3 + 0] = SFMLColor[0];
-        buffer[(screenX + (screenY * SCREEN_WIDTH)) * 3 + 1] = SFMLColor[1];
-        buffer[(screenX + (screenY * SCREEN_WIDTH)) * 3 + 2] = SFMLColor[2];
+        // Lines logged must be drawn before the memory they read changes
+        firstPendingLine = LY;
+        watchVideoMemory();
     }
+    endPendingLine = LY + 1;
 }
 
-void LCD::drawWindow()
+void LCD::watchVideoMemory()
 {
-    if (!(memory.lcdControl & memory.lcdControlBits.windowEnable))
+    if (!isWatchingVideoMemory)
     {
-        return;
+        memory.watchVideoMemory([this] { videoMemoryChanging(); });
+        isWatchingVideoMemory = true;
     }
+}
 
-    const uint16 tilemapAddr = memory.lcdControl & memory.lcdControlBits.windowTilemap ? 0x9C00 : 0x9800;
-    const uint16 tilesetAddr = memory.lcdControl & memory.lcdControlBits.tileset ? 0x8000 : 0x8800;
-    const bool tilemapSigned = tilesetAddr == 0x8800;
-    const uint8 palette = memory.backgroundPalette;
-    const uint8 WX = memory.windowX;
-    const uint8 WY = memory.windowY;
-    Vector2i screenPosition {0, memory.LY};
+void LCD::videoMemoryChanging()
+{
+    // The watcher is removed once called
+    isWatchingVideoMemory = false;
+    drawPendingLines();
+    currentSnapshot = nullptr;
+}
 
-    // There is no window on this line.
-    if (WY > screenPosition.y)
+void LCD::drawPendingLines()
+{
+    if (firstPendingLine == endPendingLine)
     {
         return;
     }
 
-    for (screenPosition.x = 0; screenPosition.x < SCREEN_WIDTH; ++screenPosition.x)
+    // A few lines (e.g. when VRAM is written every line) are drawn faster here than snapshot and handed over
+    if (renderPool && endPendingLine - firstPendingLine >= minThreadedLines)
+    {
+        submitLines(firstPendingLine, endPendingLine);
+    }
+    else
+    {
+        drawLines(firstPendingLine, endPendingLine, renderPool ? frames[currentFrame].pixels.data() : buffer.data());
+    }
+    firstPendingLine = endPendingLine = 0;
+
+    // Without render threads, nothing is left to protect
+    if (!renderPool && isWatchingVideoMemory)
     {
-        const Vector2i windowPosition {screenPosition.x - (WX - 7), screenPosition.y - WY};
-        if (windowPosition.x < 0 || windowPosition.x > SCREEN_WIDTH)
+        memory.watchVideoMemory(nullptr);
+        isWatchingVideoMemory = false;
+    }
+}
+
+void LCD::drawLines(uint8 firstLine, uint8 endLine, uint8 *pixels)
+{
+    if (memory.oamChanged)
+    {
+        areSpritesEvaluated.fill(false);
+        memory.oamChanged = false;
+    }
+
+    const Frame &frame = frames[currentFrame];
+    const VideoSource source {memory.videoRAM.data(), memory.tileCache, lineSprites};
+    for (uint8 line = firstLine; line < endLine; ++line)
+    {
+        const LineRegisters &registers = frame.registers[line];
+        const bool areSpritesBig = registers.lcdControl & lcdControlBits.spriteSize;
+        if ((registers.lcdControl & lcdControlBits.spritesEnable) && !areSpritesEvaluated[areSpritesBig])
         {
-            continue;
+            evaluateSprites(memory.oamRAM.data(), areSpritesBig, lineSprites[areSpritesBig]);
+            areSpritesEvaluated[areSpritesBig] = true;
+        }
+        drawLine(line, registers, source, lineBuffers, pixels);
+    }
+}
+
+void LCD::submitLines(uint8 firstLine, uint8 endLine)
+{
+    // Lines are split evenly between threads. The snapshot is kept while the memory is watched.
+    Frame &frame = frames[currentFrame];
+    VideoSnapshot &snapshot = currentSnapshot != nullptr ? *currentSnapshot : takeSnapshot();
+    const size_t lineCount = endLine - firstLine;
+    const size_t jobCount = std::min(renderPool->threadCount(), lineCount);
+    for (size_t job = 0; job < jobCount; ++job)
+    {
+        const uint8 firstJobLine = firstLine + lineCount * job / jobCount;
+        const uint8 endJobLine = firstLine + lineCount * (job + 1) / jobCount;
+
+        frame.jobsLeft.fetch_add(1, std::memory_order_relaxed);
+        snapshot.jobsLeft.fetch_add(1, std::memory_order_relaxed);
+        renderPool->submit([this, &frame, &snapshot, firstJobLine, endJobLine]
+        {
+            LineBuffers buffers;
+            const VideoSource source {snapshot.videoRAM.data(), snapshot.tileCache, snapshot.lineSprites};
+            for (uint8 line = firstJobLine; line < endJobLine; ++line)
+            {
+                drawLine(line, frame.registers[line], source, buffers, frame.pixels.data());
+            }
+            snapshot.jobsLeft.fetch_sub(1, std::memory_order_release);
+            frame.jobsLeft.fetch_sub(1, std::memory_order_release);
+        });
+    }
+}
+
+LCD::VideoSnapshot &LCD::takeSnapshot()
+{
+    VideoSnapshot *snapshot = nullptr;
+    for (const std::unique_ptr<VideoSnapshot> &candidate : snapshots)
+    {
+        if (candidate->jobsLeft.load(std::memory_order_acquire) == 0)
+        {
+            snapshot = candidate.get();
+            break;
         }
+    }
+    if (snapshot == nullptr)
+    {
+        snapshots.push_back(std::make_unique<VideoSnapshot>());
+        snapshot = snapshots.back().get();
+    }
 
-        // From current screen (X,Y), get address of current tilemap
-        const uint16 currentTilemapIndex = (windowPosition.x / 8u) + ((windowPosition.y / 8u) * 32u);
-        const uint16 currentTilemapAddr = tilemapAddr + currentTilemapIndex;
+    // Only tiles which changed since the snapshot was last taken are decoded again
+    constexpr size_t tileBytes = 16;
+    for (size_t tile = 0; tile < TileCache::tileCount; ++tile)
+    {
+        const size_t offset = tile * tileBytes;
+        if (std::memcmp(snapshot->videoRAM.data() + offset, memory.videoRAM.data() + offset, tileBytes) != 0)
+        {
+            std::memcpy(snapshot->videoRAM.data() + offset, memory.videoRAM.data() + offset, tileBytes);
+            snapshot->tileCache.invalidate(TileCache::firstAddress + offset);
+        }
+    }
+    const size_t tilemapsOffset = TileCache::endAddress - TileCache::firstAddress;
+    std::memcpy(snapshot->videoRAM.data() + tilemapsOffset, memory.videoRAM.data() + tilemapsOffset, snapshot->videoRAM.size() - tilemapsOffset);
+    // Render threads only read the snapshot
+    snapshot->tileCache.decodeDirtyTiles();
 
-        // Get current id of the tile being drawn
-        int16 currentTilesetId = 0;
-        if (tilemapSigned)
-            currentTilesetId = static_cast<int8>(memory.read8(currentTilemapAddr)) + 128;
-        else
-            currentTilesetId = memory.read8(currentTilemapAddr);
+    if (std::memcmp(snapshot->oam.data(), memory.oamRAM.data(), snapshot->oam.size()) != 0)
+    {
+        std::memcpy(snapshot->oam.data(), memory.oamRAM.data(), snapshot->oam.size());
+        evaluateSprites(snapshot->oam.data(), false, snapshot->lineSprites[0]);
+        evaluateSprites(snapshot->oam.data(), true, snapshot->lineSprites[1]);
+    }
 
-        // Get address to read that tile
-        const uint16 currentTilesetAddr = tilesetAddr + (currentTilesetId * 16);
+    // Until VRAM or OAM is written, next lines are drawn from it too
+    currentSnapshot = snapshot;
+    watchVideoMemory();
+    return *snapshot;
+}
 
-        const uint16 tilePosX = 7 - (windowPosition.x % 8u); // says which bit to read
-        const uint16 tilePosY = windowPosition.y % 8u * 2; // says which bytes (two bytes per line) to read
+void LCD::drawLine(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers, uint8 *frame) const
+{
+    uint8 *const pixels = buffers.pixelLine.data() + lineMargin;
 
-        // address of both bytes for the current line of the tile
-        const uint8 tile0 = memory.read8(currentTilesetAddr + tilePosY + 0u);
-        const uint8 tile1 = memory.read8(currentTilesetAddr + tilePosY + 1u);
+    // Without background, the window is not drawn either: the line is white under sprites
+    if (registers.lcdControl & lcdControlBits.backgroundEnable)
+    {
+        drawBackground(line, registers, source, buffers);
+        drawWindow(registers, source, buffers);
+        Scanline::drawBackground(buffers.backgroundLine.data() + lineMargin, pixels, SCREEN_WIDTH, registers.backgroundPalette);
+    }
+    else
+    {
+        std::fill(buffers.pixelLine.begin(), buffers.pixelLine.end(), 0);
+    }
 
-        // actual DMG color of the pixel [0;3]
-        const uint8 color = ((tile0 >> tilePosX) & 1u) + (((tile1 >> tilePosX) & 1u) << 1u);
-        const uint8 paletteColor = (palette >> (color * 2u) & 1u) + ((palette >> (color * 2u + 1) & 1u) << 1u);
+    drawSprites(line, registers, source, buffers);
 
-        // Get the SFML color
-        std::array<uint8, 3> SFMLColor = colors[paletteColor];
+    std::copy(pixels, pixels + SCREEN_WIDTH, frame + line * SCREEN_WIDTH);
+}
 
-        // print it in the final buffer
-        buffer[(screenPosition.x + (screenPosition.y * SCREEN_WIDTH)) * 3 + 0] = SFMLColor[0];
-        buffer[(screenPosition.x + (screenPosition.y * SCREEN_WIDTH)) * 3 + 1] = SFMLColor[1];
-        buffer[(screenPosition.x + (screenPosition.y * SCREEN_WIDTH)) * 3 + 2] = SFMLColor[2];
+void LCD::drawBackground(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const
+{
+    const uint16 tilemapAddr = registers.lcdControl & lcdControlBits.backgroundTilemap ? 0x9C00 : 0x9800;
+    const uint8 bgY = line + registers.scrollY;
+    const uint16 tilemapRowAddr = tilemapAddr + (bgY / 8u) * 32u;
+
+    // The first tile is cut by the scroll: start drawing it in the margin, 21 tiles cover the line
+    uint8 *pixels = buffers.backgroundLine.data() + lineMargin - (registers.scrollX % 8u);
+    const uint8 firstColumn = registers.scrollX / 8u;
+    for (uint8 column = 0; column < SCREEN_WIDTH / 8 + 1; ++column, pixels += 8)
+    {
+        const uint8 tilemapColumn = (firstColumn + column) % 32u;
+        const size_t tile = backgroundTileIndex(source.readVideoRAM(tilemapRowAddr + tilemapColumn), registers.lcdControl);
+        std::memcpy(pixels, source.tileCache.row(tile, bgY % 8u, false), 8);
     }
 }
 
-void LCD::drawSprites()
+void LCD::drawWindow(const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const
 {
-    if (!(memory.lcdControl & memory.lcdControlBits.spritesEnable))
+    // There is no window on this line, see `logLine`
+    if (!registers.hasWindow)
     {
         return;
     }
 
-    // Up to 40 sprites readable
-    std::array<SpriteAttribute, 40> sprites {};
-    memcpy(sprites.data(), memory.oamRAM.data(), sizeof(SpriteAttribute) * 40);
+    const uint16 tilemapAddr = registers.lcdControl & lcdControlBits.windowTilemap ? 0x9C00 : 0x9800;
+    const uint16 tilemapRowAddr = tilemapAddr + (registers.windowLine / 8u) * 32u;
 
-    // Draw a max of 10 sprites
-    std::vector<SpriteAttribute> spritesToDraw {};
-    spritesToDraw.reserve(10);
+    // The window starts up to 7 pixels before the screen: the margin receives them
+    const int32 windowStart = registers.windowX - 7;
+    uint8 *pixels = buffers.backgroundLine.data() + lineMargin + windowStart;
+    for (int32 x = windowStart, column = 0; x < SCREEN_WIDTH; x += 8, ++column, pixels += 8)
+    {
+        const size_t tile = backgroundTileIndex(source.readVideoRAM(tilemapRowAddr + column), registers.lcdControl);
+        std::memcpy(pixels, source.tileCache.row(tile, registers.windowLine % 8u, false), 8);
+    }
+}
 
-    // Are sprite 8x16 (true) or 8x8 (false)? If true, LSB of `tilesetId` is ignored
-    const bool areSpritesBig = memory.lcdControl & memory.lcdControlBits.spriteSize;
-    Vector2i spriteSize = {8, 8};
-    const uint8 bytesPerSprite = areSpritesBig ? 32 : 16;
-    spriteSize.y = areSpritesBig ? 16 : 8;
+void LCD::evaluateSprites(const uint8 *oam, bool areSpritesBig, SpriteLists &lists)
+{
+    const int32 spriteHeight = areSpritesBig ? 16 : 8;
+    for (LineSprites &line : lists)
+    {
+        line.count = 0;
+    }
 
-    // Go through each of the 40 sprites and find which sprite will be drawn. Max of 10 sprites.
-    // When sprites overlap with same X coordinates, firsts sprites in OAM table have priority (sprites[0] have priority over sprites[1])
-    for (auto it = sprites.cbegin(); it != sprites.cend() && spritesToDraw.size() <= 10; ++it)
+    // Each line holds the first 10 sprites of OAM covering it, whatever their X: off-screen sprites count too.
+    // They are kept in drawing order: higher X first, and on same X, later sprites in OAM first.
+    // Smaller X then first in OAM have priority, so they are drawn last, over the others.
+    for (size_t index = 0; index < spriteCount; ++index)
     {
-        const SpriteAttribute &sprite = *it;
-        Vector2i screenPosition { sprite.x - 8, sprite.y - 16};
+        SpriteAttribute sprite {};
+        std::memcpy(&sprite, oam + index * sizeof(SpriteAttribute), sizeof(SpriteAttribute));
 
-        // Does it fit on screen for current line?
-        if (screenPosition.y <= memory.LY && screenPosition.y + spriteSize.y > memory.LY
-            && screenPosition.x >= -7 && screenPosition.x < SCREEN_WIDTH)
+        const int32 top = sprite.y - 16;
+        const int32 firstLine = std::max(top, 0);
+        const int32 endLine = std::min(top + spriteHeight, SCREEN_HEIGHT);
+        for (int32 y = firstLine; y < endLine; ++y)
         {
-            spritesToDraw.push_back(sprite);
+            LineSprites &line = lists[y];
+            if (line.count == maxSpritesPerLine)
+            {
+                continue;
+            }
+
+            // Sprites of the line are all earlier in OAM: insert before the first one with the same or a smaller X
+            size_t position = line.count;
+            while (position > 0 && line.sprites[position - 1].x <= sprite.x)
+            {
+                line.sprites[position] = line.sprites[position - 1];
+                --position;
+            }
+            line.sprites[position] = sprite;
+            ++line.count;
         }
     }
+}
 
-    // Smaller X coordinate sprites have higher priority. Meanwhile, on same X coordinate, first sprite is priority.
-    // Sort sprites to have higher x first (which will be drawn first)
-    std::sort(spritesToDraw.begin(), spritesToDraw.end(), [](SpriteAttribute &a, SpriteAttribute &b)
+void LCD::drawSprites(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const
+{
+    if (!(registers.lcdControl & lcdControlBits.spritesEnable))
     {
-        return a.x > b.x;
-    });
+        return;
+    }
+
+    // Are sprite 8x16 (true) or 8x8 (false)? If true, LSB of `tilesetId` is ignored
+    const bool areSpritesBig = registers.lcdControl & lcdControlBits.spriteSize;
+    Vector2i spriteSize = {8, 8};
+    spriteSize.y = areSpritesBig ? 16 : 8;
+
+    const LineSprites &spritesToDraw = source.lineSprites[areSpritesBig][line];
 
-    const uint16 tilesetAddr = 0x8000;
     // Sprite are ready to be drawn first to last
-    for (auto sprite : spritesToDraw)
+    for (size_t index = 0; index < spritesToDraw.count; ++index)
     {
+        const SpriteAttribute &sprite = spritesToDraw.sprites[index];
         Vector2i screenPosition { sprite.x - 8, sprite.y - 16};
-        const uint8 currentLine = memory.LY;
-        const size_t lineInSprite = currentLine - screenPosition.y;
+        if (screenPosition.x <= -8 || screenPosition.x >= SCREEN_WIDTH)
+        {
+            continue;
+        }
+
+        const size_t lineInSprite = line - screenPosition.y;
 
         const bool XFlip = sprite.flag & spriteAttributeFlagBits.XFlip;
         const bool YFlip = sprite.flag & spriteAttributeFlagBits.YFlip;
-        const uint16 paletteAddr = (sprite.flag & spriteAttributeFlagBits.paletteNumber) ? 0xFF49 : 0xFF48;
-        const uint8 palette = memory.read8(paletteAddr);
+        const uint8 palette = (sprite.flag & spriteAttributeFlagBits.paletteNumber) ? registers.objectPalette1 : registers.objectPalette0;
 
-        // On 8x16 sprite mode, LSB is ignored
+        // On 8x16 sprite mode, LSB is ignored: the sprite is this tile (top) and the next one (bottom)
         uint8 tilesetId = sprite.tilesetId;
         if (areSpritesBig)
         {
             tilesetId &= ~(1u);
         }
-        const uint16 currentTileAddr = (tilesetId * bytesPerSprite) + tilesetAddr;
-        const uint16 currentTileLineAddr = currentTileAddr + lineInSprite * 2;
-        for (size_t i = 0; i < 8; ++i)
-        {
-            Vector2i pixelScreenPosition { screenPosition.x + static_cast<int32>(i), memory.LY};
-
-            if (pixelScreenPosition.x < 0 || pixelScreenPosition.x > SCREEN_WIDTH
-                || pixelScreenPosition.y < 0 || pixelScreenPosition.y > SCREEN_HEIGHT)
-            {
-                continue;
-            }
-
-            // Get position inside the tile
-            const uint8 tilePosX = XFlip ? i : 7 - i; // says which bit to read
-            const uint8 tilePosY = YFlip ? (spriteSize.y * 2) - lineInSprite * 2 : lineInSprite * 2; // says which bytes (two bytes per line) to read
-
-            // address of both bytes for the current line of the tile
-            const uint8 tile0 = memory.read8(currentTileAddr + tilePosY + 0);
-            const uint8 tile1 = memory.read8(currentTileAddr + tilePosY + 1);
-
-            // actual DMG color of the pixel [0;3]
-            const uint8 paletteIndex = ((tile0 >> tilePosX) & 1u) + (((tile1 >> tilePosX) & 1u) << 1u);
-            const uint8 paletteColor = (palette >> (paletteIndex * 2u) & 1u) + ((palette >> (paletteIndex * 2u + 1) & 1u) << 1u);
-
-            // We do not have priority, draw only if background & window below pixel is 0
-            if (sprite.flag & spriteAttributeFlagBits.priority)
-            {
-                if (colors[memory.backgroundPalette & 3u][0] != buffer[(pixelScreenPosition.x + (pixelScreenPosition.y * SCREEN_WIDTH)) * 3 + 0])
-                {
-                    continue;
-                }
-            }
-
-            // Get the SFML color
-            std::array<uint8, 3> SFMLColor = colors[paletteColor];
-            if (paletteColor == 0)
-            {
-                continue;
-            }
-            // print it in the final buffer
-            buffer[(pixelScreenPosition.x + (pixelScreenPosition.y * SCREEN_WIDTH)) * 3 + 0] = SFMLColor[0];
-            buffer[(pixelScreenPosition.x + (pixelScreenPosition.y * SCREEN_WIDTH)) * 3 + 1] = SFMLColor[1];
-            buffer[(pixelScreenPosition.x + (pixelScreenPosition.y * SCREEN_WIDTH)) * 3 + 2] = SFMLColor[2];
-        }
+        const size_t spriteLine = YFlip ? spriteSize.y - 1 - lineInSprite : lineInSprite;
+        // Sprites always use the 0x8000 tileset
+        const uint8 *row = source.tileCache.row(tilesetId + spriteLine / 8u, spriteLine % 8u, XFlip);
+        // Sprites start up to 7 pixels out of the screen: the line margin receives them
+        const size_t linePosition = lineMargin + screenPosition.x;
+        Scanline::drawSpriteRow(buffers.pixelLine.data() + linePosition, row, palette, sprite.flag & spriteAttributeFlagBits.priority);
     }
 }
 
 void LCD::incrementLY()
 {
-    ++memory.LY;
+    ++LY;
     updateLY();
 }
 
 void LCD::setLY(uint8 value)
 {
-    memory.LY = value;
+    LY = value;
     updateLY();
 }
 
 void LCD::updateLY()
 {
-    if (memory.LY == memory.LYC)
+    if (LY == LYC)
     {
-        memory.STAT |= memory.STATBits.LYCEquality;
+        STAT |= STATBits.LYCEquality;
     }
     else
     {
-        memory.STAT &= ~memory.STATBits.LYCEquality;
+        STAT &= ~STATBits.LYCEquality;
     }
 }
 
@@ -337,23 +566,23 @@ void LCD::updateSTATIRQ()
 {
     bool newSignalStatus = false;
 
-    if (memory.LY == memory.LYC && (memory.STAT & memory.STATBits.LYCInterruptEnable))
+    if (LY == LYC && (STAT & STATBits.LYCInterruptEnable))
     {
         newSignalStatus = true;
     }
 
-    if (currentMode == Mode::HBLANK && (memory.STAT & memory.STATBits.HBlankInterruptEnable))
+    if (currentMode == Mode::HBLANK && (STAT & STATBits.HBlankInterruptEnable))
     {
         newSignalStatus = true;
     }
 
-    if (currentMode == Mode::OAM && (memory.STAT & memory.STATBits.OAMInterruptEnable))
+    if (currentMode == Mode::OAM && (STAT & STATBits.OAMInterruptEnable))
     {
         newSignalStatus = true;
     }
 
     // According to cycle accurate gameboy guide, it OAM interrupt enable also trigger it
-    if (currentMode == Mode::VBLANK && (memory.STAT & (memory.STATBits.VBlankInterruptEnable | memory.STATBits.OAMInterruptEnable)))
+    if (currentMode == Mode::VBLANK && (STAT & (STATBits.VBlankInterruptEnable | STATBits.OAMInterruptEnable)))
     {
         newSignalStatus = true;
     }
@@ -361,7 +590,7 @@ void LCD::updateSTATIRQ()
     // If signal goes from low to high
     if (!STATIRQSignal && newSignalStatus)
     {
-        memory.interruptRequest |= memory.interruptBits.STAT;
+        memory.requestInterrupt(memory.interruptBits.STAT);
     }
     STATIRQSignal = newSignalStatus;
 }
@@ -4,20 +4,26 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <chrono>
 #include <gsl/gsl-lite.hpp>
 
 #include "virtual_memory.h"
+#include "scheduler.h"
+#include "worker_pool.h"
 #include "../frontend/interfaces/i_display.h"
 
 /**
  * Imagine LCD is a standalone chip in the Gameboy, being able to access
  * memory (which explain VirtualMemory reference) and does its work autonomously.
  *
- * It is therefore a standalone running class which is updated according to
- * elapsed cycles.
+ * It is therefore a standalone running class: it schedules the end of each mode
+ * on the Scheduler, and is only updated when that happens.
  *
- * All VRAM and video registers are still managed by VirtualMemory (because they are
- * still accessible by CPU).
+ * VRAM and OAM are still managed by VirtualMemory (because they are still accessible by CPU).
+ * Tiles are read already decoded from VirtualMemory's TileCache.
+ * Video registers (0xFF40 to 0xFF4B, except DMA) are owned here and registered on VirtualMemory.
  *
  * Display is 160*144 pixels.
  *
@@ -37,20 +43,51 @@
 class LCD
 {
 public:
-    explicit LCD(VirtualMemory &memory, IDisplay &display);
+    explicit LCD(VirtualMemory &memory, IDisplay &display, Scheduler &scheduler);
 
     /**
-     * Give a new amount of elapsed cycles.
+     * Number of frames completed since power on. It is incremented when entering VBLANK.
      */
-    void cycles(uint16 elapsedCycles);
+    [[nodiscard]] uint64 frameCount() const { return completedFrames; }
 
-    static const constexpr std::array<std::array<uint8, 3>, 4> colors =
-    {{
-        {{255, 255, 255}},
-        {{192, 192, 192}},
-        {{96, 96, 96}},
-        {{0, 0, 0}}
-    }};
+    /**
+     * Duration of a complete screen draw, including VBLANK.
+     */
+    static constexpr uint32 cyclesPerFrame = 70224;
+
+    /**
+     * When enabled, lines are not drawn as the LCD reaches them: their registers are logged, and the frame is
+     * drawn at once when entering VBLANK. Mid-frame register changes (raster effects) still apply to their lines.
+     * Lines logged are drawn early if VRAM or OAM is about to change, so they never see later memory.
+     * Disabled by default.
+     */
+    void setDeferredRendering(bool enabled);
+
+    /**
+     * Draw frames on `count` threads instead of the emulation thread, or on the emulation thread if 0 (default).
+     * Lines are deferred as with `setDeferredRendering`, then drawn from a snapshot of VRAM and OAM while emulation goes on.
+     * A frame is given to the display once drawn, shortly after entering VBLANK and before the next frame ends.
+     */
+    void setRenderThreads(size_t count);
+
+    /**
+     * Wait until render threads drew the last frame completed, and give it to the display.
+     */
+    void finishRendering();
+
+    /**
+     * Only draw one frame out of `skippedFrames` + 1: other frames are neither drawn nor given to the display.
+     * Modes, LY, STAT and interrupts are the same whether frames are skipped or not. 0 (default) draws every frame.
+     * It takes effect on the next frame.
+     */
+    void setFrameSkip(uint32 skippedFrames);
+
+    /**
+     * Skip frames to draw at most one frame per `interval` of host time, e.g. the display refresh period when
+     * running faster than the Gameboy. A zero interval (default) disables it, and a fixed frame skip applies.
+     * It takes effect on the next frame.
+     */
+    void setAutoFrameSkip(std::chrono::nanoseconds interval);
 
 private:
     VirtualMemory &memory;
@@ -67,10 +104,43 @@ private:
     };
     Mode currentMode = Mode::HBLANK;
 
-    // Cycles elapsed for current mode
-    uint16 currentElapsedCycles = 0;
+    Scheduler &scheduler;
+
+    /**
+     * Duration of a mode, in cycles. For VBLANK, duration of one of its lines.
+     */
+    [[nodiscard]] static uint16 modeDuration(Mode mode);
+
+    /**
+     * Scheduled at the end of each mode (and of each VBLANK line): switch to the next one.
+     * @param timestamp When the mode ended
+     */
+    void modeEnded(uint64 timestamp);
+
+    uint64 completedFrames = 0;
 
-    std::vector<uint8> buffer = std::vector<uint8>(SCREEN_WIDTH * SCREEN_HEIGHT * 3, 0);
+    /**
+     * Frame handed to the display: a shade per pixel, see IDisplay::newFrameIsReady. Colors are picked by the display.
+     * Lines are drawn there directly, unless render threads draw them, see `Frame`.
+     */
+    std::vector<uint8> buffer = std::vector<uint8>(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+
+    /**
+     * Lines being drawn have a margin on both sides, so tiles and sprites partly out of the screen are drawn whole.
+     */
+    static constexpr size_t lineMargin = 8;
+
+    /**
+     * Lines being drawn. Each thread drawing lines has its own.
+     */
+    struct LineBuffers
+    {
+        // Background and window palette indexes, a tile row at a time
+        std::array<uint8, SCREEN_WIDTH + 2 * lineMargin> backgroundLine {};
+        // Pixels, as in `buffer`. See Scanline.
+        std::array<uint8, SCREEN_WIDTH + 2 * lineMargin> pixelLine {};
+    };
+    LineBuffers lineBuffers;
 
     /**
      * Sprites attribute are located in OAM RAM. Each sprite attribute is 4 byte long.
@@ -94,10 +164,182 @@ private:
         const uint8 priority = 1u << 7u;
     } spriteAttributeFlagBits;
 
-    void drawLine();
-    void drawBackground();
-    void drawWindow();
-    void drawSprites();
+    static constexpr size_t spriteCount = 40;
+    static constexpr size_t maxSpritesPerLine = 10;
+
+    /**
+     * Sprites drawn on a line, in drawing order. See `evaluateSprites`.
+     */
+    struct LineSprites
+    {
+        std::array<SpriteAttribute, maxSpritesPerLine> sprites;
+        size_t count = 0;
+    };
+    using SpriteLists = std::array<LineSprites, SCREEN_HEIGHT>;
+
+    /**
+     * Sprite lists of every line, with 8x8 sprites then with 8x16 sprites.
+     * A list is built when a line needs it, and built again after OAM changed (see VirtualMemory::oamChanged).
+     */
+    std::array<SpriteLists, 2> lineSprites {};
+    std::array<bool, 2> areSpritesEvaluated {};
+
+    /**
+     * Build the sprite list of every line from OAM.
+     */
+    static void evaluateSprites(const uint8 *oam, bool areSpritesBig, SpriteLists &lists);
+
+    /**
+     * Memory lines are drawn from: VRAM, its decoded tiles and sprite lists of OAM.
+     * VRAM is read directly: the LCD is not locked out by DMA like the CPU.
+     */
+    struct VideoSource
+    {
+        const uint8 *videoRAM;
+        TileCache &tileCache;
+        const std::array<SpriteLists, 2> &lineSprites;
+
+        [[nodiscard]] uint8 readVideoRAM(uint16 address) const
+        {
+            return videoRAM[address - 0x8000u];
+        }
+    };
+
+    /**
+     * Index in the tile cache of a tile number read in a background or window tilemap, with LCD Control `control`.
+     * With the 0x8800 tileset, numbers are signed and 0 is the tile at 0x9000.
+     */
+    [[nodiscard]] size_t backgroundTileIndex(uint8 tileNumber, uint8 control) const
+    {
+        if (control & lcdControlBits.tileset)
+        {
+            return tileNumber;
+        }
+        return tileNumber < 0x80 ? 0x100u + tileNumber : tileNumber;
+    }
+
+    /**
+     * Registers a line is drawn with, logged when the LCD reaches the line.
+     */
+    struct LineRegisters
+    {
+        uint8 lcdControl;
+        uint8 scrollY;
+        uint8 scrollX;
+        uint8 backgroundPalette;
+        uint8 objectPalette0;
+        uint8 objectPalette1;
+        uint8 windowX;
+        // Window line drawn on this line, if the window is on it
+        bool hasWindow;
+        uint8 windowLine;
+    };
+
+    /**
+     * Registers logged for the lines of a frame, and its pixels when render threads draw it.
+     * Render threads draw a frame while the next one runs: there are two of them.
+     */
+    struct Frame
+    {
+        std::array<LineRegisters, SCREEN_HEIGHT> registers {};
+        std::vector<uint8> pixels = std::vector<uint8>(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+        // Render jobs still drawing its lines
+        std::atomic<uint32> jobsLeft {0};
+    };
+    std::array<Frame, 2> frames;
+    // Frame of the lines being logged. The other one may still be drawn by render threads.
+    size_t currentFrame = 0;
+    bool isPreviousFrameDrawing = false;
+
+    bool deferredRendering = false;
+
+    // Lines logged but not drawn yet are from `firstPendingLine` to `endPendingLine` excluded
+    uint8 firstPendingLine = 0;
+    uint8 endPendingLine = 0;
+
+    /**
+     * Log registers of line LY, then draw it, or defer it until VBLANK or a write to VRAM or OAM.
+     */
+    void logLine();
+
+    /**
+     * Draw lines logged and not drawn yet, or give them to render threads.
+     */
+    void drawPendingLines();
+
+    /**
+     * Draw lines on this thread, from the memory as it is now.
+     * @param pixels Frame receiving the lines
+     */
+    void drawLines(uint8 firstLine, uint8 endLine, uint8 *pixels);
+
+    /**
+     * Give lines of the current frame to render threads, with a snapshot of the memory as it is now.
+     */
+    void submitLines(uint8 firstLine, uint8 endLine);
+
+    /**
+     * Pending lines below this count are drawn on the emulation thread, even with render threads.
+     */
+    static constexpr uint8 minThreadedLines = 16;
+
+    /**
+     * Called right before VRAM or OAM changes, while watching them, see VirtualMemory::watchVideoMemory.
+     */
+    void videoMemoryChanging();
+    void watchVideoMemory();
+    bool isWatchingVideoMemory = false;
+
+    /**
+     * Copy of VRAM and OAM render threads draw from, with its decoded tiles and sprite lists.
+     */
+    struct VideoSnapshot
+    {
+        std::array<uint8, 0x2000> videoRAM {};
+        TileCache tileCache {videoRAM.data()};
+        std::array<uint8, spriteCount * sizeof(SpriteAttribute)> oam {};
+        std::array<SpriteLists, 2> lineSprites {};
+        // Render jobs still drawing from it
+        std::atomic<uint32> jobsLeft {0};
+    };
+
+    /**
+     * Snapshots are only taken when the memory changed since the last one: lines keep drawing from it until
+     * VRAM or OAM is written. Snapshots no job uses anymore are reused, and only what changed since is copied again.
+     */
+    std::vector<std::unique_ptr<VideoSnapshot>> snapshots;
+    // Snapshot of the memory as it is now, or nullptr if it changed since
+    VideoSnapshot *currentSnapshot = nullptr;
+
+    VideoSnapshot &takeSnapshot();
+
+    /**
+     * Give the previous frame, once drawn by render threads, to the display.
+     * @param wait Wait for render threads to be done with it
+     */
+    void presentPreviousFrame(bool wait);
+
+    /**
+     * Give the frame to the display, on entering VBLANK, unless it is skipped. Then tell the display the frame
+     * ended, skipped or not, and decide if the next one is.
+     */
+    void endFrame();
+
+    // Lines of a skipped frame are neither logged nor drawn
+    bool isFrameSkipped = false;
+
+    uint32 frameSkip = 0;
+    uint32 framesSkippedInARow = 0;
+    std::chrono::nanoseconds autoFrameSkipInterval {0};
+    // When the last frame not skipped started, for automatic frame skip
+    std::chrono::steady_clock::time_point lastDrawnFrameTime;
+
+    [[nodiscard]] bool isNextFrameSkipped();
+
+    void drawLine(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers, uint8 *frame) const;
+    void drawBackground(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const;
+    void drawWindow(const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const;
+    void drawSprites(uint8 line, const LineRegisters &registers, const VideoSource &source, LineBuffers &buffers) const;
 
     void incrementLY();
     void setLY(uint8 value);
@@ -105,6 +347,154 @@ private:
 
     bool STATIRQSignal = false;
     void updateSTATIRQ();
+
+    /**
+     * LCD Control.
+     * Read at 0xFF40 return the value.
+     * Write at 0xFF40 write the value.
+     *
+     * Bit 0: is background tiling enabled?
+     * Bit 1: are sprites enabled?
+     * Bit 2: Sprite size. 0=8x8, 1=8x16
+     * Bit 3: Where to read the background tilemap? 0=0x9800 to 0x9BFF. 1=0x9C00 to 0x9FFF
+     * Bit 4: Where to read tileset? 0=0x8800 to 0x97FF. 1=0x8000 to 0x8FFF
+     * Bit 5: is the Window enabled?
+     * Bit 6: Where to read window tilemap? 0=0x9800 to 0x9BFF. 1=0x9C00 to 0x9FFF
+     * Bit 7: Is LCD powered on?
+     */
+    uint8 lcdControl = 0;
+
+    const struct
+    {
+        const uint8 backgroundEnable = 1u << 0u;
+        const uint8 spritesEnable = 1u << 1u;
+        const uint8 spriteSize = 1u << 2u;
+        const uint8 backgroundTilemap = 1u << 3u;
+        const uint8 tileset = 1u << 4u;
+        const uint8 windowEnable = 1u << 5u;
+        const uint8 windowTilemap = 1u << 6u;
+        const uint8 lcdPower = 1u << 7u;
+    } lcdControlBits;
+
+    /**
+     * Hold LCD current status and configure LCD interrupt.
+     *
+     * Read at 0xFF41: return value.
+     * Write at 0xFF41: write the value.
+     *
+     * Bit 1-0: Read only. 0: during H-BLANK, 1: during V-BLANK, 2: during OAM search, 3: during transfer data to LCD driver
+     * Bit 2: Read only. 1 if LYC=LY
+     * Bit 3: 1 to enable Mode 0 H-Blank interrupt
+     * Bit 4: 1 to enable Mode 1 V-Blank interrupt
+     * Bit 5: 1 to enable Mode 2 OAM interrupt
+     * Bit 6: 1 to enable LYC=LY interrupt
+     * Bit 7: unused and return 1.
+     */
+    uint8 STAT = 0;
+
+    const struct
+    {
+        const uint8 currentMode = 1u << 0u | 1u << 1u;
+        const uint8 currentModeHBlank = 0;
+        const uint8 currentModeVBlank = 1;
+        const uint8 currentModeOAM = 2;
+        const uint8 currentModeDataTransfer = 3;
+
+        const uint8 LYCEquality = 1u << 2u;
+        const uint8 HBlankInterruptEnable = 1u << 3u;
+        const uint8 VBlankInterruptEnable = 1u << 4u;
+        const uint8 OAMInterruptEnable = 1u << 5u;
+        const uint8 LYCInterruptEnable = 1u << 6u;
+        const uint8 alwaysHigh = 1u << 7u;
+    } STATBits;
+
+    /**
+     * Specify position Y to draw in the background.
+     *
+     * Read and write at 0xFF42: works.
+     */
+    uint8 scrollY = 0;
+
+    /**
+     * Specify position X to draw in the background.
+     *
+     * Read and write at 0xFF43: works.
+     */
+    uint8 scrollX = 0;
+
+    /**
+     * LCD current line
+     * Hold the current line being drawn (TODO: possible values?)
+     * When LCD is off, it hold 0.
+     *
+     * Read at 0xFF44: return value.
+     * Write at 0xFF44: ignored.
+     */
+    uint8 LY = 0;
+
+    /**
+     * Trigger STAT interrupt when LY==LYC.
+     *
+     * Read at 0xFF45: return value.
+     * Write at 0xFF45: write value.
+     */
+    uint8 LYC = 0;
+
+    /**
+     * Bit 1-0: shade for color 0
+     * Bit 3-2: shade for color 1
+     * Bit 5-4: shade for color 2
+     * Bit 7-6: shade for color 3
+     *
+     * Shades:
+     * 0: white
+     * 1: light gray
+     * 2: dark gray
+     * 3: black
+     *
+     * Read and write at 0xFF47: works.
+     */
+    uint8 backgroundPalette = 0;
+
+    /**
+     * Same as 0xFF47 except for bit 1-0 which mean transparent therefore are ignored.
+     *
+     * Read and write at 0xFF48: works.
+     */
+    uint8 objectPalette0 = 0;
+
+    /**
+     * Same as 0xFF47 except for bit 1-0 which mean transparent therefore are ignored.
+     *
+     * Read and write at 0xFF49: works.
+     */
+    uint8 objectPalette1 = 0;
+
+    /**
+     * Specify window Y position.
+     *
+     * Read and write at 0xFF4A: works.
+     */
+    uint8 windowY = 0;
+
+    /**
+     * Specify window X position minus 7.
+     *
+     * Read and write at 0xFF4B: works.
+     */
+    uint8 windowX = 0;
+
+    /**
+     * Window line drawn next. It only counts lines where the window was drawn: hiding the window
+     * for some lines does not skip its lines. Reset each frame, advanced when lines are logged.
+     */
+    uint8 windowLine = 0;
+
+    /**
+     * Threads drawing frames, if enabled, see `setRenderThreads`.
+     * Declared last: it finishes its jobs before what they draw to and from is destroyed.
+     */
+    std::unique_ptr<WorkerPool> renderPool;
 };
 
 
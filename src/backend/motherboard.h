@@ -2,11 +2,17 @@
 #define FRACTAL_MOTHERBOARD_H
 
 #include <string>
+#include <algorithm>
+#include <memory>
+#include <filesystem>
 
 #include "../frontend/interfaces/i_display.h"
 #include "../frontend/interfaces/i_input.h"
 #include "cpu/cpu.h"
+#include "scheduler.h"
 #include "virtual_memory.h"
+#include "../files/rom_registry.h"
+#include "timer.h"
 #include "lcd.h"
 #include "input_manager.h"
 
@@ -21,26 +27,124 @@
 class Motherboard
 {
 public:
-    explicit Motherboard(const std::string &biosRomPath, const std::string &gameRomPath, IDisplay &display, IInput &input):
-    memory(biosRomPath, gameRomPath),
+    /**
+     * Load (or share, see RomRegistry::shared) ROMs from files.
+     * @param savePath Save file of battery-backed cartridge RAM, or empty (default) to not persist it.
+     * See `savePathOf` for the usual one.
+     */
+    explicit Motherboard(const std::string &biosRomPath, const std::string &gameRomPath, IDisplay &display, IInput &input,
+                         const std::string &savePath = ""):
+    Motherboard(RomRegistry::shared().acquire(biosRomPath), RomRegistry::shared().acquire(gameRomPath), display, input, savePath)
+    {};
+
+    /**
+     * @param savePath Save file of battery-backed cartridge RAM, or empty (default) to not persist it.
+     * A save file is only used by one instance at a time: other instances given the same one keep their
+     * cartridge RAM in memory only, see SaveFile.
+     */
+    explicit Motherboard(std::shared_ptr<const RomImage> biosRom, std::shared_ptr<const RomImage> gameROM, IDisplay &display, IInput &input,
+                         const std::string &savePath = ""):
+    memory(std::move(biosRom), std::move(gameROM), scheduler, savePath),
+    timer(memory, scheduler),
     inputManager(memory, input),
-    lcd(memory, display),
-    cpu(memory, inputManager, lcd)
+    lcd(memory, display, scheduler),
+    cpu(memory, scheduler, timer)
     {};
 
+    /**
+     * Usual save file of a game: next to its ROM, with the ".sav" extension.
+     */
+    static std::string savePathOf(const std::string &gameRomPath)
+    {
+        return std::filesystem::path(gameRomPath).replace_extension(".sav").string();
+    }
+
+    Scheduler scheduler;
     VirtualMemory memory;
+    Timer timer;
     InputManager inputManager;
     LCD lcd;
     CPU cpu;
 
     /**
-     * Run the software until it stop.
+     * Run the software until the CPU crash (see `CPU::hasCrashed`), at the Gameboy speed.
      */
     void run()
     {
-        while (true)
+        while (!cpu.hasCrashed())
+        {
+            const uint64 start = scheduler.now();
+            runUntil<false>(start + cyclesPerSync);
+            cpu.performCycleTiming(scheduler.now() - start);
+        }
+    };
+
+    /**
+     * Run at least `cycles` cycles, as fast as possible.
+     * It may overshoot by one instruction, or one cached block.
+     * @return Cycles actually elapsed
+     */
+    uint64 runFor(uint64 cycles)
+    {
+        const uint64 start = scheduler.now();
+        runUntil<false>(start + cycles);
+        return scheduler.now() - start;
+    };
+
+    /**
+     * Run until the LCD enters VBLANK (a new frame is ready), as fast as possible.
+     * As a safety net, it stops after two frames duration if VBLANK never comes.
+     * @return Cycles actually elapsed
+     */
+    uint64 runUntilVBlank()
+    {
+        const uint64 start = scheduler.now();
+        runUntil<true>(start + 2 * LCD::cyclesPerFrame);
+        return scheduler.now() - start;
+    };
+
+    /**
+     * Run `frames` frames, as fast as possible. See `runUntilVBlank`.
+     * @return Cycles actually elapsed
+     */
+    uint64 runFrames(uint32 frames)
+    {
+        uint64 elapsed = 0;
+        for (uint32 frame = 0; frame < frames && !cpu.hasCrashed(); ++frame)
         {
-            cpu.nextTick();
+            elapsed += runUntilVBlank();
+        }
+        return elapsed;
+    };
+
+private:
+    /**
+     * Peripherals which do not need cycle accuracy (joypad, crash check, throttling) are synced
+     * every `cyclesPerSync` cycles, about 1ms, instead of after each instruction.
+     */
+    static constexpr uint64 cyclesPerSync = 4560;
+
+    /**
+     * Run until the CPU clock reach `endCycle`, or the CPU crash.
+     * @tparam stopOnVBlank Also stop when the LCD enters VBLANK
+     */
+    template<bool stopOnVBlank>
+    void runUntil(uint64 endCycle)
+    {
+        const uint64 frame = lcd.frameCount();
+        while (!cpu.hasCrashed() && scheduler.now() < endCycle)
+        {
+            inputManager.updateInputStatus();
+
+            const uint64 syncCycle = std::min(endCycle, scheduler.now() + cyclesPerSync);
+            while (scheduler.now() < syncCycle)
+            {
+                cpu.nextTick();
+                if (stopOnVBlank && lcd.frameCount() != frame)
+                {
+                    return;
+                }
+            }
         }
     };
 };
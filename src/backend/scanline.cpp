@@ -0,0 +1,117 @@
+#include <array>
+
+#include "scanline.h"
+
+#if !defined(FRACTAL_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <immintrin.h>
+#define FRACTAL_SCANLINE_SSE2
+#if defined(__AVX2__)
+#define FRACTAL_SCANLINE_AVX2
+#endif
+#endif
+
+namespace
+{
+    /**
+     * Pixel of each palette index.
+     */
+    using LookupTable = std::array<uint8, 4>;
+
+    [[nodiscard]] inline LookupTable paletteTable(uint8 palette, uint8 opaqueBits)
+    {
+        LookupTable table {};
+        for (uint8 index = 0; index < table.size(); ++index)
+        {
+            table[index] = ((palette >> (index * 2u)) & IDisplay::shadeBits) | (index != 0 ? opaqueBits : 0);
+        }
+        return table;
+    }
+
+#ifdef FRACTAL_SCANLINE_SSE2
+    /**
+     * Lookup of 16 indexes: each entry is selected by comparing indexes with 0 to 3.
+     */
+    [[nodiscard]] inline __m128i lookup16(__m128i indexes, const LookupTable &table)
+    {
+        __m128i pixels = _mm_setzero_si128();
+        for (uint8 index = 0; index < table.size(); ++index)
+        {
+            const __m128i selected = _mm_cmpeq_epi8(indexes, _mm_set1_epi8(static_cast<char>(index)));
+            pixels = _mm_or_si128(pixels, _mm_and_si128(selected, _mm_set1_epi8(static_cast<char>(table[index]))));
+        }
+        return pixels;
+    }
+#endif
+
+#ifdef FRACTAL_SCANLINE_AVX2
+    /**
+     * Lookup of 32 indexes, the table being a shuffle control.
+     */
+    [[nodiscard]] inline __m256i lookup32(__m256i indexes, const LookupTable &table)
+    {
+        const __m256i shuffle = _mm256_setr_epi8(
+            table[0], table[1], table[2], table[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            table[0], table[1], table[2], table[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        return _mm256_shuffle_epi8(shuffle, indexes);
+    }
+#endif
+}
+
+void Scanline::drawBackground(const uint8 *indexes, uint8 *pixels, size_t count, uint8 palette)
+{
+    const LookupTable table = paletteTable(palette, IDisplay::backgroundOpaqueBit);
+
+    size_t pixel = 0;
+#ifdef FRACTAL_SCANLINE_AVX2
+    for (; pixel + 32 <= count; pixel += 32)
+    {
+        const __m256i line = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indexes + pixel));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + pixel), lookup32(line, table));
+    }
+#endif
+#ifdef FRACTAL_SCANLINE_SSE2
+    for (; pixel + 16 <= count; pixel += 16)
+    {
+        const __m128i line = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indexes + pixel));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + pixel), lookup16(line, table));
+    }
+#endif
+    for (; pixel < count; ++pixel)
+    {
+        pixels[pixel] = table[indexes[pixel]];
+    }
+}
+
+void Scanline::drawSpriteRow(uint8 *pixels, const uint8 *spriteIndexes, uint8 palette, bool behindBackground)
+{
+    // Sprites keep the background opaque bit, so sprites drawn later still see the background
+    const LookupTable table = paletteTable(palette, 0);
+
+#ifdef FRACTAL_SCANLINE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sprite = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(spriteIndexes));
+    const __m128i line = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixels));
+    const __m128i opaqueBit = _mm_set1_epi8(IDisplay::backgroundOpaqueBit);
+
+    // Pixels where the sprite shows: opaque, and over a transparent background if behind it
+    __m128i visible = _mm_andnot_si128(_mm_cmpeq_epi8(sprite, zero), _mm_set1_epi8(-1));
+    if (behindBackground)
+    {
+        visible = _mm_and_si128(visible, _mm_cmpeq_epi8(_mm_and_si128(line, opaqueBit), zero));
+    }
+
+    const __m128i spritePixels = _mm_or_si128(lookup16(sprite, table), _mm_and_si128(line, opaqueBit));
+    const __m128i result = _mm_or_si128(_mm_and_si128(visible, spritePixels), _mm_andnot_si128(visible, line));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pixels), result);
+#else
+    for (size_t pixel = 0; pixel < 8; ++pixel)
+    {
+        const bool backgroundOpaque = pixels[pixel] & IDisplay::backgroundOpaqueBit;
+        if (spriteIndexes[pixel] == 0 || (behindBackground && backgroundOpaque))
+        {
+            continue;
+        }
+        pixels[pixel] = table[spriteIndexes[pixel]] | (backgroundOpaque ? IDisplay::backgroundOpaqueBit : 0);
+    }
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef FRACTAL_SCANLINE_H
+#define FRACTAL_SCANLINE_H
+
+#include <cstddef>
+
+#include "../general.h"
+#include "../frontend/interfaces/i_display.h"
+
+/**
+ * Pixel operations of the LCD on whole scanlines, or 8 pixels at a time for sprites.
+ *
+ * Palette indexes (0 to 3) are read from the tile cache. Pixels are written as in the frame given to
+ * IDisplay: a shade, and whether the background under it is opaque.
+ *
+ * They are vectorized with AVX2 (32 pixels at a time) when the build targets it (see FRACTAL_AVX2),
+ * else with SSE2 (16 pixels), which every x86-64 CPU has. Other hosts, or builds with FRACTAL_SIMD
+ * off, use the scalar implementation. All of them give exactly the same pixels.
+ */
+namespace Scanline
+{
+    /**
+     * Pixels of `count` background or window palette indexes.
+     * @param indexes Palette indexes, from 0 to 3
+     * @param pixels Receive the pixels
+     * @param palette BGP: shade of index N is in bits 2N and 2N+1
+     */
+    void drawBackground(const uint8 *indexes, uint8 *pixels, size_t count, uint8 palette);
+
+    /**
+     * Draw 8 pixels of a sprite row over `pixels`.
+     * Sprite index 0 is transparent. If `behindBackground`, the sprite only shows where the background is transparent.
+     * @param pixels Line being drawn, 8 pixels from the sprite position
+     * @param spriteIndexes Palette indexes of the sprite row
+     * @param palette OBP0 or OBP1
+     */
+    void drawSpriteRow(uint8 *pixels, const uint8 *spriteIndexes, uint8 palette, bool behindBackground);
+}
+
+#endif //FRACTAL_SCANLINE_H
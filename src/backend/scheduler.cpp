@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <utility>
+
+#include "scheduler.h"
+
+void Scheduler::setHandler(Event event, Handler handler)
+{
+    handlers[static_cast<size_t>(event)] = std::move(handler);
+}
+
+void Scheduler::schedule(Event event, uint64 timestamp)
+{
+    timestamps[static_cast<size_t>(event)] = timestamp;
+    updateNextTimestamp();
+}
+
+void Scheduler::cancel(Event event)
+{
+    timestamps[static_cast<size_t>(event)] = never;
+    updateNextTimestamp();
+}
+
+void Scheduler::runDueEvents()
+{
+    while (clock >= nextTimestamp)
+    {
+        // Find the earliest event. Handler may schedule it again.
+        size_t earliest = 0;
+        for (size_t index = 1; index < eventCount; ++index)
+        {
+            if (timestamps[index] < timestamps[earliest])
+            {
+                earliest = index;
+            }
+        }
+
+        const uint64 timestamp = timestamps[earliest];
+        timestamps[earliest] = never;
+        updateNextTimestamp();
+
+        handlers[earliest](timestamp);
+    }
+}
+
+void Scheduler::updateNextTimestamp()
+{
+    nextTimestamp = never;
+    for (const uint64 timestamp : timestamps)
+    {
+        nextTimestamp = std::min(nextTimestamp, timestamp);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef FRACTAL_SCHEDULER_H
+#define FRACTAL_SCHEDULER_H
+
+#include <array>
+#include <functional>
+#include <limits>
+
+#include "../general.h"
+
+/**
+ * Scheduler hold the global clock and the events components expect at a known future cycle.
+ *
+ * Instead of being told about every elapsed cycle, a component schedules an event at an absolute
+ * timestamp and its handler is called once the clock reached it. The handler receives the timestamp
+ * the event was scheduled at (not the current clock), so periodic events can be rescheduled without drift.
+ *
+ * Each kind of event has at most one pending occurrence: scheduling it again move it.
+ * There are only a handful of kinds, so they live in a fixed array and the earliest timestamp is cached.
+ * The hot path, `isEventDue`, is a single comparison.
+ *
+ * Events are only run between two CPU instructions.
+ */
+class Scheduler
+{
+public:
+    enum class Event : uint8
+    {
+        // LCD current mode ended
+        LCDMode,
+        // TIMA overflowed a few cycles ago: request its interrupt
+        TimerInterrupt,
+        // Write dirty battery-backed cartridge RAM to its save file
+        CartridgeRAMFlush,
+        // OAM DMA transfer ended: give the bus back to the CPU
+        DMAEnd,
+
+        // Must be last
+        Count
+    };
+
+    using Handler = std::function<void(uint64 timestamp)>;
+
+    static constexpr uint64 never = std::numeric_limits<uint64>::max();
+
+    Scheduler()
+    {
+        timestamps.fill(never);
+    };
+
+    // No copy
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    /**
+     * Set the function called when `event` is due.
+     */
+    void setHandler(Event event, Handler handler);
+
+    /**
+     * Schedule `event` at `timestamp`. It replaces a pending occurrence of the same event.
+     * @param event Event to schedule
+     * @param timestamp Absolute cycle count, see `now`
+     */
+    void schedule(Event event, uint64 timestamp);
+
+    /**
+     * Remove the pending occurrence of `event`, if any.
+     */
+    void cancel(Event event);
+
+    /**
+     * Cycles elapsed since power on.
+     */
+    [[nodiscard]] uint64 now() const { return clock; }
+
+    /**
+     * Timestamp of the earliest pending event, or `never`.
+     */
+    [[nodiscard]] uint64 nextEventTime() const { return nextTimestamp; }
+
+    /**
+     * Move the clock forward. It does not run events, see `runDueEvents`.
+     */
+    void advance(uint32 cycles) { clock += cycles; }
+
+    /**
+     * Has the clock reached the earliest pending event?
+     */
+    [[nodiscard]] bool isEventDue() const { return clock >= nextTimestamp; }
+
+    /**
+     * Run all events due at the current clock, earliest first.
+     */
+    void runDueEvents();
+
+private:
+    // Native code advances the clock in place
+    friend class JIT;
+
+    static constexpr size_t eventCount = static_cast<size_t>(Event::Count);
+
+    uint64 clock = 0;
+    uint64 nextTimestamp = never;
+    std::array<uint64, eventCount> timestamps;
+    std::array<Handler, eventCount> handlers;
+
+    void updateNextTimestamp();
+};
+
+#endif //FRACTAL_SCHEDULER_H
@@ -0,0 +1,37 @@
+#include "tile_cache.h"
+
+TileCache::TileCache(const uint8 *tileData): tileData(tileData)
+{
+    // Nothing decoded yet
+    dirty.fill(true);
+}
+
+void TileCache::decodeDirtyTiles()
+{
+    for (size_t tile = 0; tile < tileCount; ++tile)
+    {
+        if (dirty[tile])
+        {
+            decode(tile);
+        }
+    }
+}
+
+void TileCache::decode(size_t tile)
+{
+    const uint8 *data = tileData + tile * 16;
+    for (size_t line = 0; line < tileSize; ++line)
+    {
+        const uint8 low = data[line * 2];
+        const uint8 high = data[line * 2 + 1];
+        for (size_t x = 0; x < tileSize; ++x)
+        {
+            // Leftmost pixel is the highest bit
+            const uint8 bit = 7 - x;
+            const uint8 index = ((low >> bit) & 1u) | (((high >> bit) & 1u) << 1u);
+            tiles[tile][line * tileSize + x] = index;
+            flippedTiles[tile][line * tileSize + (tileSize - 1 - x)] = index;
+        }
+    }
+    dirty[tile] = false;
+}
@@ -0,0 +1,74 @@
+#ifndef FRACTAL_TILE_CACHE_H
+#define FRACTAL_TILE_CACHE_H
+
+#include <array>
+#include <cstddef>
+
+#include "../general.h"
+
+/**
+ * Tiles of VRAM (0x8000 to 0x97FF) decoded from 2bpp to one palette index (0 to 3) per byte.
+ *
+ * A tile row is two bytes in VRAM, each holding one bit of the 8 pixels indexes. The LCD reads the
+ * same rows over and over: they are decoded once, with their horizontally flipped variant, and kept
+ * until VRAM changes. VirtualMemory calls `invalidate` on each write to tile data, and a dirty tile
+ * is decoded again the next time one of its rows is read.
+ */
+class TileCache
+{
+public:
+    static constexpr size_t tileCount = 384;
+    static constexpr size_t tileSize = 8;
+    static constexpr uint16 firstAddress = 0x8000;
+    static constexpr uint16 endAddress = firstAddress + tileCount * 16;
+
+    /**
+     * @param tileData VRAM from 0x8000, at least `tileCount` tiles of 16 bytes. It must outlive the cache.
+     */
+    explicit TileCache(const uint8 *tileData);
+
+    // No copy: it points to VRAM
+    TileCache(const TileCache&) = delete;
+    TileCache& operator=(const TileCache&) = delete;
+
+    /**
+     * Tile data at `address` (from `firstAddress` to `endAddress`) changed.
+     */
+    void invalidate(uint16 address)
+    {
+        dirty[(address - firstAddress) / 16u] = true;
+    }
+
+    /**
+     * Decode every dirty tile now. Until the next `invalidate`, `row` only reads: several threads may call it.
+     */
+    void decodeDirtyTiles();
+
+    /**
+     * Palette indexes of the 8 pixels of a tile row, left to right.
+     * @param tile Tile index, tile 0 being at 0x8000
+     * @param line Row in the tile, from 0 to 7
+     * @param xFlip Get the row mirrored
+     */
+    [[nodiscard]] const uint8 *row(size_t tile, size_t line, bool xFlip)
+    {
+        if (dirty[tile])
+        {
+            decode(tile);
+        }
+        return (xFlip ? flippedTiles : tiles)[tile].data() + line * tileSize;
+    }
+
+private:
+    const uint8 *tileData;
+
+    using DecodedTile = std::array<uint8, tileSize * tileSize>;
+    std::array<DecodedTile, tileCount> tiles {};
+    std::array<DecodedTile, tileCount> flippedTiles {};
+
+    std::array<bool, tileCount> dirty {};
+
+    void decode(size_t tile);
+};
+
+#endif //FRACTAL_TILE_CACHE_H
@@ -0,0 +1,117 @@
+#include "timer.h"
+
+Timer::Timer(VirtualMemory &memory, Scheduler &scheduler) : memory(memory), scheduler(scheduler)
+{
+    scheduler.setHandler(Scheduler::Event::TimerInterrupt, [this](uint64)
+    {
+        this->memory.requestInterrupt(this->memory.interruptBits.TIMA);
+        scheduleTimerInterrupt();
+    });
+
+    memory.registerIO(0xFF04, [this] { return static_cast<uint8>(dividerCounter() >> 8u); }, [this](uint8)
+    {
+        syncTimer();
+        dividerOrigin = this->scheduler.now();
+        scheduleTimerInterrupt();
+    });
+    memory.registerIO(0xFF05, [this] { return timerAt(this->scheduler.now()).value; }, [this](uint8 value)
+    {
+        syncTimer();
+        TIMA = value;
+        scheduleTimerInterrupt();
+    });
+    memory.registerIO(0xFF06, [this] { return TMA; }, [this](uint8 value)
+    {
+        syncTimer();
+        TMA = value;
+        scheduleTimerInterrupt();
+    });
+    memory.registerIO(0xFF07, [this] { return TAC | TACBits.alwaysHigh; }, [this](uint8 value)
+    {
+        syncTimer();
+        TAC = value;
+        scheduleTimerInterrupt();
+    });
+}
+
+Timer::TimerState Timer::timerAt(uint64 time) const
+{
+    if ((TAC & TACBits.enabled) == 0)
+    {
+        return {TIMA, lastOverflowTime};
+    }
+
+    // According to TIMA frequency, when a specific bit of the divider counter falls, TIMA is incremented.
+    // Increment number `k` happens at `dividerOrigin + (k << shift)`.
+    const uint8 shift = timerShift();
+    const uint64 firstIncrement = (timerSyncTime - dividerOrigin) >> shift;
+    const uint64 increments = ((time - dividerOrigin) >> shift) - firstIncrement;
+
+    const uint64 incrementsToOverflow = 256u - TIMA;
+    if (increments < incrementsToOverflow)
+    {
+        return {static_cast<uint8>(TIMA + increments), lastOverflowTime};
+    }
+
+    // Once overflowed, TIMA is reloaded from TMA: it then overflows every `256 - TMA` increments.
+    const uint64 reloadPeriod = 256u - TMA;
+    const uint64 sinceFirstOverflow = increments - incrementsToOverflow;
+    const uint64 lastOverflow = firstIncrement + incrementsToOverflow + sinceFirstOverflow / reloadPeriod * reloadPeriod;
+    return {static_cast<uint8>(TMA + sinceFirstOverflow % reloadPeriod), dividerOrigin + (lastOverflow << shift)};
+}
+
+void Timer::syncTimer()
+{
+    const uint64 now = scheduler.now();
+    const TimerState state = timerAt(now);
+    TIMA = state.value;
+    lastOverflowTime = state.lastOverflowTime;
+    timerSyncTime = now;
+}
+
+void Timer::scheduleTimerInterrupt()
+{
+    syncTimer();
+    const uint64 now = scheduler.now();
+
+    // An overflow happened a few cycles ago: its interrupt is still due
+    if (lastOverflowTime != 0 && lastOverflowTime + timerInterruptDelay > now)
+    {
+        scheduler.schedule(Scheduler::Event::TimerInterrupt, lastOverflowTime + timerInterruptDelay);
+        return;
+    }
+
+    if ((TAC & TACBits.enabled) == 0)
+    {
+        scheduler.cancel(Scheduler::Event::TimerInterrupt);
+        return;
+    }
+
+    const uint8 shift = timerShift();
+    const uint64 nextIncrement = ((now - dividerOrigin) >> shift) + 1;
+    const uint64 overflow = dividerOrigin + ((nextIncrement + (255u - TIMA)) << shift);
+    scheduler.schedule(Scheduler::Event::TimerInterrupt, overflow + timerInterruptDelay);
+}
+
+uint32 Timer::cyclesUntilDividerChange() const
+{
+    return 0x100u - (dividerCounter() & 0xFFu);
+}
+
+uint32 Timer::cyclesUntilTimerIncrement() const
+{
+    if ((TAC & TACBits.enabled) == 0)
+    {
+        return std::numeric_limits<uint32>::max();
+    }
+
+    const uint32 period = 1u << timerShift();
+    return period - (dividerCounter() & (period - 1));
+}
+
+uint8 Timer::timerShift() const
+{
+    // TIMA is incremented each 1024, 16, 64 or 256 cycles
+    static constexpr std::array<uint8, 4> shifts = {10, 4, 6, 8};
+    return shifts[TAC & TACBits.freq];
+}
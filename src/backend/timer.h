@@ -0,0 +1,129 @@
+#ifndef FRACTAL_TIMER_H
+#define FRACTAL_TIMER_H
+
+#include <array>
+#include <limits>
+
+#include "../general.h"
+#include "virtual_memory.h"
+#include "scheduler.h"
+
+/**
+ * Divider register (DIV) and TIMA timer, registers 0xFF04 to 0xFF07.
+ *
+ * Nothing is done as cycles elapse. Both registers are derived from the scheduler clock when read:
+ * DIV is the clock since its last reset, and TIMA is brought up to date from the last time it was
+ * exact (`syncTimer`), however long ago. Its next overflow is computed when timer registers are
+ * written, and scheduled as `Scheduler::Event::TimerInterrupt`.
+ */
+class Timer
+{
+public:
+    explicit Timer(VirtualMemory &memory, Scheduler &scheduler);
+
+    // No copy
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    /**
+     * Cycles before the value read at 0xFF04 (DIV) change.
+     */
+    [[nodiscard]] uint32 cyclesUntilDividerChange() const;
+
+    /**
+     * Cycles before the value read at 0xFF05 (TIMA) change, if nothing write timer registers in between.
+     * @return Cycles count, or the maximum value if TIMA is disabled
+     */
+    [[nodiscard]] uint32 cyclesUntilTimerIncrement() const;
+
+private:
+    VirtualMemory &memory;
+    Scheduler &scheduler;
+
+    /**
+     * TIMA interrupt is requested a few cycles after TIMA overflowed, through `Scheduler::Event::TimerInterrupt`.
+     */
+    static constexpr uint8 timerInterruptDelay = 4;
+
+    /**
+     * Clock when the divider counter was reset.
+     * The counter is the clock since then: read at 0xFF04 return its bits 8 to 15.
+     * Write at 0xFF04 reset the counter.
+     */
+    uint64 dividerOrigin = 0;
+
+    [[nodiscard]] uint64 dividerCounter() const { return scheduler.now() - dividerOrigin; }
+
+    /**
+     * TIMA timer, as it was at `timerSyncTime`. See TMA and TAC.
+     * Read at 0xFF05 return the current value.
+     * Write at 0xFF05 set the value.
+     */
+    uint8 TIMA = 0;
+    uint64 timerSyncTime = 0;
+
+    /**
+     * Clock of the last TIMA overflow, its interrupt may still be pending.
+     */
+    uint64 lastOverflowTime = 0;
+
+    /**
+     * TMA timer.
+     * When TIMA overflow (TIMA > 255), TMA is loaded into TIMA.
+     * TIMA must be synchronized before it changes.
+     * Read at 0xFF06 return the value.
+     * Write at 0xFF06 set the value.
+     */
+    uint8 TMA = 0;
+
+    /**
+     * TAC timer control.
+     * It enable/disable TIMA timer and sets its frequency.
+     * Read at 0xFF07 return the value.
+     * Write at 0xFF07:
+     *     - Bit [0,1]: set how often TIMA is incremented.
+     *                  0,0: 4096 Hz (every 1024 clocks)
+     *                  0,1: 262144 Hz (every 16 clocks)
+     *                  1,0: 65536 Hz (every 64 clocks)
+     *                  1,1: 16386 Hz (every 256 clocks)
+     *     - Bit [2]: if set, TIMA timer is enabled
+     *     - Bit [3..7]: ignored
+     * TIMA must be synchronized before it changes.
+     */
+    uint8 TAC = 0;
+    const struct
+    {
+        const uint8 freq = 1u << 0u | 1u << 1u;
+        const uint8 enabled = 1u << 2u;
+        const uint8 alwaysHigh = 1u << 3u | 1u << 4u | 1u << 5u | 1u << 6u | 1u << 7u;
+    } TACBits;
+
+    /**
+     * TIMA is incremented when the bit `timerShift() - 1` of the divider register falls,
+     * which means each `1 << timerShift()` cycles.
+     */
+    [[nodiscard]] uint8 timerShift() const;
+
+    struct TimerState
+    {
+        uint8 value;
+        uint64 lastOverflowTime;
+    };
+
+    /**
+     * TIMA value, and clock of its last overflow, at `time` (from `timerSyncTime`), in constant time.
+     */
+    [[nodiscard]] TimerState timerAt(uint64 time) const;
+
+    /**
+     * Bring TIMA up to the current clock. Must be called before changing TIMA, TMA, TAC or the divider.
+     */
+    void syncTimer();
+
+    /**
+     * Schedule the interrupt of the next TIMA overflow, after timer registers changed.
+     */
+    void scheduleTimerInterrupt();
+};
+
+#endif //FRACTAL_TIMER_H
@@ -1,395 +1,384 @@
+#include <cstring>
+
 #include "virtual_memory.h"
 
-uint8 VirtualMemory::read8(const uint16 address)
+VirtualMemory::VirtualMemory(std::shared_ptr<const RomImage> biosImage, std::shared_ptr<const RomImage> gameImage, Scheduler &scheduler, const std::string &savePath):
+scheduler(scheduler), biosRom(std::move(biosImage)), gameROM(std::move(gameImage)), cartridge(gameROM, scheduler, savePath)
 {
-    // I scoped everything just to help the eye to read.
-    // Scope by themselve serve no purpose.
+    if (biosRom->size() < bootloaderSize)
+    {
+        throw std::invalid_argument("BIOS must be 256 bytes long");
+    }
+
+    // Game/BIOS ROM and cartridge RAM. Writes to ROM are MBC registers: slow path.
+    readPages[0x00] = biosRom->data();
+    mapCartridge();
 
-    // Game/BIOS ROM
+    mapVideoRAM();
+    mapWorkingRAM();
+
+    // OAM is followed by an unusable area: writes go through the slow path which drop them.
+    std::fill(oamRAM.begin(), oamRAM.end(), 0xFF);
+    readPages[0xFE] = oamRAM.data();
+
+    // I/O registers. Until a device registers them, they read high and ignore writes.
+    for (size_t index = 0; index < ioRegisterCount; ++index)
     {
-        // If we are in bios memory
-        if (address <= 0xFF && biosRomDisabled == 0)
-        {
-            return biosRom.data[address];
-        }
-        if (address < 0x4000)
-        {
-            return gameROM.data[address];
-        }
-        if (address < 0x8000)
+        registerIO(ioFirstAddress + index, nullptr, nullptr);
+    }
+    // Registers not owned by another device
+    registerIO(0xFF01, [] { return 0; }, [](uint8 value) { std::cout << value; }); // serial port
+    registerIO(0xFF02, [] { return 0; }, nullptr); // serial port control
+    registerIO(0xFF0F, [this] { return interruptRequest | interruptBits.alwaysHigh; }, [this](uint8 value)
+    {
+        interruptRequest = value;
+        updatePendingInterrupts();
+    });
+    registerIO(0xFF46, nullptr, [this](uint8 value) { startDMA(value); });
+    scheduler.setHandler(Scheduler::Event::DMAEnd, [this](uint64) { unlockBus(); });
+    registerIO(0xFF50, [this] { return biosRomDisabled; }, [this](uint8 value)
+    {
+        if (value != 0 && biosRomDisabled == 0)
         {
-            return gameROM.data[(address - 0x4000) + (0x4000 * currentROMBank)];
+            biosRomDisabled = 1;
+            mapCartridge();
         }
-        if (address == 0xFF50)
+    });
+
+    if (cartridge.hasSaveFile())
+    {
+        scheduler.setHandler(Scheduler::Event::CartridgeRAMFlush, [this](uint64 timestamp)
         {
-            return biosRomDisabled;
-        }
+            // Flushed pages are clean again: map them so their next write is caught
+            if (cartridge.flushRAM())
+            {
+                mapCartridge();
+            }
+            this->scheduler.schedule(Scheduler::Event::CartridgeRAMFlush, timestamp + cartridgeFlushPeriod);
+        });
+        scheduler.schedule(Scheduler::Event::CartridgeRAMFlush, cartridgeFlushPeriod);
     }
+}
 
-    // I/O
+const std::array<uint8, VirtualMemory::pageSize> VirtualMemory::unmappedPage = []
+{
+    std::array<uint8, pageSize> page {};
+    page.fill(0xFF);
+    return page;
+}();
+
+void VirtualMemory::mapGameROM(size_t firstPage, size_t count, size_t romOffset)
+{
+    for (size_t page = firstPage; page < firstPage + count; ++page, romOffset += pageSize)
     {
-        // Joypad buttons
-        if (address == 0xFF00)
-        {
-            return joypadButtons | joypadButtonsBits.alwaysHigh;
-        }
-        // serial port
-        if (address == 0xFF01)
-        {
-            return 0;
-        }
-        // serial port control
-        if (address == 0xFF02)
-        {
-            return 0;
-        }
+        readPages[page] = romOffset + pageSize <= gameROM->size() ? gameROM->data() + romOffset : unmappedPage.data();
     }
+}
 
-    // Divider register and Timer TIMA
+void VirtualMemory::mapCartridge()
+{
+    // The mapping may change during DMA (bios disabled, RAM flush): update the pages put aside
+    const bool locked = dmaActive;
+    if (locked)
     {
-        if (address == 0xFF04)
-        {
-            return static_cast<uint8>(dividerRegister >> 8u);
-        }
-        if (address == 0xFF05)
-        {
-            return TIMA;
-        }
-        if (address == 0xFF06)
-        {
-            return TMA;
-        }
-        if (address == 0xFF07)
-        {
-            return TAC | TACBits.alwaysHigh;
-        }
+        unlockBus();
     }
 
-    // Interrupts
+    ++codeMappingChanges;
+
+    // BIOS stays over the first page until disabled
+    const size_t firstROMPage = biosRomDisabled == 0 ? 0x01 : 0x00;
+    mapGameROM(firstROMPage, 0x40 - firstROMPage, cartridge.romOffset(firstROMPage * pageSize));
+    mapGameROM(0x40, 0x40, cartridge.romOffset(0x4000));
+
+    for (size_t page = 0xA0; page < 0xC0; ++page)
     {
-        if (address == 0xFF0F)
-        {
-            return interruptRequest | interruptBits.alwaysHigh;
-        }
+        readPages[page] = cartridge.ramReadPage(page * pageSize);
+        writePages[page] = cartridge.ramWritePage(page * pageSize);
+    }
 
-        if (address == 0xFFFF)
-        {
-            return interruptEnable | interruptBits.alwaysHigh;
-        }
+    if (locked)
+    {
+        lockBus();
     }
+}
 
-    // Raw RAMs
+void VirtualMemory::mapVideoRAM()
+{
+    // Watching may start or stop during DMA: update the pages put aside
+    const bool locked = dmaActive;
+    if (locked)
     {
-        if (address >= 0x8000 && address < 0x9FFF)
-        {
-            return videoRAM[address - 0x8000];
-        }
-        if (address >= 0xC000 && address < 0xE000)
-        {
-            return workingRAM[address - 0xC000];
-        }
-        // echo working RAM
-        if (address >= 0xE000 && address < 0xFE00)
-        {
-            return workingRAM[address - 0xE000];
-        }
-        if (address >= 0xFE00 && address < 0xFEA0)
-        {
-            return oamRAM[address - 0xFE00];
-        }
-        if (address >= 0xFF80 && address < 0xFFFF)
-        {
-            return stackRAM[address - 0xFF80];
-        }
+        unlockBus();
     }
 
-    // Graphics
+    // Writes to tile data go through the slow path, to invalidate decoded tiles
+    for (size_t page = 0; page < videoRAM.size() / pageSize; ++page)
     {
-        if (address == 0xFF40)
-        {
-            return lcdControl;
-        }
-        if (address == 0xFF41)
-        {
-            return STAT | STATBits.alwaysHigh;
-        }
-        if (address == 0xFF42)
-        {
-            return scrollY;
-        }
-        if (address == 0xFF43)
-        {
-            return scrollX;
-        }
-        if (address == 0xFF44)
-        {
-            return LY;
-        }
-        if (address == 0xFF45)
-        {
-            return LYC;
-        }
-        if (address == 0xFF47)
-        {
-            return backgroundPalette;
-        }
-        if (address == 0xFF48)
-        {
-            return objectPalette0;
-        }
-        if (address == 0xFF49)
-        {
-            return objectPalette1;
-        }
-        if (address == 0xFF4A)
-        {
-            return windowY;
-        }
-        if (address == 0xFF4B)
-        {
-            return windowX;
-        }
+        uint8 *memory = videoRAM.data() + page * pageSize;
+        const bool isTileData = 0x80 + page < TileCache::endAddress / pageSize;
+        readPages[0x80 + page] = memory;
+        writePages[0x80 + page] = isTileData || videoMemoryWatcher ? nullptr : memory;
     }
 
-    // undefined memory is always high
-    return 0xFF;
+    if (locked)
+    {
+        lockBus();
+    }
 }
 
-void VirtualMemory::write8(const uint16 address, uint8 value)
+void VirtualMemory::mapWorkingRAM()
 {
-    // Game ROM
+    // Code may be protected during DMA: update the pages put aside
+    const bool locked = dmaActive;
+    if (locked)
     {
-        if (address >= 0x2000 && address < 0x4000)
-        {
-            value &= ROMBankBits.lowerBits;
-            if (value == 0)
-                value = 1;
-            currentROMBank |= value;
-            currentROMBank &= ROMBankBits.upperBits | value;
+        unlockBus();
+    }
 
-        }
-        if (address >= 0x4000 && address < 0x6000)
+    // Echo working RAM goes up to 0xFDFF
+    for (size_t page = 0; page < workingRAM.size() / pageSize; ++page)
+    {
+        uint8 *memory = workingRAM.data() + page * pageSize;
+        const bool isProtected = protectedCodePages & (1u << page);
+        readPages[0xC0 + page] = memory;
+        writePages[0xC0 + page] = isProtected ? nullptr : memory;
+        if (page < 0x1E)
         {
-            value <<= 5u;
-            value &= ROMBankBits.upperBits;
-            currentROMBank |= value;
-            currentROMBank &= ROMBankBits.lowerBits | value;
-        }
-        if (address == 0xFF50)
-        {
-            if (value != 0)
-            {
-                biosRomDisabled = 1;
-            }
+            readPages[0xE0 + page] = memory;
+            writePages[0xE0 + page] = isProtected ? nullptr : memory;
         }
     }
 
-    // I/O
+    if (locked)
     {
-        if (address == 0xFF00)
-        {
-            // only select bits are writable
-            joypadButtons &= ~joypadButtonsBits.selectBits;
-            joypadButtons |= value & joypadButtonsBits.selectBits;
-        }
-        // serial port
-        if (address == 0xFF01)
-        {
-            std::cout << value;
-        }
-        // serial port control
-        if (address == 0xFF02)
-        {
-            return;
-        }
+        lockBus();
     }
+}
 
-    // Divider register and Timer TIMA
+void VirtualMemory::protectCode(const uint16 address)
+{
+    const uint32 page = 1u << ((address - 0xC000u) / pageSize);
+    if (!(protectedCodePages & page))
     {
-        if (address == 0xFF04)
-        {
-            dividerRegister = 0;
-        }
-        if (address == 0xFF05)
-        {
-            TIMA = value;
-        }
-        if (address == 0xFF06)
-        {
-            TMA = value;
-        }
-        if (address == 0xFF07)
-        {
-            TAC = value;
-        }
+        protectedCodePages |= page;
+        mapWorkingRAM();
     }
+}
 
-    // Interrupts
+void VirtualMemory::watchVideoMemory(VideoMemoryWriteHandler handler)
+{
+    videoMemoryWatcher = std::move(handler);
+    mapVideoRAM();
+}
+
+void VirtualMemory::registerIO(uint16 address, IOReadHandler read, IOWriteHandler write)
+{
+    const size_t index = address - ioFirstAddress;
+    ioReadHandlers.at(index) = read ? std::move(read) : [] { return static_cast<uint8>(0xFF); };
+    ioWriteHandlers.at(index) = write ? std::move(write) : [](uint8) {};
+}
+
+uint8 VirtualMemory::readSlow(const uint16 address)
+{
+    // Only page 0xFF and cartridge RAM may not be mapped for reads, unless DMA locked the bus
+    if (address < ioFirstAddress)
     {
-        if (address == 0xFF0F)
-        {
-            interruptRequest = value;
-        }
-        if (address == 0xFFFF)
-        {
-            interruptEnable = value;
-        }
+        return dmaActive ? 0xFF : cartridge.readRAM(address);
+    }
+    if (address < ioFirstAddress + ioRegisterCount)
+    {
+        return ioReadHandlers[address - ioFirstAddress]();
     }
+    if (address == 0xFFFF)
+    {
+        return interruptEnable | interruptBits.alwaysHigh;
+    }
+    return stackRAM[address - 0xFF80];
+}
 
-    // Raw RAMs
+void VirtualMemory::writeSlow(const uint16 address, uint8 value)
+{
+    // I/O, HRAM and IE
+    if (address >= ioFirstAddress)
     {
-        if (address >= 0x8000 && address < 0x9FFF)
-        {
-            videoRAM[address - 0x8000] = value;
-        }
-        if (address >= 0xC000 && address < 0xE000)
+        if (address < ioFirstAddress + ioRegisterCount)
         {
-            workingRAM[address - 0xC000] = value;
+            ioWriteHandlers[address - ioFirstAddress](value);
         }
-        // echo working RAM
-        if (address >= 0xE000 && address < 0xFE00)
+        else if (address == 0xFFFF)
         {
-            workingRAM[address - 0xE000] = value;
-        }
-        if (address >= 0xFE00 && address < 0xFEA0)
-        {
-            oamRAM[address - 0xFE00] = value;
+            interruptEnable = value;
+            updatePendingInterrupts();
         }
-        if (address >= 0xFF80 && address < 0xFFFE)
+        else
         {
             stackRAM[address - 0xFF80] = value;
         }
+        return;
     }
 
-    // Graphics
+    if (dmaActive)
     {
-        if (address == 0xFF40)
-        {
-            lcdControl = value;
-            std::cout << +(lcdControl & lcdControlBits.windowEnable) << std::endl;
-        }
-        if (address == 0xFF41)
-        {
-            STAT = value;
-        }
-        if (address == 0xFF42)
-        {
-            scrollY = value;
-        }
-        if (address == 0xFF43)
-        {
-            scrollX = value;
-        }
-        if (address == 0xFF45)
-        {
-            LYC = value;
-        }
+        return;
+    }
 
-        // DMA - Copy OAM data from 0x[value]00 to OAM ram
-        // todo more cycle and bug accurate implementation
-        if (address == 0xFF46)
-        {
-            if (value >= 0xF1)
-            {
-                return;
-            }
-            const uint16 startAddress = value * 0x100;
-            const uint16 sizeToCopy = 0xA0;
-            for (uint16 i = 0; i < sizeToCopy; ++i)
-            {
-                oamRAM[i] = read8(startAddress + i);
-            }
-        }
+    // Working RAM and echo RAM protected because they hold cached code
+    if (address >= 0xC000 && address < 0xFE00)
+    {
+        const uint16 offset = (address - 0xC000) & 0x1FFFu;
+        workingRAM[offset] = value;
 
-        if (address == 0xFF47)
-        {
-            backgroundPalette = value;
-        }
-        if (address == 0xFF48)
+        const uint32 page = 1u << (offset / pageSize);
+        protectedCodePages &= ~page;
+        writtenCodePages |= page;
+        ++codeMappingChanges;
+        mapWorkingRAM();
+        return;
+    }
+
+    // OAM, followed by the unusable area
+    if (address >= 0xFE00)
+    {
+        if (address < 0xFEA0)
         {
-            objectPalette0 = value;
+            beforeVideoMemoryWrite();
+            oamRAM[address - 0xFE00] = value;
+            oamChanged = true;
         }
-        if (address == 0xFF49)
+        return;
+    }
+
+    // Game ROM: MBC registers
+    if (address < 0x8000)
+    {
+        if (cartridge.writeControl(address, value))
         {
-            objectPalette1 = value;
+            mapCartridge();
         }
-        if (address == 0xFF4A)
+        return;
+    }
+
+    // VRAM: tile data, or tilemaps while watched
+    if (address < 0xA000)
+    {
+        beforeVideoMemoryWrite();
+        videoRAM[address - 0x8000] = value;
+        if (address < TileCache::endAddress)
         {
-            windowY = value;
+            tileCache.invalidate(address);
         }
-        if (address == 0xFF4B)
+        return;
+    }
+
+    // Cartridge RAM not mapped for writes
+    if (address >= 0xA000 && address < 0xC000)
+    {
+        if (cartridge.writeRAM(address, value))
         {
-            windowX = value;
+            mapCartridge();
         }
     }
 }
 
-void VirtualMemory::incrementDividerRegister(uint8 amount)
+void VirtualMemory::startDMA(uint8 value)
 {
-    uint16 oldDividerRegister = dividerRegister;
-    dividerRegister += amount;
+    // Sources from 0xE000 read working RAM, like echo RAM
+    const uint8 sourcePage = value >= 0xE0 ? value - 0x20 : value;
 
-    // TIMA may need to be incremented multiple time during one instruction.
-    // To make this happen, update TIMA with a maximum of 15 cycles.
-    // 15 cycles is the lowest frequency of TIMA.
+    beforeVideoMemoryWrite();
 
-    static const uint8 threshold = 10;
-    uint8 subtractedAmount = 0;
-    while (amount != 0)
+    // Whole transfer at once, from the memory mapped before the bus was locked
+    const uint8 *source = dmaActive ? busReadPages[sourcePage] : readPages[sourcePage];
+    if (source != nullptr)
+    {
+        std::memcpy(oamRAM.data(), source, oamSize);
+    }
+    else
     {
-        subtractedAmount = std::min(threshold, amount);
-        updateTIMATimer(oldDividerRegister, subtractedAmount);
-        amount -= subtractedAmount;
-        oldDividerRegister += subtractedAmount;
+        // Cartridge RAM not mapped: RTC registers or disabled RAM
+        for (size_t i = 0; i < oamSize; ++i)
+        {
+            oamRAM[i] = cartridge.readRAM(sourcePage * pageSize + i);
+        }
     }
+
+    oamChanged = true;
+
+    // A new transfer restarts the countdown
+    lockBus();
+    scheduler.schedule(Scheduler::Event::DMAEnd, scheduler.now() + dmaDuration);
 }
 
-void VirtualMemory::updateTIMATimer(uint16 oldDividerRegister, uint16 amountAdded)
+void VirtualMemory::lockBus()
 {
-    interruptRequest |= interruptRequestAfter;
-    interruptRequestAfter = 0;
-
-    if ((TAC & TACBits.enabled) == 0)
+    if (dmaActive)
     {
         return;
     }
+    dmaActive = true;
+    ++codeMappingChanges;
 
-    // According to TIMA frequency, when a specific of divider register overflow,
-    // TIMA is incremented.
-    const uint8 freqFlag = TAC & TACBits.freq;
-    uint16 overflow = 0;
+    busReadPages = readPages;
+    busWritePages = writePages;
+    std::fill(readPages.begin(), readPages.begin() + 0xFF, nullptr);
+    std::fill(writePages.begin(), writePages.begin() + 0xFF, nullptr);
+}
 
-    if (freqFlag == 0)
-    {
-        overflow = 1023;
-    }
-    if (freqFlag == 1)
-    {
-        overflow = 15;
-    }
-    if (freqFlag == 2)
+void VirtualMemory::unlockBus()
+{
+    if (!dmaActive)
     {
-        overflow = 63;
+        return;
     }
-    if (freqFlag == 3)
+    dmaActive = false;
+
+    readPages = busReadPages;
+    writePages = busWritePages;
+}
+
+int32 VirtualMemory::gameROMOffset(const uint16 address) const
+{
+    // ROM can not be read during DMA
+    if (dmaActive || (address <= 0xFF && biosRomDisabled == 0))
     {
-        overflow = 255;
+        return -1;
     }
 
-    // check if freqBit overflow. Same as half-carry.
-    if (((oldDividerRegister & overflow) + (amountAdded & overflow)) <= overflow)
+    if (address >= 0x8000)
     {
-        // Did not overflow
-        return;
+        return -1;
     }
 
-    ++TIMA;
+    const size_t offset = cartridge.romOffset(address);
 
-    if (TIMA == 0)
+    return offset < gameROM->size() ? static_cast<int32>(offset) : -1;
+}
+
+int32 VirtualMemory::codeOffset(const uint16 address) const
+{
+    if (address >= 0xC000 && address < 0xE000)
     {
-        // TIMA overflow. reset it
-        TIMA = TAC;
-        // request interrupt
-        interruptRequestAfter |= interruptBits.TIMA;
+        const uint16 offset = address - 0xC000;
+        const bool isProtected = protectedCodePages & (1u << (offset / pageSize));
+        return isProtected && !dmaActive ? workingRAMCodeOffset + offset : -1;
     }
-}
\ No newline at end of file
+    return gameROMOffset(address);
+}
+
+void VirtualMemory::requestInterrupt(uint8 bit)
+{
+    interruptRequest |= bit;
+    updatePendingInterrupts();
+}
+
+void VirtualMemory::acknowledgeInterrupt(uint8 bit)
+{
+    interruptRequest &= ~bit;
+    updatePendingInterrupts();
+}
+
+void VirtualMemory::updatePendingInterrupts()
+{
+    pendingInterruptsMask = interruptRequest & interruptEnable & ~interruptBits.alwaysHigh;
+}
@@ -6,10 +6,14 @@
 #include <memory>
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <string>
 
 #include "../general.h"
-#include "../files/file_reader_stack.h"
-#include "../files/file_reader_heap.h"
+#include "../files/rom_registry.h"
+#include "scheduler.h"
+#include "cartridge.h"
+#include "tile_cache.h"
 
 using namespace EmulatorConstants;
 
@@ -19,307 +23,325 @@ using namespace EmulatorConstants;
  * MMU is 8 bit only.
  *
  * - Once address 255 have been read, bios is read. MMU automatically disable bios and insert game data in place.
+ *
+ * The address space is split in 256 pages of 256 bytes. Each page has a read and a write pointer to the
+ * memory backing it (ROM, VRAM, WRAM, echo RAM, OAM), so most accesses are a single indexed load.
+ * A null pointer send the access to the slow path: I/O registers, MBC registers, unmapped memory,
+ * and writes to VRAM tile data, which invalidate `tileCache`. Writes to the rest of VRAM and to OAM go there too
+ * while the LCD watches them, see `watchVideoMemory`.
+ * Pointers are updated when the mapping change (bank switch, bios disabled), not on each access.
+ *
+ * I/O registers (0xFF00 to 0xFF7F) are owned by the devices implementing them. Each device registers
+ * handlers for its registers with `registerIO`, and an access calls the handler of its address directly.
+ *
+ * While an OAM DMA transfer runs, the CPU only reaches I/O registers, HRAM and IE: the page table is put
+ * aside and every other access reads 0xFF and drops writes, see `startDMA`.
  */
 class VirtualMemory
 {
 public:
-    explicit VirtualMemory(const std::string &biosRomPath, const std::string &gameROM):
-    biosRom(biosRomPath), gameROM(gameROM)
-    {}
+    /**
+     * If the BIOS is smaller than 256 bytes, the constructor will throw.
+     * @param biosImage BIOS image, see RomRegistry
+     * @param gameImage Game image, see RomRegistry
+     * @param savePath Save file of battery-backed cartridge RAM, or empty to not persist it
+     */
+    explicit VirtualMemory(std::shared_ptr<const RomImage> biosImage, std::shared_ptr<const RomImage> gameImage, Scheduler &scheduler, const std::string &savePath = "");
 
-    // No copy
+    // No copy: pages point inside the instance
+    VirtualMemory(const VirtualMemory&) = delete;
     VirtualMemory& operator=(const VirtualMemory&) = delete;
 
-    [[nodiscard]] uint8 read8(uint16 address);
-    void write8(uint16 address, uint8 value);
+    [[nodiscard]] uint8 read8(uint16 address)
+    {
+        const uint8 *page = readPages[address >> 8u];
+        if (page != nullptr)
+        {
+            return page[address & 0xFFu];
+        }
+        return readSlow(address);
+    }
+
+    void write8(uint16 address, uint8 value)
+    {
+        uint8 *page = writePages[address >> 8u];
+        if (page != nullptr)
+        {
+            page[address & 0xFFu] = value;
+            return;
+        }
+        writeSlow(address, value);
+    }
+
+    using IOReadHandler = std::function<uint8()>;
+    using IOWriteHandler = std::function<void(uint8 value)>;
 
-    void incrementDividerRegister(uint8 amount);
+    /**
+     * Route accesses to the I/O register at `address` to a device.
+     * @param address Register address, from 0xFF00 to 0xFF7F
+     * @param read Return the value read. If empty, the register reads 0xFF.
+     * @param write Receive the value written. If empty, writes are ignored.
+     */
+    void registerIO(uint16 address, IOReadHandler read, IOWriteHandler write);
 
-private:
-    friend class LCD;
-    friend class InputManager;
+    /**
+     * Where does `address` read in the game ROM file, with the current ROM bank applied?
+     * @return Offset of `address` in the game ROM, or -1 if `address` does not read the game ROM.
+     */
+    [[nodiscard]] int32 gameROMOffset(uint16 address) const;
 
-    static const size_t bootloaderSize = 256;
-    const FileReaderStack<bootloaderSize> biosRom;
-    const FileReaderHeap gameROM;
+    /**
+     * Key of the code at `address` for the block cache: its game ROM offset (see `gameROMOffset`), or
+     * `workingRAMCodeOffset` plus its offset in working RAM if its page is protected (see `protectCode`).
+     * @return The offset, or -1 if code at `address` can not be cached.
+     */
+    [[nodiscard]] int32 codeOffset(uint16 address) const;
 
     /**
-     * If different than 0, bios rom is disabled.
-     * Read at 0xFF50 return the value.
-     * Write of 1 at 0xFF50 write the value.
-     * Other writes are rejected.
+     * Code offsets from here are in working RAM. Game ROMs are at most 8 MiB.
      */
-    uint8 biosRomDisabled = 0;
+    static constexpr int32 workingRAMCodeOffset = 0x800000;
 
-    // Always MBC1 for now
-    uint8 currentROMBank = 1;
-    const struct
+    /**
+     * Catch writes to the working RAM page holding `address` (0xC000 to 0xDFFF), because code from
+     * it has been cached. The first write unprotects the page and reports it in `takeWrittenCodePages`.
+     */
+    void protectCode(uint16 address);
+
+    [[nodiscard]] bool hasWrittenCodePages() const { return writtenCodePages != 0; }
+
+    /**
+     * Working RAM pages written since they were protected (bit n for page 0xC0 + n). Reported only once.
+     */
+    [[nodiscard]] uint32 takeWrittenCodePages()
     {
-        const uint8 lowerBits = 1u << 0u | 1u << 1u | 1u << 2u | 1u << 3u | 1u << 4u;
-        const uint8 upperBits = 1u << 5u | 1u << 6u;
-    } ROMBankBits;
+        const uint32 pages = writtenCodePages;
+        writtenCodePages = 0;
+        return pages;
+    }
 
-    // TODO std::array
-    std::array<uint8, 0x2000> workingRAM;
-    std::array<uint8, 0xA0> oamRAM;
-    std::array<uint8, 128> stackRAM;
-    std::array<uint8, 0x2000> videoRAM;
+    /**
+     * Changes each time cached code may not be mapped anymore: ROM bank switch, BIOS disabled,
+     * bus locked by OAM DMA, protected working RAM page written.
+     * Code comparing it before and after an instruction can skip `codeOffset` when it did not change.
+     */
+    [[nodiscard]] uint32 codeMappingVersion() const { return codeMappingChanges; }
 
     /**
-     * Hold if an interrupt is requested
-     * Bit 0: Vertical blank interrupt [0x0040]
-     * Bit 1: LCD STAT interrupt [0x0048]
-     * Bit 2: Timer (TIMA) interrupt [0x0050]
-     * Bit 3: Serial interrupt [0x0058]
-     * Bit 4: Joypad interrupt [0x0060]
-     *
-     * CPU check these before each instructions.
-     *
-     * Read at 0xFF0F return these five bits. Remaining bits are high.
-     * Write at 0xFF0F works. Last 3 bits are ignored.
+     * Request an interrupt (set its bit in IF).
+     * Devices must go through it so `pendingInterrupts` stay in sync.
+     * @param bit Bit of the interrupt, see `interruptBits`
      */
-    uint8 interruptRequest = 0;
+    void requestInterrupt(uint8 bit);
 
     /**
-     * Same as interruptRequest.
-     * TIMA interrupt is delayed one instruction before being set.
-     * When TIMA is triggered, it is enabled here first, then in interruptRequest.
+     * Acknowledge an interrupt being serviced (clear its bit in IF).
+     * @param bit Bit of the interrupt, see `interruptBits`
      */
-    uint8 interruptRequestAfter = 0;
+    void acknowledgeInterrupt(uint8 bit);
 
     /**
-     * Hold if interrupts are enabled. Same bit topology as `interruptRequest`.
-     * CPU check these before each instructions.
-     *
-     * Read at 0xFFFF return these five bits. Remaining bits are high.
-     * Write at 0xFFFF set the value. Last 3 bits are ignored.
+     * Interrupts both requested and enabled (IE & IF), cached so the CPU can check it before each instruction.
+     * Lowest bit has the highest priority.
      */
-    uint8 interruptEnable = 0;
+    [[nodiscard]] uint8 pendingInterrupts() const { return pendingInterruptsMask; }
+
+    using VideoMemoryWriteHandler = std::function<void()>;
 
     /**
-     * Joypad input/output
-     * Read at 0xFF00 return these first 6 bits. Remaining bits are high.
-     * Write at 0xFF00 set the value. Remaining bits are high.
+     * Call `handler` once, right before the next write to VRAM or OAM (DMA included), then stop watching.
+     * While watched, all VRAM writes go through the slow path.
+     * @param handler Called before the write, or empty to stop watching
      */
-    uint8 joypadButtons = 0xFF;
+    void watchVideoMemory(VideoMemoryWriteHandler handler);
 
-    const struct
-    {
-        const uint8 rightOrA = 1u << 0u;
-        const uint8 leftOrB = 1u << 1u;
-        const uint8 upOrSelect = 1u << 2u;
-        const uint8 downOrStart = 1u << 3u;
-        const uint8 inputBits = rightOrA | leftOrB | upOrSelect | downOrStart;
+private:
+    friend class LCD;
+    friend class JIT;
 
-        const uint8 selectDirection = 1u << 4u;
-        const uint8 selectButton = 1u << 5u;
-        const uint8 selectBits = selectDirection | selectButton;
+    Scheduler &scheduler;
 
-        const uint8 alwaysHigh = 1u << 6u | 1u << 7u;
-    } joypadButtonsBits;
+    static const size_t bootloaderSize = 256;
+    // Shared with other instances: never written
+    const std::shared_ptr<const RomImage> biosRom;
+    const std::shared_ptr<const RomImage> gameROM;
 
-public:
-    const struct
-    {
-        const uint8 verticalBlank = 1u << 0u;
-        const uint8 STAT = 1u << 1u;
-        const uint8 TIMA = 1u << 2u;
-        const uint8 serial = 1u << 3u;
-        const uint8 joypad = 1u << 4u;
-        const uint8 alwaysHigh = 1u << 5u | 1u << 6u | 1u << 7u;
-    } interruptBits;
+    Cartridge cartridge;
 
-    const struct
-    {
-        const uint16 verticalBlank = 0x0040u;
-        const uint16 lcdStat = 0x0048u;
-        const uint16 TIMA = 0x0050u;
-        const uint16 serial = 0x0058u;
-        const uint16 joypad = 0x0060u;
-    } interruptAddress;
+    static constexpr size_t pageSize = 0x100;
+    static constexpr size_t pageCount = 0x100;
 
-private:
     /**
-     * Hold clock count.
-     * Read at 0xFF04 return the upper 8 bits of this counter.
-     * Write at 0xFF04 reset the whole counter.
-     * See `incrementDividerRegister` for low-level CPU clock increment.
+     * Memory backing each page, or nullptr if accesses must go through `readSlow` / `writeSlow`.
      */
-    uint16 dividerRegister = 0;
+    std::array<const uint8*, pageCount> readPages {};
+    std::array<uint8*, pageCount> writePages {};
 
     /**
-     * TIMA timer. See TMA and TAC.
-     * Read at 0xFF05 return the value.
-     * Write at 0xFF05 set the value.
+     * Read by pages with nothing behind: ROM past the end of the file, unusable OAM area.
      */
-    uint8 TIMA = 0;
+    static const std::array<uint8, pageSize> unmappedPage;
 
     /**
-     * TMA timer.
-     * When TIMA overflow (TIMA > 255), TMA is loaded into TIMA.
-     * Read at 0xFF06 return the value.
-     * Write at 0xFF06 set the value.
+     * Read and write of I/O registers, HRAM, IE and everything writes can not reach directly.
      */
-    uint8 TMA = 0;
+    [[nodiscard]] uint8 readSlow(uint16 address);
+    void writeSlow(uint16 address, uint8 value);
 
     /**
-     * TAC timer control.
-     * It enable/disable TIMA timer and sets its frequency.
-     * Read at 0xFF07 return the value.
-     * Write at 0xFF07:
-     *     - Bit [0,1]: set how often TIMA is incremented.
-     *                  0,0: 4096 Hz (every 1024 clocks)
-     *                  0,1: 262144 Hz (every 16 clocks)
-     *                  1,0: 65536 Hz (every 64 clocks)
-     *                  1,1: 16386 Hz (every 256 clocks)
-     *     - Bit [2]: if set, TIMA timer is enabled
-     *     - Bit [3..7]: ignored
+     * Point `count` read pages from `firstPage` to the game ROM from `romOffset`.
+     * Pages past the end of the file read as unmapped.
      */
-    uint8 TAC = 0;
-    const struct
-    {
-        const uint8 freq = 1u << 0u | 1u << 1u;
-        const uint8 enabled = 1u << 2u;
-        const uint8 alwaysHigh = 1u << 3u | 1u << 4u | 1u << 5u | 1u << 6u | 1u << 7u;
-    } TACBits;
+    void mapGameROM(size_t firstPage, size_t count, size_t romOffset);
 
-    void updateTIMATimer(uint16 oldDividerRegister, uint16 amountAdded);
+    /**
+     * Map cartridge pages (ROM and external RAM) to the banks currently selected, see Cartridge.
+     */
+    void mapCartridge();
 
     /**
-     * LCD Control.
-     * Read at 0xFF40 return the value.
-     * Write at 0xFF40 write the value.
-     *
-     * Bit 0: is background tiling enabled?
-     * Bit 1: are sprites enabled?
-     * Bit 2: Sprite size. 0=8x8, 1=8x16
-     * Bit 3: Where to read the background tilemap? 0=0x9800 to 0x9BFF. 1=0x9C00 to 0x9FFF
-     * Bit 4: Where to read tileset? 0=0x8800 to 0x97FF. 1=0x8000 to 0x8FFF
-     * Bit 5: is the Window enabled?
-     * Bit 6: Where to read window tilemap? 0=0x9800 to 0x9BFF. 1=0x9C00 to 0x9FFF
-     * Bit 7: Is LCD powered on?
+     * Map VRAM pages. Tile data writes always go through the slow path, and the whole VRAM while watched.
      */
-    uint8 lcdControl = 0;
+    void mapVideoRAM();
 
-    const struct
-    {
-        const uint8 backgroundEnable = 1u << 0u;
-        const uint8 spritesEnable = 1u << 1u;
-        const uint8 spriteSize = 1u << 2u;
-        const uint8 backgroundTilemap = 1u << 3u;
-        const uint8 tileset = 1u << 4u;
-        const uint8 windowEnable = 1u << 5u;
-        const uint8 windowTilemap = 1u << 6u;
-        const uint8 lcdPower = 1u << 7u;
-    } lcdControlBits;
+    /**
+     * Map working RAM and echo RAM pages. Writes to pages protected by `protectCode` go through the slow path.
+     */
+    void mapWorkingRAM();
 
     /**
-     * Hold LCD current status and configure LCD interrupt.
-     *
-     * Read at 0xFF41: return value.
-     * Write at 0xFF41: write the value.
-     *
-     * Bit 1-0: Read only. 0: during H-BLANK, 1: during V-BLANK, 2: during OAM search, 3: during transfer data to LCD driver
-     * Bit 2: Read only. 1 if LYC=LY
-     * Bit 3: 1 to enable Mode 0 H-Blank interrupt
-     * Bit 4: 1 to enable Mode 1 V-Blank interrupt
-     * Bit 5: 1 to enable Mode 2 OAM interrupt
-     * Bit 6: 1 to enable LYC=LY interrupt
-     * Bit 7: unused and return 1.
+     * Dirty cartridge RAM is written to its save file every emulated second.
      */
-    uint8 STAT = 0;
+    static constexpr uint64 cartridgeFlushPeriod = 4194304;
 
-    const struct
-    {
-        const uint8 currentMode = 1u << 0u | 1u << 1u;
-        const uint8 currentModeHBlank = 0;
-        const uint8 currentModeVBlank = 1;
-        const uint8 currentModeOAM = 2;
-        const uint8 currentModeDataTransfer = 3;
-
-        const uint8 LYCEquality = 1u << 2u;
-        const uint8 HBlankInterruptEnable = 1u << 3u;
-        const uint8 VBlankInterruptEnable = 1u << 4u;
-        const uint8 OAMInterruptEnable = 1u << 5u;
-        const uint8 LYCInterruptEnable = 1u << 6u;
-        const uint8 alwaysHigh = 1u << 7u;
-    } STATBits;
+    static constexpr uint16 ioFirstAddress = 0xFF00;
+    static constexpr size_t ioRegisterCount = 0x80;
 
     /**
-     * Specify position Y to draw in the background.
-     *
-     * Read and write at 0xFF42: works.
+     * Handlers of I/O registers, indexed by address - `ioFirstAddress`. See `registerIO`.
      */
-    uint8 scrollY = 0;
+    std::array<IOReadHandler, ioRegisterCount> ioReadHandlers;
+    std::array<IOWriteHandler, ioRegisterCount> ioWriteHandlers;
 
     /**
-     * Specify position X to draw in the background.
-     *
-     * Read and write at 0xFF43: works.
+     * If different than 0, bios rom is disabled.
+     * Read at 0xFF50 return the value.
+     * Write of 1 at 0xFF50 write the value.
+     * Other writes are rejected.
      */
-    uint8 scrollX = 0;
+    uint8 biosRomDisabled = 0;
+
+    // TODO std::array
+    std::array<uint8, 0x2000> workingRAM;
+    // Working RAM pages holding cached code (bit n for page 0xC0 + n), and those written since, see `protectCode`
+    uint32 protectedCodePages = 0;
+    uint32 writtenCodePages = 0;
+    uint32 codeMappingChanges = 0;
+    // Only the first 0xA0 bytes are OAM. Remaining bytes complete the page and always read 0xFF.
+    std::array<uint8, pageSize> oamRAM;
+    // Set on each OAM write, cleared by the LCD once it read sprites
+    bool oamChanged = true;
+    std::array<uint8, 128> stackRAM;
+    std::array<uint8, 0x2000> videoRAM;
 
     /**
-     * LCD current line
-     * Hold the current line being drawn (TODO: possible values?)
-     * When LCD is off, it hold 0.
-     *
-     * Read at 0xFF44: return value.
-     * Write at 0xFF44: ignored.
+     * Decoded tiles of `videoRAM`, read by the LCD.
      */
-    uint8 LY = 0;
+    TileCache tileCache {videoRAM.data()};
 
     /**
-     * Trigger STAT interrupt when LY==LYC.
-     *
-     * Read at 0xFF45: return value.
-     * Write at 0xFF45: write value.
+     * See `watchVideoMemory`.
      */
-    uint8 LYC = 0;
+    VideoMemoryWriteHandler videoMemoryWatcher;
 
     /**
-     * Bit 1-0: shade for color 0
-     * Bit 3-2: shade for color 1
-     * Bit 5-4: shade for color 2
-     * Bit 7-6: shade for color 3
+     * Called before each write to VRAM or OAM: call and clear the watcher, if any.
+     */
+    void beforeVideoMemoryWrite()
+    {
+        if (videoMemoryWatcher)
+        {
+            const VideoMemoryWriteHandler handler = std::move(videoMemoryWatcher);
+            videoMemoryWatcher = nullptr;
+            mapVideoRAM();
+            handler();
+        }
+    }
+
+    /**
+     * Hold if an interrupt is requested
+     * Bit 0: Vertical blank interrupt [0x0040]
+     * Bit 1: LCD STAT interrupt [0x0048]
+     * Bit 2: Timer (TIMA) interrupt [0x0050]
+     * Bit 3: Serial interrupt [0x0058]
+     * Bit 4: Joypad interrupt [0x0060]
      *
-     * Shades:
-     * 0: white
-     * 1: light gray
-     * 2: dark gray
-     * 3: black
+     * CPU check these before each instructions.
      *
-     * Read and write at 0xFF47: works.
+     * Read at 0xFF0F return these five bits. Remaining bits are high.
+     * Write at 0xFF0F works. Last 3 bits are ignored.
      */
-    uint8 backgroundPalette = 0;
+    uint8 interruptRequest = 0;
 
     /**
-     * Same as 0xFF47 except for bit 1-0 which mean transparent therefore are ignored.
+     * Hold if interrupts are enabled. Same bit topology as `interruptRequest`.
+     * CPU check these before each instructions.
      *
-     * Read and write at 0xFF48: works.
+     * Read at 0xFFFF return these five bits. Remaining bits are high.
+     * Write at 0xFFFF set the value. Last 3 bits are ignored.
      */
-    uint8 objectPalette0 = 0;
+    uint8 interruptEnable = 0;
 
     /**
-     * Same as 0xFF47 except for bit 1-0 which mean transparent therefore are ignored.
-     *
-     * Read and write at 0xFF49: works.
+     * IE & IF, limited to the five interrupt bits.
+     * Updated each time `interruptRequest` or `interruptEnable` change.
      */
-    uint8 objectPalette1 = 0;
+    uint8 pendingInterruptsMask = 0;
+
+    void updatePendingInterrupts();
 
     /**
-     * Specify window Y position.
-     *
-     * Read and write at 0xFF4A: works.
+     * Copy OAM data from 0x[value]00 to OAM RAM, on write at 0xFF46.
+     * Data is copied at once, but the bus is locked for the duration of the transfer, until `Scheduler::Event::DMAEnd`.
      */
-    uint8 windowY = 0;
+    void startDMA(uint8 value);
+
+    static constexpr uint32 dmaDuration = 640;
+    static constexpr size_t oamSize = 0xA0;
+
+    bool dmaActive = false;
 
     /**
-     * Specify window X position minus 7.
-     *
-     * Read and write at 0xFF4B: works.
+     * Pages mapped while the bus is locked, put back by `unlockBus`.
      */
-    uint8 windowX = 0;
+    std::array<const uint8*, pageCount> busReadPages {};
+    std::array<uint8*, pageCount> busWritePages {};
+
+    /**
+     * Send accesses to everything but page 0xFF to the slow path, which rejects them during DMA.
+     */
+    void lockBus();
+    void unlockBus();
+
+public:
+    const struct
+    {
+        const uint8 verticalBlank = 1u << 0u;
+        const uint8 STAT = 1u << 1u;
+        const uint8 TIMA = 1u << 2u;
+        const uint8 serial = 1u << 3u;
+        const uint8 joypad = 1u << 4u;
+        const uint8 alwaysHigh = 1u << 5u | 1u << 6u | 1u << 7u;
+    } interruptBits;
+
+    const struct
+    {
+        const uint16 verticalBlank = 0x0040u;
+        const uint16 lcdStat = 0x0048u;
+        const uint16 TIMA = 0x0050u;
+        const uint16 serial = 0x0058u;
+        const uint16 joypad = 0x0060u;
+    } interruptAddress;
 };
 
 #endif //FRACTAL_VIRTUAL_MEMORY_H
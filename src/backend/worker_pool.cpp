@@ -0,0 +1,64 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(size_t threadCount)
+{
+    for (size_t index = 0; index < threadCount; ++index)
+    {
+        workers.emplace_back(&WorkerPool::work, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void WorkerPool::submit(Job job)
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobAvailable.notify_one();
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return jobs.empty() && runningJobs == 0; });
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+        {
+            // Stopping, and nothing left
+            return;
+        }
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        ++runningJobs;
+
+        lock.unlock();
+        job();
+        // What the job holds is released before it is reported done
+        job = nullptr;
+        lock.lock();
+
+        --runningJobs;
+        jobDone.notify_all();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef FRACTAL_WORKER_POOL_H
+#define FRACTAL_WORKER_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "../general.h"
+
+/**
+ * A fixed number of threads running jobs in submission order, as soon as a thread is free.
+ *
+ * Jobs left when the pool is destroyed still run before the threads stop.
+ */
+class WorkerPool
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit WorkerPool(size_t threadCount);
+    ~WorkerPool();
+
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    WorkerPool(const WorkerPool&) = delete;
+
+    [[nodiscard]] size_t threadCount() const { return workers.size(); }
+
+    void submit(Job job);
+
+    /**
+     * Wait until every job submitted is done.
+     */
+    void wait();
+
+private:
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable jobDone;
+    std::deque<Job> jobs;
+    size_t runningJobs = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void work();
+};
+
+#endif //FRACTAL_WORKER_POOL_H
@@ -0,0 +1,126 @@
+#ifndef FRACTAL_FILE_READER_MMAP_H
+#define FRACTAL_FILE_READER_MMAP_H
+
+#include <string>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FRACTAL_HAS_MMAP
+#else
+#include <fstream>
+#include <memory>
+#endif
+
+#include "../general.h"
+
+/**
+ * Map an unknown-size or big-size file in memory, making it available to be read.
+ *
+ * The mapping is read-only and private: it is backed by the OS page cache, so nothing is copied
+ * at startup, and every process mapping the same file share the same physical pages.
+ * The whole file is prefetched as game ROMs are small and read at random.
+ *
+ * The file must not be truncated while mapped: reading past its new end raises SIGBUS.
+ *
+ * On platforms without mmap, the file is read in a heap buffer instead.
+ */
+class FileReaderMmap
+{
+public:
+    // On top to initialize it first
+    const size_t fileSize;
+
+    // A non-mutable view of the data
+    const uint8 * const data;
+
+    /**
+     * If opening or mapping `filename` fail, the constructor will throw.
+     *
+     * @param filename path to the file to map in `data`
+     */
+    explicit FileReaderMmap(const std::string &filename) : FileReaderMmap(open(filename))
+    {}
+
+    FileReaderMmap& operator=(const FileReaderMmap&) = delete;
+    FileReaderMmap(const FileReaderMmap&) = delete;
+
+#ifdef FRACTAL_HAS_MMAP
+    ~FileReaderMmap()
+    {
+        munmap(const_cast<uint8*>(data), fileSize);
+    }
+#endif
+
+private:
+    struct Mapping
+    {
+        size_t size;
+        const uint8 *data;
+#ifndef FRACTAL_HAS_MMAP
+        std::unique_ptr<uint8[]> buffer;
+#endif
+    };
+
+#ifndef FRACTAL_HAS_MMAP
+    std::unique_ptr<uint8[]> buffer;
+#endif
+
+    explicit FileReaderMmap(Mapping &&mapping): fileSize(mapping.size), data(mapping.data)
+#ifndef FRACTAL_HAS_MMAP
+    , buffer(std::move(mapping.buffer))
+#endif
+    {}
+
+#ifdef FRACTAL_HAS_MMAP
+    static Mapping open(const std::string &filename)
+    {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::invalid_argument("Can not open file at given path");
+        }
+
+        struct stat status {};
+        if (fstat(fd, &status) != 0 || status.st_size <= 0)
+        {
+            close(fd);
+            throw std::invalid_argument("Can not read file at given path");
+        }
+        const size_t size = static_cast<size_t>(status.st_size);
+
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping keeps its own reference on the file
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            throw std::invalid_argument("Can not map file at given path");
+        }
+        madvise(mapped, size, MADV_WILLNEED);
+
+        return {size, static_cast<const uint8*>(mapped)};
+    }
+#else
+    static Mapping open(const std::string &filename)
+    {
+        std::ifstream fileStream(filename, std::ifstream::ate | std::ifstream::binary);
+        if (!fileStream.is_open())
+        {
+            throw std::invalid_argument("Can not open file at given path");
+        }
+
+        const size_t size = static_cast<size_t>(fileStream.tellg());
+        std::unique_ptr<uint8[]> buffer(new uint8[size]);
+        fileStream.seekg(0);
+        fileStream.read(reinterpret_cast<int8*>(buffer.get()), size);
+
+        const uint8 *data = buffer.get();
+        return {size, data, std::move(buffer)};
+    }
+#endif
+};
+
+#endif //FRACTAL_FILE_READER_MMAP_H
@@ -0,0 +1,98 @@
+#include <cstring>
+
+#include "rom_registry.h"
+
+static uint64 fnv1a(const uint8 *data, size_t size)
+{
+    uint64 hash = 0xCBF29CE484222325u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3u;
+    }
+    return hash;
+}
+
+static std::filesystem::file_time_type lastWriteTimeOf(const std::string &path)
+{
+    std::error_code error;
+    const std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+    return error ? std::filesystem::file_time_type::min() : time;
+}
+
+RomImage::RomImage(const std::string &path):
+file(path), contentHash(fnv1a(file.data, file.fileSize)), fileLastWriteTime(lastWriteTimeOf(path))
+{}
+
+RomRegistry &RomRegistry::shared()
+{
+    static RomRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<const RomImage> RomRegistry::acquire(const std::string &path)
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    // Already loaded from this path, and not changed since
+    const auto byPath = imagesByPath.find(path);
+    if (byPath != imagesByPath.end())
+    {
+        std::shared_ptr<const RomImage> image = byPath->second.lock();
+        if (image && lastWriteTimeOf(path) == image->lastWriteTime())
+        {
+            return image;
+        }
+    }
+
+    // About to load: drop entries of images freed since, so paths ever loaded do not pile up
+    forgetExpired();
+
+    auto image = std::make_shared<const RomImage>(path);
+    if (std::shared_ptr<const RomImage> sameContent = findSameContent(*image))
+    {
+        // Drop the new mapping, keep the one already shared
+        image = std::move(sameContent);
+    }
+    else
+    {
+        imagesByHash.emplace(image->hash(), image);
+    }
+    imagesByPath[path] = image;
+
+    return image;
+}
+
+std::shared_ptr<const RomImage> RomRegistry::findSameContent(const RomImage &image)
+{
+    const auto [first, last] = imagesByHash.equal_range(image.hash());
+    for (auto it = first; it != last;)
+    {
+        std::shared_ptr<const RomImage> candidate = it->second.lock();
+        if (!candidate)
+        {
+            // Last user is gone
+            it = imagesByHash.erase(it);
+            continue;
+        }
+        if (candidate->size() == image.size() && std::memcmp(candidate->data(), image.data(), image.size()) == 0)
+        {
+            return candidate;
+        }
+        ++it;
+    }
+    return nullptr;
+}
+
+
+void RomRegistry::forgetExpired()
+{
+    for (auto it = imagesByPath.begin(); it != imagesByPath.end();)
+    {
+        it = it->second.expired() ? imagesByPath.erase(it) : std::next(it);
+    }
+    for (auto it = imagesByHash.begin(); it != imagesByHash.end();)
+    {
+        it = it->second.expired() ? imagesByHash.erase(it) : std::next(it);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#ifndef FRACTAL_ROM_REGISTRY_H
+#define FRACTAL_ROM_REGISTRY_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <filesystem>
+#include <unordered_map>
+
+#include "../general.h"
+#include "file_reader_mmap.h"
+
+/**
+ * An immutable ROM file (BIOS or game) loaded in memory.
+ * It is shared between all emulator instances running it, see RomRegistry.
+ */
+class RomImage
+{
+public:
+    /**
+     * If opening `path` fail, the constructor will throw.
+     */
+    explicit RomImage(const std::string &path);
+
+    RomImage& operator=(const RomImage&) = delete;
+    RomImage(const RomImage&) = delete;
+
+    [[nodiscard]] const uint8 *data() const { return file.data; }
+    [[nodiscard]] size_t size() const { return file.fileSize; }
+
+    /**
+     * FNV-1a hash of the content.
+     */
+    [[nodiscard]] uint64 hash() const { return contentHash; }
+
+    /**
+     * Modification time of the file when it was loaded, to notice it changed on disk.
+     */
+    [[nodiscard]] std::filesystem::file_time_type lastWriteTime() const { return fileLastWriteTime; }
+
+private:
+    const FileReaderMmap file;
+    const uint64 contentHash;
+    const std::filesystem::file_time_type fileLastWriteTime;
+};
+
+/**
+ * Hand out ROM images, so N emulator instances running the same ROM cost one ROM's worth of memory
+ * and a single load.
+ *
+ * Images are reference counted: the registry only keeps weak references, an image is freed once
+ * the last instance using it is destroyed.
+ * They are keyed by path, to skip loading a file already loaded, and by content hash, to share
+ * the same ROM loaded from different paths.
+ *
+ * It is thread-safe.
+ */
+class RomRegistry
+{
+public:
+    /**
+     * Registry shared by the whole process.
+     */
+    static RomRegistry &shared();
+
+    /**
+     * Get the image of the file at `path`, loading it if no alive image hold it.
+     * A file changed on disk since it was loaded is loaded again.
+     *
+     * If opening `path` fail, it will throw.
+     */
+    [[nodiscard]] std::shared_ptr<const RomImage> acquire(const std::string &path);
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::weak_ptr<const RomImage>> imagesByPath;
+    std::unordered_multimap<uint64, std::weak_ptr<const RomImage>> imagesByHash;
+
+    /**
+     * Find an alive image with the same content as `image`.
+     */
+    [[nodiscard]] std::shared_ptr<const RomImage> findSameContent(const RomImage &image);
+
+    /**
+     * Erase entries of images whose last user is gone.
+     */
+    void forgetExpired();
+};
+
+#endif //FRACTAL_ROM_REGISTRY_H
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "save_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FRACTAL_HAS_MMAP
+#else
+#include <fstream>
+#include <filesystem>
+#include <set>
+#endif
+
+#ifdef FRACTAL_HAS_MMAP
+SaveFile::SaveFile(const std::string &path, size_t size): path(path), mappedSize(size)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        throw std::invalid_argument("Can not open save file at given path");
+    }
+    // Two writers would overwrite each other's saves
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(fd);
+        throw std::invalid_argument("Save file is already used by another instance");
+    }
+
+    struct stat status {};
+    if (fstat(fd, &status) != 0)
+    {
+        close(fd);
+        throw std::invalid_argument("Can not read save file at given path");
+    }
+    const size_t fileSize = static_cast<size_t>(status.st_size);
+    if (fileSize < size && ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        close(fd);
+        throw std::invalid_argument("Can not resize save file at given path");
+    }
+
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        close(fd);
+        throw std::invalid_argument("Can not map save file at given path");
+    }
+    mapped = static_cast<uint8*>(address);
+
+    // Fresh RAM reads high
+    if (fileSize < size)
+    {
+        std::memset(mapped + fileSize, 0xFF, size - fileSize);
+    }
+
+    worker = std::thread(&SaveFile::work, this);
+}
+#else
+SaveFile::SaveFile(const std::string &path, size_t size): path(path), mappedSize(size), buffer(size, 0xFF)
+{
+    acquire(path);
+
+    {
+        std::ifstream fileStream(path, std::ifstream::binary);
+        fileStream.read(reinterpret_cast<int8*>(buffer.data()), size);
+    }
+
+    // Create the file, or complete it
+    std::fstream fileStream(path, std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::ate);
+    if (!fileStream.is_open())
+    {
+        fileStream.open(path, std::fstream::binary | std::fstream::out);
+    }
+    if (!fileStream.is_open())
+    {
+        release(path);
+        throw std::invalid_argument("Can not open save file at given path");
+    }
+    if (static_cast<size_t>(fileStream.tellp()) < size)
+    {
+        fileStream.seekp(0);
+        fileStream.write(reinterpret_cast<int8*>(buffer.data()), size);
+    }
+
+    mapped = buffer.data();
+    worker = std::thread(&SaveFile::work, this);
+}
+
+static std::mutex usedPathsMutex;
+static std::set<std::string> usedPaths;
+
+/**
+ * Same key for all paths of a file, as far as they can be resolved.
+ */
+static std::string usedPathKey(const std::string &path)
+{
+    std::error_code error;
+    const std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    return error ? path : canonical.string();
+}
+
+void SaveFile::acquire(const std::string &path)
+{
+    const std::lock_guard<std::mutex> lock(usedPathsMutex);
+    // Two writers would overwrite each other's saves
+    if (!usedPaths.insert(usedPathKey(path)).second)
+    {
+        throw std::invalid_argument("Save file is already used by another instance");
+    }
+}
+
+void SaveFile::release(const std::string &path)
+{
+    const std::lock_guard<std::mutex> lock(usedPathsMutex);
+    usedPaths.erase(usedPathKey(path));
+}
+#endif
+
+SaveFile::~SaveFile()
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_one();
+    worker.join();
+
+    // Whatever was not flushed yet
+#ifdef FRACTAL_HAS_MMAP
+    msync(mapped, mappedSize, MS_SYNC);
+    munmap(mapped, mappedSize);
+    // Releases the lock
+    close(fd);
+#else
+    write({{0, mappedSize}, buffer});
+    release(path);
+#endif
+}
+
+void SaveFile::flush(const std::vector<Range> &ranges)
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        for (const Range &range : ranges)
+        {
+#ifdef FRACTAL_HAS_MMAP
+            jobs.push_back({range, {}});
+#else
+            // The emulation keeps writing the buffer: the worker writes a copy
+            jobs.push_back({range, std::vector<uint8>(mapped + range.offset, mapped + range.offset + range.length)});
+#endif
+        }
+    }
+    jobAvailable.notify_one();
+}
+
+void SaveFile::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+        {
+            // Stopping, and nothing left
+            return;
+        }
+
+        const Job job = std::move(jobs.front());
+        jobs.pop_front();
+
+        lock.unlock();
+        write(job);
+        lock.lock();
+    }
+}
+
+void SaveFile::write(const Job &job)
+{
+#ifdef FRACTAL_HAS_MMAP
+    // msync wants a page aligned address
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t start = job.range.offset / pageSize * pageSize;
+    const size_t end = std::min(job.range.offset + job.range.length, mappedSize);
+    msync(mapped + start, end - start, MS_SYNC);
+#else
+    std::fstream fileStream(path, std::fstream::binary | std::fstream::in | std::fstream::out);
+    fileStream.seekp(static_cast<std::streamoff>(job.range.offset));
+    fileStream.write(reinterpret_cast<const int8*>(job.bytes.data()), job.bytes.size());
+#endif
+}
@@ -0,0 +1,94 @@
+#ifndef FRACTAL_SAVE_FILE_H
+#define FRACTAL_SAVE_FILE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../general.h"
+
+/**
+ * A writable file mapped in memory, for battery-backed cartridge RAM.
+ *
+ * The emulation thread reads and writes `data()` directly. It tells which ranges changed with `flush`,
+ * which returns at once: ranges are written to disk by a worker thread, so saving never stalls emulation.
+ * Everything left is written when the SaveFile is destroyed.
+ *
+ * On POSIX systems the file is mapped shared, so `data()` is the page cache itself: flushing is only
+ * an msync of the changed ranges. Elsewhere, `data()` is a heap buffer and changed ranges are copied
+ * when flushed, then written by the worker.
+ *
+ * A file has a single writer: opening a file already used by another SaveFile throws. On POSIX systems
+ * the file is locked, which also catches other processes. Elsewhere, only SaveFiles of this process are.
+ */
+class SaveFile
+{
+public:
+    struct Range
+    {
+        size_t offset;
+        size_t length;
+    };
+
+    /**
+     * Open the file at `path`, creating it if needed. Bytes not in the file yet are 0xFF.
+     * If the file can not be opened or mapped, or is already used by another SaveFile, the constructor will throw.
+     *
+     * @param path path of the save file
+     * @param size bytes to map. A longer file is kept as is, only its first `size` bytes are mapped.
+     */
+    explicit SaveFile(const std::string &path, size_t size);
+    ~SaveFile();
+
+    SaveFile& operator=(const SaveFile&) = delete;
+    SaveFile(const SaveFile&) = delete;
+
+    [[nodiscard]] uint8 *data() { return mapped; }
+    [[nodiscard]] size_t size() const { return mappedSize; }
+
+    /**
+     * Write `ranges` to disk, asynchronously.
+     */
+    void flush(const std::vector<Range> &ranges);
+
+private:
+    const std::string path;
+    const size_t mappedSize;
+    uint8 *mapped = nullptr;
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Kept open to hold the lock on the file
+    int fd = -1;
+#else
+    std::vector<uint8> buffer;
+
+    /**
+     * Register `path` as used by this SaveFile, or throw if another one uses it.
+     */
+    static void acquire(const std::string &path);
+    static void release(const std::string &path);
+#endif
+
+    /**
+     * A range to write, with a copy of its bytes if the file is not mapped.
+     */
+    struct Job
+    {
+        Range range;
+        std::vector<uint8> bytes;
+    };
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::thread worker;
+
+    void work();
+    void write(const Job &job);
+};
+
+#endif //FRACTAL_SAVE_FILE_H
@@ -1,7 +1,9 @@
 #ifndef FRACTAL_DISPLAY_H
 #define FRACTAL_DISPLAY_H
 
+#include <array>
 #include <vector>
+#include <algorithm>
 
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
@@ -16,21 +18,39 @@ using namespace EmulatorConstants;
 class Display : public IDisplay, public IInput
 {
 public:
-    Display() : window(sf::VideoMode(windowSize.x * 4, windowSize.y * 4), "DMG")
+    /**
+     * RGBA color of each shade, from white (0) to black (3).
+     */
+    using Palette = std::array<std::array<uint8, 4>, 4>;
+
+    static constexpr Palette grayPalette =
+    {{
+        {{255, 255, 255, 255}},
+        {{192, 192, 192, 255}},
+        {{96, 96, 96, 255}},
+        {{0, 0, 0, 255}}
+    }};
+
+    explicit Display(const Palette &palette = grayPalette) :
+    window(sf::VideoMode(windowSize.x * 4, windowSize.y * 4), "DMG"), palette(palette)
     {
         tex.create(160, 144);
     }
 
-    void newFrameIsReady(const std::vector<uint8> &frame) override
+    /**
+     * Colors used from the next frame on.
+     */
+    void setPalette(const Palette &colors)
     {
-        pollEvents();
+        palette = colors;
+    }
 
-        for (size_t i = 0, j = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT * 3; i += 3, j += 4)
+    void newFrameIsReady(const std::vector<uint8> &frame) override
+    {
+        for (size_t i = 0, j = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i, j += 4)
         {
-            RGBAFrame[j + 0] = frame[i + 0];
-            RGBAFrame[j + 1] = frame[i + 1];
-            RGBAFrame[j + 2] = frame[i + 2];
-            RGBAFrame[j + 3] = 255;
+            const std::array<uint8, 4> &color = palette[frame[i] & shadeBits];
+            std::copy(color.begin(), color.end(), RGBAFrame.begin() + j);
         }
 
         tex.update(RGBAFrame.data());
@@ -41,6 +61,12 @@ public:
         window.display();
     }
 
+    // Window events and keyboard are checked every frame, even when it is skipped
+    void frameEnded() override
+    {
+        pollEvents();
+    }
+
 private:
     sf::Vector2i windowSize = sf::Vector2i(160, 144);
     sf::RenderWindow window;
@@ -48,6 +74,8 @@ private:
     // Pixels as RGBA
     std::vector<uint8> RGBAFrame = std::vector<uint8>(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
 
+    Palette palette;
+
     void pollEvents()
     {
         sf::Event event{};
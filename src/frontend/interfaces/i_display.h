@@ -14,14 +14,29 @@ public:
     /**
     * This function get called when a new frame have been generated.
     *
-    * Vector length will always be length `69120`: 160 * 144 * 3 (RGB).
+    * Vector length will always be length `23040`: 160 * 144, one byte per pixel.
+    * Each pixel holds its shade in `shadeBits`, from 0 (white) to 3 (black), and `backgroundOpaqueBit`
+    * if the background or window under it is not transparent (palette index other than 0).
+    * It is up to the display to pick the color of each shade, usually with a 4 entries lookup table.
+    *
     * The given vector will always be the same. If you need to long-live the frame,
-    * you may need to copy it. According to your display implementation you may also need to copy
-    * the vector and add the alpha component (RGBA).
+    * you may need to copy it.
     *
     * @param frame Frame' pixels as described above.
     */
     virtual void newFrameIsReady(const std::vector<uint8> &frame) = 0;
+
+    /**
+    * This function get called once per emulated frame, on entering VBLANK, even for frames skipped
+    * (see LCD::setFrameSkip) which are never given to `newFrameIsReady`.
+    *
+    * It is the place for per-frame work which must not depend on frames being shown, like pumping
+    * window events and refreshing the buttons status.
+    */
+    virtual void frameEnded() {}
+
+    static constexpr uint8 shadeBits = 1u << 0u | 1u << 1u;
+    static constexpr uint8 backgroundOpaqueBit = 1u << 2u;
 };
 
 #endif //FRACTAL_I_DISPLAY_H
@@ -12,6 +12,9 @@ typedef short int16;
 typedef unsigned int uint32;
 typedef int int32;
 
+typedef unsigned long long uint64;
+typedef long long int64;
+
 namespace EmulatorConstants
 {
     constexpr int SCREEN_WIDTH = 160;
@@ -36,6 +39,26 @@ struct Vector2i
     return static_cast<uint16>(b1) + (static_cast<uint16>(b2) << 8u);
 }
 
+/**
+ * Index of the lowest bit set.
+ *
+ * @param value value to scan, must not be 0
+ * @return index of the lowest bit set
+ */
+[[nodiscard]] [[maybe_unused]] static uint8 lowestSetBit(const uint32 value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint8>(__builtin_ctz(value));
+#else
+    uint8 index = 0;
+    while ((value & (1u << index)) == 0)
+    {
+        ++index;
+    }
+    return index;
+#endif
+}
+
 template <typename Numeric>
 [[nodiscard]] constexpr Numeric rol(Numeric val)
 {
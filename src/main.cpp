@@ -32,8 +32,10 @@ int main(int argc, char **argv)
     // They must have same lifetime as the application
     Display display;
 
-    Motherboard motherboard(biosROM, gameROM, display, display);
+    Motherboard motherboard(biosROM, gameROM, display, display, Motherboard::savePathOf(gameROM));
     motherboard.run();
 
-    return 0;
+    std::cerr << std::hex << "Crash at PC=0x" << motherboard.cpu.crashPC()
+              << ", opcode=0x" << +motherboard.cpu.crashOpcode() << std::endl;
+    return 1;
 }
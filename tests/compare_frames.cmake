@@ -0,0 +1,33 @@
+# Render the same ROMs with each scanline build and compare their frames with the scalar build.
+#
+# Expected variables:
+# RENDERERS: render_frames executables, separated by '|', the first one is the scalar reference
+# BIOS, ROMS (separated by '|'), FRAMES: what to render
+# OUTPUT_DIR: where frame hashes are written
+
+string(REPLACE "|" ";" RENDERERS "${RENDERERS}")
+string(REPLACE "|" ";" ROMS "${ROMS}")
+
+set(REFERENCE "")
+foreach (RENDERER IN LISTS RENDERERS)
+    get_filename_component(NAME "${RENDERER}" NAME_WE)
+    set(OUTPUT "${OUTPUT_DIR}/${NAME}.txt")
+    execute_process(COMMAND "${RENDERER}" "${BIOS}" "${OUTPUT}" "${FRAMES}" ${ROMS}
+                    RESULT_VARIABLE RESULT OUTPUT_QUIET)
+    if (RESULT EQUAL 77)
+        message(STATUS "${NAME}: skipped, the host can not run it")
+        continue()
+    elseif (NOT RESULT EQUAL 0)
+        message(FATAL_ERROR "${NAME}: rendering failed (${RESULT})")
+    endif()
+
+    if (REFERENCE STREQUAL "")
+        set(REFERENCE "${OUTPUT}")
+        continue()
+    endif()
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${REFERENCE}" "${OUTPUT}" RESULT_VARIABLE DIFFERENT)
+    if (DIFFERENT)
+        message(FATAL_ERROR "${NAME}: frames differ from ${REFERENCE}")
+    endif()
+    message(STATUS "${NAME}: same frames as the scalar build")
+endforeach()
@@ -0,0 +1,73 @@
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/backend/motherboard.h"
+
+/**
+ * Exit code telling `compare_frames.cmake` the host can not run this build.
+ */
+static constexpr int skipped = 77;
+
+/**
+ * Write a FNV-1a hash of each frame, one line per frame.
+ */
+class FrameHasher : public IDisplay, public IInput
+{
+public:
+    explicit FrameHasher(std::ostream &output, const std::string &name) : output(output), name(name)
+    {};
+
+    void newFrameIsReady(const std::vector<uint8> &frame) override
+    {
+        uint64 hash = 0xCBF29CE484222325u;
+        for (const uint8 pixel : frame)
+        {
+            hash ^= pixel;
+            hash *= 0x100000001B3u;
+        }
+        output << name << ' ' << frames++ << ' ' << std::hex << hash << std::dec << '\n';
+    }
+
+private:
+    std::ostream &output;
+    const std::string name;
+    uint64 frames = 0;
+};
+
+/**
+ * Render ROMs for a fixed number of frames and write the hash of every frame, so builds of the
+ * scanline code with different instruction sets can be compared, see `compare_frames.cmake`.
+ *
+ * Usage: render_frames BIOS OUTPUT FRAMES ROM...
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        std::cerr << "Usage: " << argv[0] << " BIOS OUTPUT FRAMES ROM..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+#if defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+    if (!__builtin_cpu_supports("avx2"))
+    {
+        std::cerr << "Host has no AVX2" << std::endl;
+        return skipped;
+    }
+#endif
+
+    std::ofstream output(argv[2]);
+    const auto frames = static_cast<uint32>(std::strtoul(argv[3], nullptr, 10));
+    for (int rom = 4; rom < argc; ++rom)
+    {
+        FrameHasher display(output, std::filesystem::path(argv[rom]).filename().string());
+        Motherboard motherboard(RomRegistry::shared().acquire(argv[1]), RomRegistry::shared().acquire(argv[rom]), display, display);
+        motherboard.runFrames(frames);
+    }
+
+    return output ? EXIT_SUCCESS : EXIT_FAILURE;
+}